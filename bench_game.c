@@ -0,0 +1,454 @@
+// memfd_create()
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "game.h"
+#include "utils_v3.h"
+
+/**
+ * Micro-benchmarks of the game logic (game.c). They are deterministic: every
+ * map is played with the same pseudo-random key presses, and every run of an
+ * operation starts from the same state. The messages go to in-memory sinks:
+ * a MessageBuffer, or a memfd for the functions which write on a file
+ * descriptor. No socket is involved.
+ *
+ * For each map and operation, the results are printed in JSON on the
+ * standard output:
+ *   ns_per_op            the best run,
+ *   allocs_per_op        the calls to malloc, calloc and realloc (wrapped at
+ *                        link time, see the bench target of the Makefile),
+ *   alloc_bytes_per_op   the bytes they asked for,
+ *   instructions_per_op  the user space instructions of the best run, null
+ *                        when perf_event_open is not available.
+ * followed by the memory taken by the game state of a room on each map:
+ *   state_bytes           with the board packed in bitboards,
+ *   unpacked_state_bytes  with one enum Item per tile, as the board used to
+ *                         be stored.
+ *
+ * usage: bench_game [-n iterations] [-r runs] <map.txt>...
+ */
+
+#define DEFAULT_ITERATIONS 200000
+#define DEFAULT_RUNS 5
+#define SEED 0x2545f491u
+// The memfd sinks are rewound every SINK_REWIND operations: they stay small.
+#define SINK_REWIND 4096
+
+// The send_* functions of game.c are left out of game.h (see its
+// pseudo-header), they are declared here the same way.
+void send_spawn_item(const struct GameState *state, uint32_t x, uint32_t y,
+                     enum Item item, FileDescriptor fdbcast);
+void send_player_moved(const struct GameState *state, enum Item player,
+                       struct Position to, FileDescriptor fdbcast);
+void send_eat_food(const struct GameState *state, enum Item player,
+                   enum Item food, struct Position to, FileDescriptor fdbcast);
+void send_game_over(enum Item winner, FileDescriptor fdbcast);
+
+//*****************************************************************************
+// ALLOCATIONS (-Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc)
+//*****************************************************************************
+
+static uint64_t __allocs = 0;
+static uint64_t __alloc_bytes = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size) {
+  __allocs++;
+  __alloc_bytes += size;
+  return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size) {
+  __allocs++;
+  __alloc_bytes += nmemb * size;
+  return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+  __allocs++;
+  __alloc_bytes += size;
+  return __real_realloc(ptr, size);
+}
+
+//*****************************************************************************
+// INSTRUCTIONS
+//*****************************************************************************
+
+// RES: a disabled counter of the user space instructions of the process, -1
+//      if perf_event_open is not available (kernel, container, paranoia).
+static int __open_instructions(void) {
+  struct perf_event_attr attr = {.type = PERF_TYPE_HARDWARE,
+                                 .size = sizeof(attr),
+                                 .config = PERF_COUNT_HW_INSTRUCTIONS,
+                                 .disabled = 1,
+                                 .exclude_kernel = 1,
+                                 .exclude_hv = 1};
+  return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static uint64_t __read_counter(int fd) {
+  uint64_t count = 0;
+  if (read(fd, &count, sizeof(count)) != sizeof(count)) {
+    return 0;
+  }
+  return count;
+}
+
+//*****************************************************************************
+// OPERATIONS
+//*****************************************************************************
+
+struct Fixture {
+  const char *path;
+  // the text of the map, read again by load_map
+  FileDescriptor map;
+  // where the functions writing on a file descriptor write
+  FileDescriptor sink;
+  struct MessageBuffer out;
+  // the map as loaded, and the state played from it
+  struct GameState *initial;
+  struct GameState *state;
+  uint32_t rng;
+  uint32_t tiles;
+};
+
+// xorshift32: the same key presses on every run.
+static uint32_t __next_random(struct Fixture *f) {
+  f->rng ^= f->rng << 13;
+  f->rng ^= f->rng >> 17;
+  f->rng ^= f->rng << 5;
+  return f->rng;
+}
+
+static struct Position __tile_position(const struct Fixture *f, long i) {
+  uint32_t index = (uint32_t)(i % f->tiles);
+  return (struct Position){.x = index % f->initial->width,
+                           .y = index / f->initial->width};
+}
+
+static void __op_load_map(struct Fixture *f, long i) {
+  lseek(f->map, 0, SEEK_SET);
+  lseek(f->sink, 0, SEEK_SET);
+  free(load_map(f->map, f->sink));
+}
+
+static void __op_load_map_buf(struct Fixture *f, long i) {
+  lseek(f->map, 0, SEEK_SET);
+  message_buffer_clear(&f->out);
+  free(load_map_buf(f->map, &f->out));
+}
+
+static void __op_reset_gamestate(struct Fixture *f, long i) {
+  reset_gamestate(f->state);
+}
+
+// A match which ends starts again from the map.
+static void __op_process_user_command(struct Fixture *f, long i) {
+  if (i % SINK_REWIND == 0) {
+    lseek(f->sink, 0, SEEK_SET);
+  }
+  enum Item player = i % 2 == 0 ? PLAYER1 : PLAYER2;
+  enum Direction dir = (enum Direction)(__next_random(f) % 4);
+  if (process_user_command(f->state, player, dir, f->sink)) {
+    gamestate_copy(f->state, f->initial);
+  }
+}
+
+static void __op_process_user_command_buf(struct Fixture *f, long i) {
+  message_buffer_clear(&f->out);
+  enum Item player = i % 2 == 0 ? PLAYER1 : PLAYER2;
+  enum Direction dir = (enum Direction)(__next_random(f) % 4);
+  if (process_user_command_buf(f->state, player, dir, &f->out)) {
+    gamestate_copy(f->state, f->initial);
+  }
+}
+
+static void __op_send_registered(struct Fixture *f, long i) {
+  if (i % SINK_REWIND == 0) {
+    lseek(f->sink, 0, SEEK_SET);
+  }
+  send_registered(i % 2 + 1, f->sink);
+}
+
+static void __op_send_spawn_item(struct Fixture *f, long i) {
+  if (i % SINK_REWIND == 0) {
+    lseek(f->sink, 0, SEEK_SET);
+  }
+  struct Position pos = __tile_position(f, i);
+  send_spawn_item(f->state, pos.x, pos.y, FOOD, f->sink);
+}
+
+static void __op_send_player_moved(struct Fixture *f, long i) {
+  if (i % SINK_REWIND == 0) {
+    lseek(f->sink, 0, SEEK_SET);
+  }
+  send_player_moved(f->state, i % 2 == 0 ? PLAYER1 : PLAYER2,
+                    __tile_position(f, i), f->sink);
+}
+
+static void __op_send_eat_food(struct Fixture *f, long i) {
+  if (i % SINK_REWIND == 0) {
+    lseek(f->sink, 0, SEEK_SET);
+  }
+  send_eat_food(f->state, i % 2 == 0 ? PLAYER1 : PLAYER2, FOOD,
+                __tile_position(f, i), f->sink);
+}
+
+static void __op_send_game_over(struct Fixture *f, long i) {
+  if (i % SINK_REWIND == 0) {
+    lseek(f->sink, 0, SEEK_SET);
+  }
+  send_game_over(i % 2 == 0 ? PLAYER1 : PLAYER2, f->sink);
+}
+
+struct Operation {
+  const char *name;
+  void (*run)(struct Fixture *f, long i);
+  // an operation this much slower runs this many times fewer iterations
+  int divisor;
+};
+
+static const struct Operation __operations[] = {
+    {"load_map", __op_load_map, 100},
+    {"load_map_buf", __op_load_map_buf, 100},
+    {"reset_gamestate", __op_reset_gamestate, 1},
+    {"process_user_command", __op_process_user_command, 4},
+    {"process_user_command_buf", __op_process_user_command_buf, 1},
+    {"send_registered", __op_send_registered, 4},
+    {"send_spawn_item", __op_send_spawn_item, 4},
+    {"send_player_moved", __op_send_player_moved, 4},
+    {"send_eat_food", __op_send_eat_food, 4},
+    {"send_game_over", __op_send_game_over, 4},
+};
+
+#define NB_OPERATIONS (sizeof(__operations) / sizeof(*__operations))
+
+//*****************************************************************************
+// HARNESS
+//*****************************************************************************
+
+struct Result {
+  long iterations;
+  double ns_per_op;
+  double allocs_per_op;
+  double alloc_bytes_per_op;
+  // < 0 without perf_event_open
+  double instructions_per_op;
+};
+
+// Memory taken by the game state of a room on a map.
+struct MapMemory {
+  const char *path;
+  size_t state_bytes;
+  size_t unpacked_state_bytes;
+};
+
+static double __now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Every run starts from the map as loaded, with the same key presses.
+static void __rewind(struct Fixture *f) {
+  gamestate_copy(f->state, f->initial);
+  f->rng = SEED;
+  lseek(f->sink, 0, SEEK_SET);
+  message_buffer_clear(&f->out);
+}
+
+static struct Result __bench(struct Fixture *f, const struct Operation *op,
+                             long iterations, int runs, int perf) {
+  struct Result result = {.iterations = iterations / op->divisor,
+                          .ns_per_op = -1,
+                          .instructions_per_op = -1};
+  if (result.iterations < 1) {
+    result.iterations = 1;
+  }
+  // warm up the caches and the sinks
+  __rewind(f);
+  for (long i = 0; i < result.iterations / 10 + 1; i++) {
+    op->run(f, i);
+  }
+
+  uint64_t allocs = 0;
+  uint64_t alloc_bytes = 0;
+  for (int r = 0; r < runs; r++) {
+    __rewind(f);
+    uint64_t allocs_before = __allocs;
+    uint64_t bytes_before = __alloc_bytes;
+    if (perf >= 0) {
+      ioctl(perf, PERF_EVENT_IOC_RESET, 0);
+      ioctl(perf, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    double start = __now();
+    for (long i = 0; i < result.iterations; i++) {
+      op->run(f, i);
+    }
+    double elapsed = __now() - start;
+    if (perf >= 0) {
+      ioctl(perf, PERF_EVENT_IOC_DISABLE, 0);
+    }
+    allocs += __allocs - allocs_before;
+    alloc_bytes += __alloc_bytes - bytes_before;
+
+    double ns_per_op = elapsed * 1e9 / result.iterations;
+    if (result.ns_per_op < 0 || ns_per_op < result.ns_per_op) {
+      result.ns_per_op = ns_per_op;
+      if (perf >= 0) {
+        result.instructions_per_op =
+            (double)__read_counter(perf) / result.iterations;
+      }
+    }
+  }
+  result.allocs_per_op = (double)allocs / runs / result.iterations;
+  result.alloc_bytes_per_op = (double)alloc_bytes / runs / result.iterations;
+  return result;
+}
+
+// RES: false if 'path' is not a text map.
+static bool __fixture_init(struct Fixture *f, const char *path) {
+  FileDescriptor fd = sopen(path, O_RDONLY, 0);
+  f->path = path;
+  f->map = memfd_create("bench_game_map", 0);
+  checkNeg(f->map, "Error memfd_create");
+  char buf[4096];
+  ssize_t n;
+  while ((n = sread(fd, buf, sizeof(buf))) > 0) {
+    nwrite(f->map, buf, n);
+  }
+  sclose(fd);
+  f->sink = memfd_create("bench_game_sink", 0);
+  checkNeg(f->sink, "Error memfd_create");
+  // sized by load_map_buf for the spawn stream of the map
+  message_buffer_init(&f->out, 1);
+
+  lseek(f->map, 0, SEEK_SET);
+  f->initial = load_map_buf(f->map, &f->out);
+  if (f->initial == NULL || f->initial->width == 0 ||
+      f->initial->height == 0) {
+    // the map is skipped: nothing of the fixture is kept
+    sclose(f->map);
+    sclose(f->sink);
+    message_buffer_free(&f->out);
+    free(f->initial);
+    return false;
+  }
+  f->tiles = f->initial->width * f->initial->height;
+  f->state = gamestate_create(f->initial->width, f->initial->height);
+  return true;
+}
+
+static void __fixture_free(struct Fixture *f) {
+  sclose(f->map);
+  sclose(f->sink);
+  message_buffer_free(&f->out);
+  free(f->initial);
+  free(f->state);
+}
+
+// Writes 'value' as a JSON string (the paths are the only strings).
+static void __print_string(const char *value) {
+  putchar('"');
+  for (; *value != '\0'; value++) {
+    if (*value == '"' || *value == '\\') {
+      putchar('\\');
+    }
+    putchar(*value);
+  }
+  putchar('"');
+}
+
+int main(int argc, char *argv[]) {
+  long iterations = DEFAULT_ITERATIONS;
+  int runs = DEFAULT_RUNS;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:r:")) != -1) {
+    switch (opt) {
+    case 'n':
+      iterations = atol(optarg);
+      break;
+    case 'r':
+      runs = atoi(optarg);
+      break;
+    default:
+      iterations = 0;
+      break;
+    }
+  }
+  if (iterations <= 0 || runs <= 0 || optind == argc) {
+    fprintf(stderr, "Usage: %s [-n iterations] [-r runs] <map.txt>...\n",
+            argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  int perf = __open_instructions();
+  printf("{\n  \"benchmark\": \"bench_game\",\n");
+  printf("  \"iterations\": %ld,\n  \"runs\": %d,\n", iterations, runs);
+  printf("  \"instructions\": %s,\n", perf >= 0 ? "true" : "false");
+  printf("  \"results\": [");
+  struct MapMemory *memory = smalloc(argc * sizeof(struct MapMemory));
+  int nb_maps = 0;
+  bool first = true;
+  for (int m = optind; m < argc; m++) {
+    struct Fixture fixture;
+    if (!__fixture_init(&fixture, argv[m])) {
+      fprintf(stderr, "Not a text map, skipped: %s\n", argv[m]);
+      continue;
+    }
+    uint32_t width = fixture.initial->width;
+    uint32_t height = fixture.initial->height;
+    memory[nb_maps++] = (struct MapMemory){
+        .path = fixture.path,
+        .state_bytes = gamestate_size(width, height),
+        .unpacked_state_bytes = sizeof(struct GameState) +
+                                (size_t)width * height * sizeof(enum Item)};
+    for (size_t o = 0; o < NB_OPERATIONS; o++) {
+      const struct Operation *op = &__operations[o];
+      struct Result result = __bench(&fixture, op, iterations, runs, perf);
+      printf("%s\n    {\"map\": ", first ? "" : ",");
+      __print_string(fixture.path);
+      printf(", \"width\": %u, \"height\": %u, \"op\": \"%s\", "
+             "\"iterations\": %ld, \"ns_per_op\": %.2f, "
+             "\"allocs_per_op\": %.4f, \"alloc_bytes_per_op\": %.1f, "
+             "\"instructions_per_op\": ",
+             fixture.initial->width, fixture.initial->height, op->name,
+             result.iterations, result.ns_per_op, result.allocs_per_op,
+             result.alloc_bytes_per_op);
+      if (result.instructions_per_op < 0) {
+        printf("null}");
+      } else {
+        printf("%.1f}", result.instructions_per_op);
+      }
+      first = false;
+    }
+    __fixture_free(&fixture);
+  }
+  printf("\n  ],\n  \"maps\": [");
+  for (int m = 0; m < nb_maps; m++) {
+    printf("%s\n    {\"map\": ", m == 0 ? "" : ",");
+    __print_string(memory[m].path);
+    printf(", \"state_bytes\": %zu, \"unpacked_state_bytes\": %zu}",
+           memory[m].state_bytes, memory[m].unpacked_state_bytes);
+  }
+  printf("\n  ]\n}\n");
+  free(memory);
+  if (perf >= 0) {
+    close(perf);
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,155 @@
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "game.h"
+#include "msg_ring.h"
+#include "utils_v3.h"
+
+/**
+ * Compares the two ways the client handlers can pass their messages to the
+ * broadcaster: the pipe (one write per command) and the message ring in
+ * shared memory (see msg_ring.h). Each producer process publishes the
+ * messages of 'commands' commands, 'batch' messages per command, while the
+ * consumer reads them the way the broadcaster does.
+ *
+ * usage: bench_ipc [<producers> [<commands> [<batch>]]]
+ */
+
+#define DEFAULT_PRODUCERS 2
+#define DEFAULT_COMMANDS 200000
+#define DEFAULT_BATCH 2
+#define MAX_BATCH 16
+#define READ_MESSAGES 1024
+
+static double __now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void __fill(union Message *msgs, int producer, int batch) {
+  for (int i = 0; i < batch; i++) {
+    msgs[i] = (union Message){.movement = {.msgt = MOVEMENT,
+                                           .id = producer,
+                                           .pos = {i, producer}}};
+  }
+}
+
+static double __bench_pipe(int producers, int commands, int batch) {
+  int pipefd[2];
+  spipe(pipefd);
+  // the producers must not inherit what stdout holds
+  fflush(stdout);
+  double start = __now();
+  for (int p = 0; p < producers; p++) {
+    if (sfork() == 0) {
+      sclose(pipefd[0]);
+      union Message msgs[MAX_BATCH];
+      __fill(msgs, p, batch);
+      for (int c = 0; c < commands; c++) {
+        nwrite(pipefd[1], msgs, batch * sizeof(union Message));
+      }
+      exit(EXIT_SUCCESS);
+    }
+  }
+  sclose(pipefd[1]);
+
+  static union Message buf[READ_MESSAGES];
+  size_t expected = (size_t)producers * commands * batch * sizeof(buf[0]);
+  size_t received = 0;
+  ssize_t n;
+  while ((n = sread(pipefd[0], buf, sizeof(buf))) > 0) {
+    received += n;
+  }
+  double elapsed = __now() - start;
+  sclose(pipefd[0]);
+  while (wait(NULL) > 0) {
+  }
+  if (received != expected) {
+    fprintf(stderr, "pipe: %zu bytes received, %zu expected\n", received,
+            expected);
+    exit(EXIT_FAILURE);
+  }
+  return elapsed;
+}
+
+static double __bench_ring(int producers, int commands, int batch) {
+  size_t size = msg_ring_size(MSG_RING_DEFAULT_CAPACITY);
+  struct MsgRing *ring = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (ring == MAP_FAILED) {
+    perror("Error mmap");
+    exit(EXIT_FAILURE);
+  }
+  msg_ring_init(ring, MSG_RING_DEFAULT_CAPACITY);
+  FileDescriptor doorbell = eventfd(0, EFD_NONBLOCK);
+  checkNeg(doorbell, "Error eventfd");
+
+  fflush(stdout);
+  double start = __now();
+  for (int p = 0; p < producers; p++) {
+    if (sfork() == 0) {
+      union Message msgs[MAX_BATCH];
+      __fill(msgs, p, batch);
+      for (int c = 0; c < commands; c++) {
+        msg_ring_push(ring, msgs, batch, doorbell);
+      }
+      exit(EXIT_SUCCESS);
+    }
+  }
+
+  static union Message buf[READ_MESSAGES];
+  size_t expected = (size_t)producers * commands * batch;
+  size_t received = 0;
+  unsigned long wakeups = 0;
+  while (received < expected) {
+    size_t n = msg_ring_pop(ring, buf, READ_MESSAGES);
+    if (n > 0) {
+      received += n;
+      continue;
+    }
+    if (msg_ring_prepare_wait(ring)) {
+      struct pollfd pfd = {.fd = doorbell, .events = POLLIN};
+      checkNeg(poll(&pfd, 1, -1), "Error poll");
+      wakeups++;
+    }
+    msg_ring_woken(ring, doorbell);
+  }
+  double elapsed = __now() - start;
+  while (wait(NULL) > 0) {
+  }
+  sclose(doorbell);
+  munmap(ring, size);
+  printf("ring: %lu doorbell wakeup(s)\n", wakeups);
+  return elapsed;
+}
+
+int main(int argc, char *argv[]) {
+  int producers = argc > 1 ? atoi(argv[1]) : DEFAULT_PRODUCERS;
+  int commands = argc > 2 ? atoi(argv[2]) : DEFAULT_COMMANDS;
+  int batch = argc > 3 ? atoi(argv[3]) : DEFAULT_BATCH;
+  if (producers <= 0 || commands <= 0 || batch <= 0 || batch > MAX_BATCH) {
+    fprintf(stderr, "Usage: %s [<producers> [<commands> [<batch <= %d>]]]\n",
+            argv[0], MAX_BATCH);
+    return EXIT_FAILURE;
+  }
+
+  double messages = (double)producers * commands * batch;
+  printf("%d producer(s), %d command(s) each, %d message(s) per command\n",
+         producers, commands, batch);
+  double pipe_time = __bench_pipe(producers, commands, batch);
+  printf("pipe: %.3f s, %.0f messages/s, %.0f ns/command\n", pipe_time,
+         messages / pipe_time, pipe_time * 1e9 / ((double)producers * commands));
+  double ring_time = __bench_ring(producers, commands, batch);
+  printf("ring: %.3f s, %.0f messages/s, %.0f ns/command\n", ring_time,
+         messages / ring_time, ring_time * 1e9 / ((double)producers * commands));
+  printf("ring/pipe speedup: %.2fx\n", pipe_time / ring_time);
+  return EXIT_SUCCESS;
+}
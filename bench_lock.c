@@ -0,0 +1,132 @@
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/ipc.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "room_segment.h"
+#include "utils_v3.h"
+
+/**
+ * Measures the cost of a lock/unlock pair around a (tiny) critical section
+ * with the SysV semaphore the client handlers used to take and with the lock
+ * of the room segment (see room_segment.h), while 0, 1 and 2 other processes
+ * (the contending handlers) take the same lock in a loop.
+ *
+ * usage: bench_lock [<iterations>]
+ */
+
+#define DEFAULT_ITERATIONS 1000000
+#define MAX_CONTENDERS 2
+#define PERM 0600
+
+// What the processes share besides the lock.
+struct Shared {
+  atomic_bool stop;
+  atomic_int ready;
+  // the critical section updates it
+  long counter;
+};
+
+enum LockKind { LOCK_SEM, LOCK_SEGMENT };
+
+static struct Shared *__shared;
+static struct RoomSegment *__segment;
+static int __sem_id;
+
+static void __lock(enum LockKind kind) {
+  if (kind == LOCK_SEM) {
+    sem_down0(__sem_id);
+  } else {
+    room_segment_lock(__segment);
+  }
+}
+
+static void __unlock(enum LockKind kind) {
+  if (kind == LOCK_SEM) {
+    sem_up0(__sem_id);
+  } else {
+    room_segment_unlock(__segment);
+  }
+}
+
+static double __now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// RES: the mean cost in ns of a lock/unlock pair with 'contenders' other
+//      processes taking the lock.
+static double __bench(enum LockKind kind, int contenders, long iterations) {
+  atomic_store(&__shared->stop, false);
+  atomic_store(&__shared->ready, 0);
+  fflush(stdout);
+  for (int c = 0; c < contenders; c++) {
+    if (sfork() == 0) {
+      atomic_fetch_add(&__shared->ready, 1);
+      while (!atomic_load_explicit(&__shared->stop, memory_order_relaxed)) {
+        __lock(kind);
+        __shared->counter++;
+        __unlock(kind);
+      }
+      exit(EXIT_SUCCESS);
+    }
+  }
+  while (atomic_load(&__shared->ready) < contenders) {
+  }
+
+  double start = __now();
+  for (long i = 0; i < iterations; i++) {
+    __lock(kind);
+    __shared->counter++;
+    __unlock(kind);
+  }
+  double elapsed = __now() - start;
+
+  atomic_store(&__shared->stop, true);
+  while (wait(NULL) > 0) {
+  }
+  return elapsed * 1e9 / iterations;
+}
+
+int main(int argc, char *argv[]) {
+  long iterations = argc > 1 ? atol(argv[1]) : DEFAULT_ITERATIONS;
+  if (iterations <= 0) {
+    fprintf(stderr, "Usage: %s [<iterations>]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  size_t size = sizeof(struct Shared) + room_segment_size(0, false);
+  void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED) {
+    perror("Error mmap");
+    return EXIT_FAILURE;
+  }
+  // the segment must stay aligned: it comes first
+  __segment = memory;
+  __shared = (struct Shared *)((char *)memory + room_segment_size(0, false));
+  room_segment_init(__segment, false);
+  __sem_id = sem_create(IPC_PRIVATE, 1, PERM, 1);
+
+  printf("%ld lock/unlock pairs per run\n", iterations);
+  printf("%-12s %12s %12s %12s\n", "lock", "0 contender", "1 contender",
+         "2 contenders");
+  const char *names[] = {"semaphore", "room lock"};
+  for (enum LockKind kind = LOCK_SEM; kind <= LOCK_SEGMENT; kind++) {
+    printf("%-12s", names[kind]);
+    for (int contenders = 0; contenders <= MAX_CONTENDERS; contenders++) {
+      printf(" %9.1f ns", __bench(kind, contenders, iterations));
+    }
+    printf("\n");
+  }
+
+  sem_delete(__sem_id);
+  munmap(memory, size);
+  return EXIT_SUCCESS;
+}
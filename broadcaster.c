@@ -1,42 +1,516 @@
 #include "common_fd.h"
 #include "game.h"
+#include "metrics.h"
+#include "msg_ring.h"
 #include "pascman.h"
+#include "room_segment.h"
+#include "send_queue.h"
+#include "shm_arena.h"
+#include "stage_trace.h"
 #include "utils_v3.h"
+#include "wire.h"
+#include "worker_pool.h"
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
 
-int main(int argc, char *argv[]) {
+// The ring holds whole messages: its capacity is a multiple of the message
+// size, so a complete message never wraps around the end of the buffer.
+#define RING_MESSAGES 1024
+#define RING_CAPACITY (RING_MESSAGES * sizeof(union Message))
 
-  // do nothing if SIGINT is received
-  signal(SIGINT, SIG_IGN);
+// Bytes read from the pipe but not yet forwarded. 'head' is where the next
+// read goes, 'tail' is the first byte of the oldest message, 'used' the
+// number of bytes between them (including an incomplete trailing message).
+struct Ring {
+  char data[RING_CAPACITY];
+  size_t head;
+  size_t tail;
+  size_t used;
+};
 
-  printf("Running broadcaster\n");
+// Reads everything the pipe has to offer (up to the free space of the ring)
+// with a single readv.
+// RES: the number of bytes read, 0 once every writer has closed the pipe.
+static ssize_t __ring_fill(struct Ring *ring, FileDescriptor fd) {
+  struct iovec iov[2];
+  int iovcnt = 0;
+  size_t free_bytes = RING_CAPACITY - ring->used;
+  size_t first = RING_CAPACITY - ring->head;
+  if (first > free_bytes) {
+    first = free_bytes;
+  }
+  iov[iovcnt].iov_base = ring->data + ring->head;
+  iov[iovcnt++].iov_len = first;
+  if (free_bytes > first) {
+    iov[iovcnt].iov_base = ring->data;
+    iov[iovcnt++].iov_len = free_bytes - first;
+  }
+
+  ssize_t bytes_read = readv(fd, iov, iovcnt);
+  checkNeg(bytes_read, "Error READV");
+  ring->head = (ring->head + bytes_read) % RING_CAPACITY;
+  ring->used += bytes_read;
+  return bytes_read;
+}
+
+// Time left to the players to receive their last messages once the match
+// is over.
+#define LINGER_MS 5000
+
+static struct SendQueue __queues[NB_PLAYERS];
+static bool __alive[NB_PLAYERS];
+
+static void __drop_player(int i, const char *reason) {
+  fprintf(stderr, "Broadcaster: player %d %s, disconnecting\n", i + 1,
+          reason);
+  shutdown(__queues[i].fd, SHUT_RDWR);
+  __alive[i] = false;
+}
+
+// Latency tracing (see stage_trace.h): the key presses whose TraceRecord has
+// been received wait in '__traces' until their messages are written on the
+// player sockets. The first '__nb_pushed' ones have their messages in the send
+// queues already, the others in the tick buffer.
+#define TRACE_BACKLOG 1024
+
+struct PendingTrace {
+  uint32_t read_ns;
+  uint32_t published_ns;
+  uint32_t received_ns;
+};
+
+static struct PendingTrace __traces[TRACE_BACKLOG];
+static size_t __nb_traces = 0;
+static size_t __nb_pushed = 0;
+static uint64_t __traces_dropped = 0;
+static struct StageHistograms __stages;
+static volatile sig_atomic_t __dump_requested = 0;
+
+static void __sigusr1_handler(int signum) { __dump_requested = 1; }
+
+static void __trace_received(uint32_t read_ns, uint32_t published_ns) {
+  if (__nb_traces == TRACE_BACKLOG) {
+    __traces_dropped++;
+    return;
+  }
+  __traces[__nb_traces++] = (struct PendingTrace){
+      .read_ns = read_ns,
+      .published_ns = published_ns,
+      .received_ns = stage_trace_now()};
+}
+
+static void __trace_record_received(const union Message *msg) {
+  struct TraceRecord record;
+  memcpy(&record, msg, sizeof(record));
+  __trace_received(record.read_ns, record.published_ns);
+}
+
+// The send queues are empty: the messages of the pushed key presses are
+// written.
+static void __traces_sent(void) {
+  uint32_t sent_ns = stage_trace_now();
+  for (size_t i = 0; i < __nb_pushed; i++) {
+    stage_histograms_record(&__stages, __traces[i].read_ns,
+                            __traces[i].published_ns,
+                            __traces[i].received_ns, sent_ns);
+  }
+  memmove(__traces, __traces + __nb_pushed,
+          (__nb_traces - __nb_pushed) * sizeof(struct PendingTrace));
+  __nb_traces -= __nb_pushed;
+  __nb_pushed = 0;
+}
+
+static void __push_all(const union Message *msgs, size_t count) {
+  if (count == 0) {
+    return;
+  }
+  for (int i = 0; i < NB_PLAYERS; i++) {
+    if (__alive[i] && !send_queue_push(&__queues[i], msgs, count)) {
+      __drop_player(i, "is too slow");
+    }
+  }
+  // the messages of every key press received so far are queued
+  __nb_pushed = __nb_traces;
+}
 
-  while (1) {
-    union Message buffer;
-    ssize_t bytes_read =
-        sread(WRITE_PIPE_TO_BROADCAST_FD, (void *)&buffer, sizeof(buffer));
-    if (bytes_read <= 0) {
-      perror("Failed to read from pipe");
+// Tick mode: the messages read during a tick wait in '__tick_buf' until
+// '__tick_deadline' (in ms), then only the last MOVEMENT of each player is
+// forwarded.
+static int __tick_ms = 0;
+static struct MessageBuffer __tick_buf;
+static uint64_t __tick_deadline;
+static uint64_t __coalesced = 0;
+
+static uint64_t __now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static void __tick_release(void) {
+  __coalesced += message_buffer_coalesce(&__tick_buf);
+  __push_all(__tick_buf.msgs, __tick_buf.count);
+  message_buffer_clear(&__tick_buf);
+}
+
+static void __forward(const union Message *msgs, size_t count) {
+  if (__tick_ms == 0) {
+    __push_all(msgs, count);
+    return;
+  }
+  if (__tick_buf.count == 0 && count > 0) {
+    __tick_deadline = __now_ms() + __tick_ms;
+  }
+  for (size_t i = 0; i < count; i++) {
+    message_buffer_push(&__tick_buf, &msgs[i]);
+  }
+}
+
+// Time (in ms) poll may wait for before the current tick ends, -1 if there
+// is nothing waiting for a tick.
+static int __tick_timeout(void) {
+  if (__tick_buf.count == 0) {
+    return -1;
+  }
+  uint64_t now = __now_ms();
+  return now >= __tick_deadline ? 0 : (int)(__tick_deadline - now);
+}
+
+// Forwards the messages 'from' to 'to' (excluded) of the ring, counted from
+// its tail. Messages never wrap: at most two contiguous runs.
+static void __ring_forward_span(const struct Ring *ring, size_t from,
+                                size_t to) {
+  size_t start = (ring->tail + from * sizeof(union Message)) % RING_CAPACITY;
+  size_t len = (to - from) * sizeof(union Message);
+  size_t first = RING_CAPACITY - start;
+  if (first > len) {
+    first = len;
+  }
+  __forward((union Message *)(ring->data + start),
+            first / sizeof(union Message));
+  __forward((union Message *)ring->data,
+            (len - first) / sizeof(union Message));
+}
+
+// Queues the complete messages of the ring for every player, stopping right
+// after a GAME_OVER message. An incomplete trailing message stays in the
+// ring until the rest of it is read. The trace records are taken out.
+// RES: true if a GAME_OVER message has been queued.
+static bool __ring_forward(struct Ring *ring) {
+  size_t count = ring->used / sizeof(union Message);
+  bool game_over = false;
+  size_t from = 0;
+  for (size_t i = 0; i < count; i++) {
+    size_t offset = (ring->tail + i * sizeof(union Message)) % RING_CAPACITY;
+    enum MessageType msgt;
+    memcpy(&msgt, ring->data + offset, sizeof(msgt));
+    // a single branch for the messages of the game
+    if (msgt <= EAT_FOOD) {
+      continue;
+    }
+    if (msgt == GAME_OVER) {
+      count = i + 1;
+      game_over = true;
       break;
     }
-    // Process the data read from the pipe
+    __ring_forward_span(ring, from, i);
+    union Message record;
+    memcpy(&record, ring->data + offset, sizeof(record));
+    __trace_record_received(&record);
+    from = i + 1;
+  }
+  __ring_forward_span(ring, from, count);
+  ring->tail = (ring->tail + count * sizeof(union Message)) % RING_CAPACITY;
+  ring->used -= count * sizeof(union Message);
+  return game_over;
+}
+
+// Queues the messages waiting in the message ring for every player, stopping
+// right after a GAME_OVER message. The trace records are taken out.
+// RES: true if a GAME_OVER message has been queued.
+static bool __msg_ring_forward(struct MsgRing *ring) {
+  static union Message batch[RING_MESSAGES];
+  size_t count;
+  while ((count = msg_ring_pop(ring, batch, RING_MESSAGES)) > 0) {
+    size_t from = 0;
+    for (size_t i = 0; i < count; i++) {
+      // a single branch for the messages of the game
+      if (batch[i].msgt <= EAT_FOOD) {
+        continue;
+      }
+      if (batch[i].msgt == GAME_OVER) {
+        __forward(batch + from, i + 1 - from);
+        return true;
+      }
+      __forward(batch + from, i - from);
+      __trace_record_received(&batch[i]);
+      from = i + 1;
+    }
+    __forward(batch + from, count - from);
+  }
+  return false;
+}
+
+// Game actor: applies the commands waiting in the ring to the state, in
+// the order of the ring, and queues the resulting messages for every player.
+// RES: true if a command ended the game.
+static bool __apply_commands(struct MsgRing *ring, struct RoomSegment *segment) {
+  static struct PlayerCommand batch[RING_MESSAGES];
+  static struct MessageBuffer msgs;
+  if (msgs.msgs == NULL) {
+    message_buffer_init(&msgs, RING_MESSAGES);
+  }
+  struct GameState *state = room_segment_state(segment);
+  bool game_over = false;
+  size_t count;
+  while (!game_over &&
+         (count = msg_ring_pop_commands(ring, batch, RING_MESSAGES)) > 0) {
+    // The actor is the only writer: the lock is only taken so that the room
+    // reads a consistent state, it is never contended.
+    room_segment_lock(segment);
+    for (size_t i = 0; i < count && !game_over; i++) {
+      size_t before = msgs.count;
+      game_over = process_user_command_buf(state, batch[i].player,
+                                           batch[i].dir, &msgs);
+      if (batch[i].traced && msgs.count > before) {
+        __trace_received(batch[i].read_ns, batch[i].published_ns);
+      }
+    }
+    room_segment_unlock(segment);
+    __forward(msgs.msgs, msgs.count);
+    message_buffer_clear(&msgs);
+  }
+  return game_over;
+}
+
+static void __flush_all(void) {
+  for (int i = 0; i < NB_PLAYERS; i++) {
+    if (__alive[i] && send_queue_flush(&__queues[i]) < 0) {
+      __drop_player(i, "left");
+    }
+  }
+}
+
+static bool __any_alive(void) {
+  for (int i = 0; i < NB_PLAYERS; i++) {
+    if (__alive[i]) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool __pending(void) {
+  for (int i = 0; i < NB_PLAYERS; i++) {
+    if (__alive[i] && !send_queue_empty(&__queues[i])) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Serves the players of 'job' until the match is over, then releases the
+// descriptors and the segment of the match. Everything is reset on entry: a
+// pooled broadcaster serves one match after the other.
+static void __serve(const struct BroadcasterJob *job) {
+  __tick_ms = job->tick_ms;
+  __coalesced = 0;
+  message_buffer_init(&__tick_buf, 64);
+  __nb_traces = __nb_pushed = 0;
+  __traces_dropped = 0;
+  stage_histograms_reset(&__stages);
+
+  // With a message ring, the handlers publish their messages in the ring and
+  // ring RING_DOORBELL_FD; the pipe then only reports their end. In actor
+  // mode, the ring holds their commands, which the broadcaster applies.
+  struct MsgRing *msg_ring = NULL;
+  struct ShmSegment shm = {.base = NULL};
+  struct RoomSegment *segment = NULL;
+  bool actor = job->actor;
+  if (job->ring) {
+    shm_arena_attach(&shm, job->segment);
+    segment = shm.base;
+    msg_ring = (struct MsgRing *)((char *)segment + job->ring_offset);
+  }
+
+  printf("Running broadcaster\n");
+
+  for (int i = 0; i < NB_PLAYERS; i++) {
+    send_queue_init(&__queues[i], PLAYERS_RANGE_FD + i, &job->sendq);
+    if (job->wire_versions[i] != 0) {
+      send_queue_set_wire(&__queues[i], job->wire_versions[i]);
+    }
+    __alive[i] = true;
+  }
+
+  // Each wakeup drains the pipe into the ring then queues the whole batch
+  // for every player; each player socket is then written with one
+  // non-blocking send, so a slow player never holds up the other one nor
+  // the client handlers writing on the pipe.
+  static struct Ring ring;
+  ring.head = ring.tail = ring.used = 0;
+  bool input_open = true;
+  int linger = LINGER_MS;
+  while (__any_alive() && (input_open || (__pending() && linger > 0))) {
+    if (__dump_requested) {
+      __dump_requested = 0;
+      stage_histograms_print(&__stages, stdout);
+    }
+    struct pollfd fds[NB_PLAYERS + 2];
+    int nfds = 0;
+    if (input_open) {
+      fds[nfds++] = (struct pollfd){.fd = WRITE_PIPE_TO_BROADCAST_FD,
+                                    .events = POLLIN};
+    }
+    // the doorbell is only rung if the ring is seen empty here
+    bool ring_ready = msg_ring != NULL && input_open &&
+                      !msg_ring_prepare_wait(msg_ring);
+    if (msg_ring != NULL && input_open) {
+      fds[nfds++] =
+          (struct pollfd){.fd = RING_DOORBELL_FD, .events = POLLIN};
+    }
     for (int i = 0; i < NB_PLAYERS; i++) {
-      int player_fd = PLAYERS_RANGE_FD + i;
-      ssize_t bytes_written = swrite(player_fd, (void *)&buffer, bytes_read);
-      if (bytes_written <= 0) {
-        perror("Failed to write to player");
-        break;
+      if (__alive[i] && !send_queue_empty(&__queues[i])) {
+        fds[nfds++] =
+            (struct pollfd){.fd = __queues[i].fd, .events = POLLOUT};
       }
     }
+    int timeout = ring_ready ? 0 : input_open ? __tick_timeout() : linger;
+    int ready = poll(fds, nfds, timeout);
+    if (ready < 0 && errno == EINTR) {
+      continue;
+    }
+    checkNeg(ready, "Error poll");
+    if (!input_open) {
+      linger = ready == 0 ? 0 : linger;
+    }
 
-    if (buffer.msgt == GAME_OVER) {
-      break;
+    if (msg_ring != NULL && input_open) {
+      msg_ring_woken(msg_ring, RING_DOORBELL_FD);
+      if (actor ? __apply_commands(msg_ring, segment)
+                : __msg_ring_forward(msg_ring)) {
+        input_open = false;
+      } else if (fds[0].revents != 0) {
+        // every handler is gone: whatever they published is in the ring
+        input_open = false;
+        if (actor) {
+          __apply_commands(msg_ring, segment);
+        } else {
+          __msg_ring_forward(msg_ring);
+        }
+      }
+    } else if (input_open && fds[0].revents != 0) {
+      ssize_t bytes_read = __ring_fill(&ring, WRITE_PIPE_TO_BROADCAST_FD);
+      if (bytes_read <= 0) {
+        perror("Failed to read from pipe");
+        input_open = false;
+      } else if (__ring_forward(&ring)) {
+        input_open = false;
+      }
     }
+    // the tick is over, or no more messages will come
+    if (__tick_buf.count > 0 && (!input_open || __tick_timeout() == 0)) {
+      __tick_release();
+    }
+    __flush_all();
+    if (__nb_pushed > 0 && !__pending()) {
+      __traces_sent();
+    }
+  }
+
+  for (int i = 0; i < NB_PLAYERS; i++) {
+    printf("Broadcaster: player %d max queue depth %zu, %llu slow-client "
+           "event(s), %llu message(s) dropped\n",
+           i + 1, __queues[i].stats.max_depth,
+           (unsigned long long)__queues[i].stats.slow_events,
+           (unsigned long long)__queues[i].stats.dropped);
+    send_queue_free(&__queues[i]);
+  }
+  if (__tick_ms > 0) {
+    printf("Broadcaster: %llu movement(s) coalesced (tick %d ms)\n",
+           (unsigned long long)__coalesced, __tick_ms);
   }
+  if (__stages.stages[STAGE_TOTAL].count > 0 || __traces_dropped > 0) {
+    printf("Broadcaster: latency of the key presses of the match (%llu "
+           "trace(s) dropped)\n",
+           (unsigned long long)__traces_dropped);
+    stage_histograms_print(&__stages, stdout);
+  }
+  message_buffer_free(&__tick_buf);
+  shm_arena_detach(&shm);
 
   printf("Exiting broadcaster\n");
-  // Close the pipe
+  // Close the pipe and the player sockets
   sclose(WRITE_PIPE_TO_BROADCAST_FD);
+  for (int i = 0; i < NB_PLAYERS; i++) {
+    sclose(PLAYERS_RANGE_FD + i);
+  }
+  if (msg_ring != NULL) {
+    sclose(RING_DOORBELL_FD);
+  }
+}
+
+// Pooled broadcaster: serves the matches the server hands it, one at a
+// time, until the server closes the control socket (see worker_pool.h).
+static int __serve_pool(void) {
+  FileDescriptor targets[NB_PLAYERS + 2];
+  int ntargets = 0;
+  targets[ntargets++] = WRITE_PIPE_TO_BROADCAST_FD;
+  for (int i = 0; i < NB_PLAYERS; i++) {
+    targets[ntargets++] = PLAYERS_RANGE_FD + i;
+  }
+  targets[ntargets++] = RING_DOORBELL_FD;
+  struct BroadcasterJob job;
+  while (worker_recv_job(&job, sizeof(job), targets, ntargets) >= 0) {
+    __serve(&job);
+    fflush(stdout);
+    worker_job_done();
+  }
+  return EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[]) {
+
+  // do nothing if SIGINT is received
+  signal(SIGINT, SIG_IGN);
+  // SIGUSR1 dumps the latency histograms of the match (pas_server -L)
+  ssigaction(SIGUSR1, __sigusr1_handler);
+  // the counters of the server, if it serves them (pas_server -M)
+  metrics_attach();
+  if (argc == 2 && strcmp(argv[1], "-pool") == 0) {
+    return __serve_pool();
+  }
+
+  // usage: broadcaster [<slow client policy> <queue capacity> [<tick ms>
+  //                     [<wire version of each player>...
+  //                     [<segment> <ring offset> [actor]]]]]
+  //        broadcaster -pool
+  struct BroadcasterJob job = {
+      .sendq = {.policy = SLOW_CLIENT_COALESCE,
+                .capacity = SEND_QUEUE_DEFAULT_CAPACITY}};
+  if (argc >= 3 && (!send_queue_parse_policy(argv[1], &job.sendq.policy) ||
+                    (job.sendq.capacity = strtoul(argv[2], NULL, 10)) == 0 ||
+                    (argc >= 4 && (job.tick_ms = atoi(argv[3])) < 0))) {
+    fprintf(stderr, "Invalid broadcaster arguments\n");
+    return EXIT_FAILURE;
+  }
+  for (int i = 0; i < NB_PLAYERS && argc > 4 + i; i++) {
+    job.wire_versions[i] = atoi(argv[4 + i]);
+  }
+  if (argc >= 4 + NB_PLAYERS + 2) {
+    job.ring = true;
+    snprintf(job.segment, sizeof(job.segment), "%s", argv[4 + NB_PLAYERS]);
+    job.ring_offset = strtoul(argv[4 + NB_PLAYERS + 1], NULL, 10);
+    job.actor = argc > 4 + NB_PLAYERS + 2 &&
+                strcmp(argv[4 + NB_PLAYERS + 2], "actor") == 0;
+  }
+  __serve(&job);
   return EXIT_SUCCESS;
 }
@@ -1,10 +1,17 @@
 #include "common_fd.h"
 #include "game.h"
-#include "ipc_keys.h"
+#include "metrics.h"
+#include "msg_ring.h"
+#include "room_segment.h"
+#include "shm_arena.h"
 #include "pascman.h"
+#include "stage_trace.h"
 #include "utils_v3.h"
+#include "worker_pool.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 void sigterm_handler(int signum) {
   printf("\nSIGTERM received on client handler...\n");
@@ -12,48 +19,139 @@ void sigterm_handler(int signum) {
   sclose(PLAYER_SOCKET_FD);
   exit(EXIT_SUCCESS);
 }
+
+// Serves the player of 'job' until it leaves or the game is over, then
+// releases the descriptors and the segment of the match.
+static void __serve(const struct HandlerJob *job) {
+  enum Item player_it = job->player_no == 1 ? PLAYER1 : PLAYER2;
+
+  // Attach the segment of the room, which holds the lock and the state (see
+  // room_segment.h).
+  struct ShmSegment shm;
+  shm_arena_attach(&shm, job->segment);
+  struct RoomSegment *segment = shm.base;
+  struct GameState *state = room_segment_state(segment);
+  // With a ring offset, the messages are published in the message ring of
+  // the segment instead of being written on the pipe.
+  struct MsgRing *ring = NULL;
+  struct MessageBuffer msgs = {.msgs = NULL};
+  if (job->ring) {
+    ring = (struct MsgRing *)((char *)segment + job->ring_offset);
+  }
+  // A traced key press is published with its TraceRecord (see
+  // stage_trace.h), in a single write on the pipe.
+  bool trace = segment->trace;
+  bool buffered = ring != NULL || trace;
+  if (buffered) {
+    message_buffer_init(&msgs, 8);
+  }
+
+  enum Direction key_press;
+  if (job->actor) {
+    // In actor mode, the handler only passes the commands of its player to
+    // the broadcaster, the one process applying them to the state.
+    while (read(PLAYER_SOCKET_FD, &key_press, sizeof(int)) > 0) {
+      struct PlayerCommand cmd = {.player = player_it, .dir = key_press};
+      if (trace) {
+        // nothing happens between the read and the publication
+        cmd.traced = true;
+        cmd.read_ns = cmd.published_ns = stage_trace_now();
+      }
+      msg_ring_push_command(ring, &cmd, RING_DOORBELL_FD);
+    }
+  } else {
+    // read the fd of the socket
+    while (read(PLAYER_SOCKET_FD, &key_press, sizeof(int)) > 0) {
+      if (trace) {
+        stage_trace_begin(&msgs);
+      }
+      printf("Received command %d from player %d\n", key_press,
+             job->player_no);
+      // no system call unless the other handler holds the lock
+      room_segment_lock(segment);
+      bool game_over;
+      if (buffered) {
+        // published under the lock: the messages of both players stay in the
+        // order of the state changes
+        game_over =
+            process_user_command_buf(state, player_it, key_press, &msgs);
+        if (trace) {
+          stage_trace_end(&msgs);
+        }
+        if (ring != NULL) {
+          msg_ring_push(ring, msgs.msgs, msgs.count, RING_DOORBELL_FD);
+          message_buffer_clear(&msgs);
+        } else {
+          message_buffer_flush(&msgs, WRITE_PIPE_TO_BROADCAST_FD);
+        }
+      } else {
+        game_over = process_user_command(state, player_it, key_press,
+                                         WRITE_PIPE_TO_BROADCAST_FD);
+      }
+      room_segment_unlock(segment);
+      if (game_over) {
+        // GAME FINISH
+        printf("Detection of the end of the game !\n");
+        break;
+      }
+    }
+    printf("The client handler is closing now.\n");
+  }
+
+  if (buffered) {
+    message_buffer_free(&msgs);
+  }
+  if (ring != NULL) {
+    sclose(RING_DOORBELL_FD);
+  }
+  shm_arena_detach(&shm);
+  // close the socket and the pipe
+  sclose(PLAYER_SOCKET_FD);
+  sclose(WRITE_PIPE_TO_BROADCAST_FD);
+}
+
+// Pooled handler: serves the matches the server hands it, one at a time,
+// until the server closes the control socket (see worker_pool.h).
+static int __serve_pool(void) {
+  const FileDescriptor targets[] = {PLAYER_SOCKET_FD,
+                                    WRITE_PIPE_TO_BROADCAST_FD,
+                                    RING_DOORBELL_FD};
+  struct HandlerJob job;
+  while (worker_recv_job(&job, sizeof(job), targets, 3) >= 0) {
+    __serve(&job);
+    worker_job_done();
+  }
+  return EXIT_SUCCESS;
+}
+
 int main(int argc, char *argv[]) {
 
   // do nothing is SIGINT is received
   signal(SIGINT, SIG_IGN);
   signal(SIGTERM, sigterm_handler);
-  if (argv == NULL || argc != 2) {
-    fprintf(stderr, "Usage: %s\n", argv[0]);
+  // the counters of the server, if it serves them (pas_server -M)
+  metrics_attach();
+  if (argc == 2 && strcmp(argv[1], "-pool") == 0) {
+    return __serve_pool();
+  }
+  if (argv == NULL || argc < 3 || argc > 5 ||
+      (argc == 5 && strcmp(argv[4], "actor") != 0)) {
+    fprintf(stderr,
+            "Usage: %s <player> <segment> [<ring offset> [actor]] | -pool\n",
+            argv[0]);
     return EXIT_FAILURE;
   }
 
-  int player_no = atoi(argv[1]);
-  enum Item player_it;
-  if (player_no == 1) {
-    player_it = PLAYER1;
-  } else if (player_no == 2) {
-    player_it = PLAYER2;
-  } else {
+  struct HandlerJob job = {.player_no = atoi(argv[1]),
+                           .ring = argc >= 4,
+                           .ring_offset = argc >= 4 ? strtoul(argv[3], NULL, 10)
+                                                    : 0,
+                           .actor = argc == 5};
+  if (job.player_no != 1 && job.player_no != 2) {
     fprintf(stderr, "Invalid player number: %s\n", argv[1]);
     return EXIT_FAILURE;
   }
-
-  // Get sem id and shm id
-  int sem_id = sem_get(SEM_KEY, 1);
-  int shm_id = sshmget(SHM_KEY, sizeof(struct GameState), 0);
-  struct GameState *state = sshmat(shm_id);
-  // read the fd of the socket
-  enum Direction key_press;
-  while (sread(PLAYER_SOCKET_FD, &key_press, sizeof(int)) > 0) {
-    printf("Received command %d from player %d\n", key_press, player_no);
-    // lock semaphore
-    sem_down0(sem_id);
-    if (process_user_command(state, player_it, key_press,
-                             WRITE_PIPE_TO_BROADCAST_FD)) {
-      // GAME FINISH
-      printf("Detection of the end of the game !\n");
-      sem_up0(sem_id);
-      return EXIT_SUCCESS;
-    }
-    sem_up0(sem_id);
-  }
-  printf("The client handler is closing now.");
-  // close the socket
-  sclose(PLAYER_SOCKET_FD);
+  snprintf(job.segment, sizeof(job.segment), "%s", argv[2]);
+  __serve(&job);
   return EXIT_SUCCESS;
 }
@@ -8,7 +8,14 @@
  * **/
 #define PLAYER_SOCKET_FD 3
 #define WRITE_PIPE_TO_BROADCAST_FD 4
+// eventfd ringing the broadcaster when the message ring is used (see msg_ring.h)
+#define RING_DOORBELL_FD 5
 // begin to 6 for player 1, 6+1 for player 2, 6+x for player x+1
 #define PLAYERS_RANGE_FD 6
+// shared counters of the server (see metrics.h), kept open across exec
+#define METRICS_FD 29
+// control socket of a pooled client handler or broadcaster (see
+// worker_pool.h), out of the way of the players range
+#define POOL_CONTROL_FD 30
 
 #endif // COMMON_FD
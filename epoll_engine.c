@@ -0,0 +1,578 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "epoll_engine.h"
+#include "metrics.h"
+#include "utils_v3.h"
+#include "wire.h"
+
+#define MAX_EVENTS 64
+// Size of the chunks read on a player socket. Commands are 4 bytes long so
+// this lets a single read drain a burst of key presses.
+#define READ_CHUNK 256
+
+enum ConnState {
+  // waiting for the REGISTRATION message
+  CONN_REGISTERING,
+  // registered, waiting for an opponent in the lobby
+  CONN_WAITING,
+  // playing in a room
+  CONN_PLAYING,
+  // its room is finished, closed once its send queue is empty
+  CONN_CLOSING,
+};
+
+struct EpollConn {
+  FileDescriptor fd;
+  enum ConnState state;
+  struct EpollRoom *room;
+  // index of the player in its room (0-based)
+  int player;
+  // bytes of a command which has not been fully received yet
+  size_t pending;
+  unsigned char partial[sizeof(int)];
+  struct SendQueue out;
+  // true while EPOLLOUT is watched, i.e. the send queue is not empty
+  bool writing;
+  struct EpollConn *next;
+};
+
+static volatile sig_atomic_t __stop_requested = 0;
+
+static uint64_t __now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void __epoll_sigint_handler(int signum) { __stop_requested = 1; }
+
+static void __watch(struct EventLoop *loop, FileDescriptor fd, void *ptr) {
+  struct epoll_event event = {.events = EPOLLIN, .data.ptr = ptr};
+  checkNeg(epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &event),
+           "Error epoll_ctl ADD");
+}
+
+static void __lobby_emptied(struct EventLoop *loop) {
+  if (loop->lobby_hooks.emptied != NULL) {
+    loop->lobby_hooks.emptied(loop, loop->lobby_hooks.ctx);
+  }
+}
+
+static void __conn_close(struct EventLoop *loop, struct EpollConn *conn) {
+  if (conn->fd == -1) {
+    return;
+  }
+  if (conn->state == CONN_CLOSING) {
+    loop->lingering--;
+  }
+  if (conn->state != CONN_REGISTERING) {
+    metrics_add(METRIC_PLAYERS_DISCONNECTED, 1);
+  }
+  epoll_ctl(loop->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+  sclose(conn->fd);
+  send_queue_free(&conn->out);
+  conn->fd = -1;
+  conn->room = NULL;
+  if (loop->lobby == conn) {
+    loop->lobby = NULL;
+    __lobby_emptied(loop);
+  }
+  conn->next = loop->graveyard;
+  loop->graveyard = conn;
+}
+
+// The connection is served by another loop from now on: it is forgotten
+// without closing its socket.
+static void __conn_detach(struct EventLoop *loop, struct EpollConn *conn) {
+  epoll_ctl(loop->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+  send_queue_free(&conn->out);
+  conn->fd = -1;
+  conn->next = loop->graveyard;
+  loop->graveyard = conn;
+}
+
+// Closes the room. When the match is 'finished', the players keep their
+// connection until they have received every queued message.
+static void __room_close(struct EventLoop *loop, struct EpollRoom *room,
+                         bool finished) {
+  for (int i = 0; i < NB_PLAYERS; i++) {
+    struct EpollConn *conn = room->players[i];
+    if (finished && conn->fd != -1 && !send_queue_empty(&conn->out)) {
+      conn->state = CONN_CLOSING;
+      conn->room = NULL;
+      loop->lingering++;
+    } else {
+      __conn_close(loop, conn);
+    }
+  }
+  if (room->prev != NULL) {
+    room->prev->next = room->next;
+  } else {
+    loop->rooms = room->next;
+  }
+  if (room->next != NULL) {
+    room->next->prev = room->prev;
+  }
+  message_buffer_free(&room->out);
+  free(room->state);
+  free(room);
+  loop->active_rooms--;
+  atomic_store_explicit(&loop->stats.rooms, loop->active_rooms,
+                        memory_order_relaxed);
+  metrics_add(METRIC_MATCHES_FINISHED, 1);
+}
+
+// Watches EPOLLOUT on the socket only while its send queue is not empty.
+static void __conn_update_events(struct EventLoop *loop,
+                                 struct EpollConn *conn) {
+  bool writing = !send_queue_empty(&conn->out);
+  if (writing == conn->writing) {
+    return;
+  }
+  struct epoll_event event = {.events = EPOLLIN | (writing ? EPOLLOUT : 0),
+                              .data.ptr = conn};
+  checkNeg(epoll_ctl(loop->epfd, EPOLL_CTL_MOD, conn->fd, &event),
+           "Error epoll_ctl MOD");
+  conn->writing = writing;
+}
+
+// Writes as much of the send queue as the socket accepts.
+// RES: false if the player left.
+static bool __conn_flush(struct EventLoop *loop, struct EpollConn *conn) {
+  int ret = send_queue_flush(&conn->out);
+  if (ret < 0) {
+    return false;
+  }
+  if (ret == 1 && conn->state == CONN_CLOSING) {
+    __conn_close(loop, conn);
+    return true;
+  }
+  __conn_update_events(loop, conn);
+  return true;
+}
+
+// Queues 'count' messages for the player and writes what can be written.
+// RES: false if the player left or is too slow to be kept.
+static bool __conn_send(struct EventLoop *loop, struct EpollConn *conn,
+                        const union Message *msgs, size_t count) {
+  uint64_t slow_events = conn->out.stats.slow_events;
+  bool queued = send_queue_push(&conn->out, msgs, count);
+  if (conn->out.stats.slow_events != slow_events) {
+    atomic_fetch_add_explicit(&loop->stats.slow_clients,
+                              conn->out.stats.slow_events - slow_events,
+                              memory_order_relaxed);
+  }
+  if (conn->out.stats.max_depth >
+      atomic_load_explicit(&loop->stats.max_queue_depth,
+                           memory_order_relaxed)) {
+    atomic_store_explicit(&loop->stats.max_queue_depth,
+                          conn->out.stats.max_depth, memory_order_relaxed);
+  }
+  if (!queued) {
+    fprintf(stderr, "A player is too slow, disconnecting\n");
+    return false;
+  }
+  return __conn_flush(loop, conn);
+}
+
+// The connection is unusable: the player left (or was disconnected).
+static void __conn_lost(struct EventLoop *loop, struct EpollConn *conn) {
+  if (conn->state == CONN_PLAYING) {
+    printf("Room %d: a player left\n", conn->room->id);
+    __room_close(loop, conn->room, false);
+  } else {
+    __conn_close(loop, conn);
+  }
+}
+
+// Sends every buffered message of the room to each of its players.
+// RES: false if one of the players left, in which case the room is closed.
+static bool __room_flush(struct EventLoop *loop, struct EpollRoom *room) {
+  if (room->out.count == 0) {
+    return true;
+  }
+  if (loop->tick_ms > 0) {
+    size_t coalesced = message_buffer_coalesce(&room->out);
+    atomic_fetch_add_explicit(&loop->stats.coalesced, coalesced,
+                              memory_order_relaxed);
+  }
+  for (int i = 0; i < NB_PLAYERS; i++) {
+    if (!__conn_send(loop, room->players[i], room->out.msgs,
+                     room->out.count)) {
+      __conn_lost(loop, room->players[i]);
+      return false;
+    }
+  }
+  atomic_fetch_add_explicit(&loop->stats.messages,
+                            room->out.count * NB_PLAYERS,
+                            memory_order_relaxed);
+  message_buffer_clear(&room->out);
+  return true;
+}
+
+static void __room_start(struct EventLoop *loop, struct EpollConn *p1,
+                         struct EpollConn *p2) {
+  struct EpollRoom *room = smalloc(sizeof(struct EpollRoom));
+  room->id = loop->next_room_id++;
+  room->players[0] = p1;
+  room->players[1] = p2;
+  message_buffer_init(&room->out, 8);
+  room->prev = NULL;
+  room->next = loop->rooms;
+  if (loop->rooms != NULL) {
+    loop->rooms->prev = room;
+  }
+  loop->rooms = room;
+  loop->active_rooms++;
+  atomic_store_explicit(&loop->stats.rooms, loop->active_rooms,
+                        memory_order_relaxed);
+  metrics_add(METRIC_MATCHES_STARTED, 1);
+  for (int i = 0; i < NB_PLAYERS; i++) {
+    room->players[i]->state = CONN_PLAYING;
+    room->players[i]->room = room;
+    room->players[i]->player = i;
+  }
+
+  const struct CompiledMap *map = loop->maps[room->id % loop->nb_maps];
+  room->state = smalloc(map_cache_state_size(map));
+  map_cache_reset_state(map, room->state);
+  // The spawn stream is sent straight from the compiled map, it does not
+  // take any room in the send queues.
+  for (int i = 0; i < NB_PLAYERS; i++) {
+    union Message msg = {
+        .registration = {.msgt = REGISTRATION, .player = i + 1}};
+    size_t len;
+    const void *spawn =
+        map_cache_spawn(map, room->players[i]->out.wire_version, &len);
+    send_queue_bulk(&room->players[i]->out, spawn, len);
+    if (!__conn_send(loop, room->players[i], &msg, 1)) {
+      __conn_lost(loop, room->players[i]);
+      return;
+    }
+  }
+  printf("Room %d started (%d room(s) running)\n", room->id,
+         loop->active_rooms);
+
+  if (room->state->game_over) {
+    __room_close(loop, room, true);
+  }
+}
+
+static void __lobby_join(struct EventLoop *loop, struct EpollConn *conn) {
+  if (loop->lobby == NULL) {
+    if (loop->lobby_hooks.wait != NULL &&
+        loop->lobby_hooks.wait(loop, conn->fd, conn->out.wire_version,
+                               loop->lobby_hooks.ctx)) {
+      __conn_detach(loop, conn);
+      return;
+    }
+    conn->state = CONN_WAITING;
+    loop->lobby = conn;
+    return;
+  }
+  struct EpollConn *opponent = loop->lobby;
+  loop->lobby = NULL;
+  __lobby_emptied(loop);
+  __room_start(loop, opponent, conn);
+}
+
+// Applies every complete command received from a playing connection, then
+// sends the resulting messages to the room at once (at the next tick in tick
+// mode, unless the game is over).
+static void __conn_commands(struct EventLoop *loop, struct EpollConn *conn,
+                            const unsigned char *data, size_t len) {
+  struct EpollRoom *room = conn->room;
+  enum Item player = conn->player == 0 ? PLAYER1 : PLAYER2;
+  bool game_over = false;
+  for (size_t i = 0; i + sizeof(int) <= len && !game_over;
+       i += sizeof(int)) {
+    int dir;
+    memcpy(&dir, data + i, sizeof(int));
+    game_over = process_user_command_buf(room->state, player,
+                                         (enum Direction)dir, &room->out);
+  }
+  if (loop->tick_ms > 0 && !game_over) {
+    return;
+  }
+  if (__room_flush(loop, room) && game_over) {
+    printf("Room %d finished\n", room->id);
+    __room_close(loop, room, true);
+  }
+}
+
+static void __conn_readable(struct EventLoop *loop, struct EpollConn *conn) {
+  unsigned char buf[sizeof(int) + READ_CHUNK];
+  memcpy(buf, conn->partial, conn->pending);
+  ssize_t received = read(conn->fd, buf + conn->pending, READ_CHUNK);
+  if (received < 0 && (errno == EINTR || errno == EAGAIN)) {
+    return;
+  }
+  if (received <= 0) {
+    __conn_lost(loop, conn);
+    return;
+  }
+
+  size_t len = conn->pending + (size_t)received;
+  size_t complete = len - len % sizeof(int);
+  conn->pending = len - complete;
+  memcpy(conn->partial, buf + complete, conn->pending);
+
+  switch (conn->state) {
+  case CONN_REGISTERING: {
+    if (complete == 0) {
+      return;
+    }
+    int msg_type;
+    memcpy(&msg_type, buf, sizeof(int));
+    int version = wire_parse_registration(msg_type);
+    if (version == -1 || !wire_send_ack(conn->fd, version)) {
+      fprintf(stderr, "Failed to register a player, closing connection\n");
+      __conn_close(loop, conn);
+      return;
+    }
+    send_queue_set_wire(&conn->out, version);
+    metrics_add(METRIC_PLAYERS_REGISTERED, 1);
+    __lobby_join(loop, conn);
+    // key presses read along with the REGISTRATION word count if the match
+    // starts at once; a player left waiting drops them, as in CONN_WAITING
+    if (conn->state == CONN_PLAYING && conn->room != NULL) {
+      __conn_commands(loop, conn, buf + sizeof(int), complete - sizeof(int));
+    }
+    break;
+  }
+  case CONN_WAITING:
+    // the match has not started yet: key presses are meaningless
+    break;
+  case CONN_PLAYING:
+    __conn_commands(loop, conn, buf, complete);
+    break;
+  case CONN_CLOSING:
+    // the match is over: key presses are meaningless
+    break;
+  }
+}
+
+// Sends what every room has buffered since the previous tick.
+static void __tick(struct EventLoop *loop) {
+  uint64_t expirations;
+  if (read(loop->ticker, &expirations, sizeof(expirations)) < 0) {
+    return;
+  }
+  struct EpollRoom *room = loop->rooms;
+  while (room != NULL) {
+    // the room may be closed by the flush
+    struct EpollRoom *next = room->next;
+    __room_flush(loop, room);
+    room = next;
+  }
+}
+
+static void __accept_ready(struct EventLoop *loop) {
+  while (1) {
+    FileDescriptor fd = accept(loop->listener, NULL, NULL);
+    if (fd < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR &&
+          errno != ECONNABORTED) {
+        perror("accept failure");
+      }
+      return;
+    }
+    event_loop_add_connection(loop, fd);
+  }
+}
+
+void event_loop_init(struct EventLoop *loop, FileDescriptor listener,
+                     const struct CompiledMap **maps, int nb_maps,
+                     const struct SendQueueConfig *sendq, int tick_ms) {
+  loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+  checkNeg(loop->epfd, "Error epoll_create1");
+  loop->listener = listener;
+  loop->maps = maps;
+  loop->nb_maps = nb_maps;
+  loop->lobby = NULL;
+  loop->rooms = NULL;
+  loop->graveyard = NULL;
+  loop->next_room_id = 0;
+  loop->active_rooms = 0;
+  loop->lingering = 0;
+  loop->accepting = listener != -1;
+  loop->sendq = *sendq;
+  loop->doorbell = -1;
+  loop->on_doorbell = NULL;
+  loop->doorbell_ctx = NULL;
+  loop->lobby_hooks = (struct LobbyHooks){0};
+  loop->ticker = -1;
+  loop->tick_ms = tick_ms;
+  atomic_init(&loop->stats.rooms, 0);
+  atomic_init(&loop->stats.messages, 0);
+  atomic_init(&loop->stats.busy_ns, 0);
+  atomic_init(&loop->stats.max_batch_ns, 0);
+  atomic_init(&loop->stats.batches, 0);
+  atomic_init(&loop->stats.max_queue_depth, 0);
+  atomic_init(&loop->stats.slow_clients, 0);
+  atomic_init(&loop->stats.coalesced, 0);
+  if (tick_ms > 0) {
+    loop->ticker = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    checkNeg(loop->ticker, "Error timerfd_create");
+    struct timespec period = {.tv_sec = tick_ms / 1000,
+                              .tv_nsec = (tick_ms % 1000) * 1000000L};
+    struct itimerspec timer = {.it_interval = period, .it_value = period};
+    checkNeg(timerfd_settime(loop->ticker, 0, &timer, NULL),
+             "Error timerfd_settime");
+    __watch(loop, loop->ticker, &loop->ticker);
+  }
+  if (listener != -1) {
+    int flags = fcntl(listener, F_GETFL);
+    checkNeg(fcntl(listener, F_SETFL, flags | O_NONBLOCK), "Error fcntl");
+    __watch(loop, listener, NULL);
+  }
+}
+
+void event_loop_set_doorbell(struct EventLoop *loop, FileDescriptor fd,
+                             DoorbellHandler handler, void *ctx) {
+  loop->doorbell = fd;
+  loop->on_doorbell = handler;
+  loop->doorbell_ctx = ctx;
+  __watch(loop, fd, &loop->doorbell);
+}
+
+void event_loop_set_lobby_hooks(struct EventLoop *loop,
+                                const struct LobbyHooks *hooks) {
+  loop->lobby_hooks = *hooks;
+}
+
+static struct EpollConn *__conn_new(struct EventLoop *loop,
+                                    FileDescriptor fd) {
+  struct EpollConn *conn = smalloc(sizeof(struct EpollConn));
+  conn->fd = fd;
+  conn->state = CONN_REGISTERING;
+  conn->room = NULL;
+  conn->player = -1;
+  conn->pending = 0;
+  conn->writing = false;
+  conn->next = NULL;
+  send_queue_init(&conn->out, fd, &loop->sendq);
+  __watch(loop, fd, conn);
+  return conn;
+}
+
+void event_loop_add_connection(struct EventLoop *loop, FileDescriptor fd) {
+  __conn_new(loop, fd);
+}
+
+void event_loop_add_player(struct EventLoop *loop, FileDescriptor fd,
+                           int version) {
+  struct EpollConn *conn = __conn_new(loop, fd);
+  send_queue_set_wire(&conn->out, version);
+  __lobby_join(loop, conn);
+}
+
+bool event_loop_busy(const struct EventLoop *loop) {
+  return loop->active_rooms > 0 || loop->lingering > 0;
+}
+
+int event_loop_run_once(struct EventLoop *loop, int timeout) {
+  struct epoll_event events[MAX_EVENTS];
+  int n = epoll_wait(loop->epfd, events, MAX_EVENTS, timeout);
+  if (n < 0) {
+    checkCond(errno != EINTR, "Error epoll_wait");
+    return -1;
+  }
+  uint64_t start = __now_ns();
+  for (int i = 0; i < n; i++) {
+    void *ptr = events[i].data.ptr;
+    if (ptr == NULL) {
+      __accept_ready(loop);
+    } else if (ptr == &loop->doorbell) {
+      loop->on_doorbell(loop, loop->doorbell_ctx);
+    } else if (ptr == &loop->ticker) {
+      __tick(loop);
+    } else {
+      struct EpollConn *conn = ptr;
+      if (conn->fd != -1 && (events[i].events & EPOLLOUT) &&
+          !__conn_flush(loop, conn)) {
+        __conn_lost(loop, conn);
+      }
+      if (conn->fd != -1 && (events[i].events & ~EPOLLOUT)) {
+        __conn_readable(loop, conn);
+      }
+    }
+  }
+  while (loop->graveyard != NULL) {
+    struct EpollConn *dead = loop->graveyard;
+    loop->graveyard = dead->next;
+    free(dead);
+  }
+
+  uint64_t elapsed = __now_ns() - start;
+  atomic_fetch_add_explicit(&loop->stats.busy_ns, elapsed,
+                            memory_order_relaxed);
+  atomic_fetch_add_explicit(&loop->stats.batches, 1, memory_order_relaxed);
+  if (elapsed > atomic_load_explicit(&loop->stats.max_batch_ns,
+                                     memory_order_relaxed)) {
+    atomic_store_explicit(&loop->stats.max_batch_ns, elapsed,
+                          memory_order_relaxed);
+  }
+  return n;
+}
+
+void event_loop_stop_accepting(struct EventLoop *loop) {
+  if (loop->accepting) {
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, loop->listener, NULL);
+    loop->accepting = false;
+  }
+  if (loop->lobby != NULL) {
+    __conn_close(loop, loop->lobby);
+  }
+}
+
+void event_loop_destroy(struct EventLoop *loop) {
+  if (loop->lobby != NULL) {
+    __conn_close(loop, loop->lobby);
+  }
+  while (loop->graveyard != NULL) {
+    struct EpollConn *dead = loop->graveyard;
+    loop->graveyard = dead->next;
+    free(dead);
+  }
+  if (loop->ticker != -1) {
+    sclose(loop->ticker);
+    loop->ticker = -1;
+  }
+  sclose(loop->epfd);
+  loop->epfd = -1;
+}
+
+int epoll_engine_run(FileDescriptor sockfd, const struct CompiledMap **maps,
+                     int nb_maps, const struct SendQueueConfig *sendq,
+                     int tick_ms) {
+  // A player leaving while we write to him must not kill the server.
+  signal(SIGPIPE, SIG_IGN);
+  struct sigaction action = {0};
+  ssigemptyset(&action.sa_mask);
+  action.sa_handler = __epoll_sigint_handler;
+  action.sa_flags = 0;
+  checkNeg(sigaction(SIGINT, &action, NULL), "Error sigaction");
+
+  struct EventLoop loop;
+  event_loop_init(&loop, sockfd, maps, nb_maps, sendq, tick_ms);
+  while (!__stop_requested || event_loop_busy(&loop)) {
+    if (__stop_requested && loop.accepting) {
+      printf("Waiting for the running rooms to finish...\n");
+      event_loop_stop_accepting(&loop);
+    }
+    event_loop_run_once(&loop, -1);
+  }
+  event_loop_destroy(&loop);
+  return 0;
+}
@@ -0,0 +1,176 @@
+#ifndef EPOLL_ENGINE_H
+#define EPOLL_ENGINE_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "game.h"
+#include "map_cache.h"
+#include "send_queue.h"
+
+/**
+ * The epoll engine serves every match from a single thread: all the player
+ * sockets are multiplexed with epoll, the commands are applied with
+ * process_user_command_buf and the resulting messages are queued in the send
+ * queue of each player of the room (see send_queue.h), which is written
+ * whenever its socket is writable. There is no client_handler, no
+ * broadcaster, no pipe and no semaphore.
+ *
+ * In tick mode (tick_ms > 0) the messages of a room are only sent once per
+ * tick, after dropping the MOVEMENT messages superseded by a later one (see
+ * message_buffer_coalesce).
+ */
+
+// Engine-side view of one connected player.
+struct EpollConn;
+
+// One match served by an event loop. The GameState is private to the loop
+// which owns the room, so it needs no locking.
+struct EpollRoom {
+  int id;
+  struct EpollConn *players[NB_PLAYERS];
+  struct GameState *state;
+  struct MessageBuffer out;
+  // rooms of the loop
+  struct EpollRoom *prev;
+  struct EpollRoom *next;
+};
+
+// Counters of one event loop. They are only written by the thread running
+// the loop and may be read at any time by another thread.
+struct EventLoopStats {
+  atomic_int rooms;
+  // messages written to the player sockets
+  atomic_uint_least64_t messages;
+  // time spent processing batches of events (loop latency)
+  atomic_uint_least64_t busy_ns;
+  atomic_uint_least64_t max_batch_ns;
+  atomic_uint_least64_t batches;
+  // highest number of messages waiting in the send queue of a player
+  atomic_uint_least64_t max_queue_depth;
+  // number of times the send queue of a player was full
+  atomic_uint_least64_t slow_clients;
+  // MOVEMENT messages dropped by the tick coalescing, per room
+  atomic_uint_least64_t coalesced;
+};
+
+struct EventLoop;
+
+// Callback used when the doorbell of the loop rings.
+typedef void (*DoorbellHandler)(struct EventLoop *loop, void *ctx);
+
+// Hooks letting the loops of an engine share a single lobby (see
+// sharded_engine.c). Both are called by the thread running 'loop'.
+struct LobbyHooks {
+  // A player registered in 'version' on 'fd' finds the lobby of 'loop'
+  // empty. RES: true if the hook takes the player over, the loop then
+  // forgets it without closing 'fd'; false to let it wait in the lobby.
+  bool (*wait)(struct EventLoop *loop, FileDescriptor fd, int version,
+               void *ctx);
+  // The lobby of 'loop' is empty again: its player was matched or left.
+  void (*emptied)(struct EventLoop *loop, void *ctx);
+  void *ctx;
+};
+
+struct EventLoop {
+  FileDescriptor epfd;
+  // listening socket, -1 when the connections are given to the loop by
+  // someone else (see event_loop_add_connection)
+  FileDescriptor listener;
+  // the rooms of the loop use these maps in turn
+  const struct CompiledMap **maps;
+  int nb_maps;
+  // registered player waiting for an opponent
+  struct EpollConn *lobby;
+  struct EpollRoom *rooms;
+  // connections closed during the current batch of events, freed once the
+  // batch has been processed
+  struct EpollConn *graveyard;
+  // optional descriptor (e.g. an eventfd) whose readiness calls 'on_doorbell'
+  FileDescriptor doorbell;
+  DoorbellHandler on_doorbell;
+  void *doorbell_ctx;
+  // 'wait' is NULL when the lobby is private to the loop
+  struct LobbyHooks lobby_hooks;
+  // periodic timerfd of the tick mode, -1 when messages are sent right away
+  FileDescriptor ticker;
+  int tick_ms;
+  int next_room_id;
+  int active_rooms;
+  // players of finished rooms who still have messages to receive
+  int lingering;
+  bool accepting;
+  struct SendQueueConfig sendq;
+  struct EventLoopStats stats;
+};
+
+/**
+ * PRE:  listener is a listening socket or -1, tick_ms >= 0.
+ * POST: the loop is ready to serve matches played on the 'nb_maps' maps,
+ *       each player gets a send queue configured by 'sendq'. The messages
+ *       of a room are sent every 'tick_ms' milliseconds (0 = right away).
+ */
+void event_loop_init(struct EventLoop *loop, FileDescriptor listener,
+                     const struct CompiledMap **maps, int nb_maps,
+                     const struct SendQueueConfig *sendq, int tick_ms);
+
+// True while the loop still serves a room or a lingering player.
+bool event_loop_busy(const struct EventLoop *loop);
+
+/**
+ * POST: the already accepted socket 'fd' is served by the loop. The loop
+ *       waits for its REGISTRATION message then pairs it with the next
+ *       registered player.
+ */
+void event_loop_add_connection(struct EventLoop *loop, FileDescriptor fd);
+
+/**
+ * PRE:  a player on the accepted socket 'fd' has been registered in
+ *       'version' (its answer already sent).
+ * POST: the player is served by the loop, it joins its lobby.
+ */
+void event_loop_add_player(struct EventLoop *loop, FileDescriptor fd,
+                           int version);
+
+/**
+ * POST: the lobby of the loop is shared through 'hooks'.
+ */
+void event_loop_set_lobby_hooks(struct EventLoop *loop,
+                                const struct LobbyHooks *hooks);
+
+/**
+ * POST: 'handler' is called (with 'ctx') by the loop thread every time 'fd'
+ *       becomes readable. The handler is responsible for draining 'fd'.
+ */
+void event_loop_set_doorbell(struct EventLoop *loop, FileDescriptor fd,
+                             DoorbellHandler handler, void *ctx);
+
+/**
+ * POST: waits at most 'timeout' milliseconds (-1 = forever) for events and
+ *       processes all of them.
+ * RES:  the number of events processed, -1 if the wait was interrupted by a
+ *       signal.
+ */
+int event_loop_run_once(struct EventLoop *loop, int timeout);
+
+/**
+ * POST: the loop stops accepting new players; the player waiting in the
+ *       lobby, if any, is disconnected.
+ */
+void event_loop_stop_accepting(struct EventLoop *loop);
+
+/**
+ * POST: every resource held by the loop is released.
+ */
+void event_loop_destroy(struct EventLoop *loop);
+
+/**
+ * Runs the server with the epoll engine until SIGINT is received and every
+ * running match is finished.
+ */
+int epoll_engine_run(FileDescriptor sockfd, const struct CompiledMap **maps,
+                     int nb_maps, const struct SendQueueConfig *sendq,
+                     int tick_ms);
+
+#endif // EPOLL_ENGINE_H
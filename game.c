@@ -1,5 +1,6 @@
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 
 #include "utils_v3.h"
 
@@ -14,30 +15,32 @@
 // d'une resource qui se trouve à une position donnée sur la carte.
 //
 // Cette fonction renvoie -1 en cas d'erreur
-int32_t id(uint32_t x, uint32_t y, enum Item item);
+int32_t id(const struct GameState *state, uint32_t x, uint32_t y,
+           enum Item item);
 
 // Cette fonction utilitaire permet de connaitre l'identifiant
 // d'une resource qui se trouve à une position donnée sur la carte.
 //
 // Cette fonction renvoie -1 en cas d'erreur
-int32_t id_at(struct Position pos, enum Item item);
+int32_t id_at(const struct GameState *state, struct Position pos,
+              enum Item item);
 
 // Cette fonction utilitaire permet de connaitre l'offset d'une
 // position dans la carte.
-size_t position2index(struct Position pos);
+size_t position2index(const struct GameState *state, struct Position pos);
 
 // Cette fonction ecrit le message approprié pour signifier aux clients qu'une
 // resource donnée est introduite dans le jeu.
-void send_spawn_item(uint32_t x, uint32_t y, enum Item item,
-                     FileDescriptor fdbcast);
+void send_spawn_item(const struct GameState *state, uint32_t x, uint32_t y,
+                     enum Item item, FileDescriptor fdbcast);
 // Cette fonction ecrit le message approprié pour signifier aux clients qu'un
 // des joueurs a bougé sur le plateau de jeu.
-void send_player_moved(enum Item player, struct Position to,
-                       FileDescriptor fdbcast);
+void send_player_moved(const struct GameState *state, enum Item player,
+                       struct Position to, FileDescriptor fdbcast);
 // Cette fonction ecrit le message approprié pour signifier aux clients que
 // de la nourriture ou superfood a été mangée par un joueur.
-void send_eat_food(enum Item player, enum Item food, struct Position to,
-                   FileDescriptor fdbcast);
+void send_eat_food(const struct GameState *state, enum Item player,
+                   enum Item food, struct Position to, FileDescriptor fdbcast);
 // Cette fonction ecrit le message approprié pour signifier aux clients que
 // la partie est terminée.
 void send_game_over(enum Item winner, FileDescriptor fdbcast);
@@ -46,18 +49,253 @@ void send_game_over(enum Item winner, FileDescriptor fdbcast);
  * FIN DU PSEUDO-HEADER.
  ******************************************************************************************/
 
+// Destination des messages produits par le jeu: soit un FileDescriptor (un
+// write par message), soit un MessageBuffer en mémoire quand 'buf' != NULL.
+struct MessageSink {
+  FileDescriptor fd;
+  struct MessageBuffer *buf;
+};
+
+static void __emit(const struct MessageSink *sink, const union Message *msg) {
+  if (sink->buf != NULL) {
+    message_buffer_push(sink->buf, msg);
+  } else {
+    swrite(sink->fd, msg, sizeof(union Message));
+  }
+}
+
+static void __sink_spawn_item(const struct GameState *state, uint32_t x,
+                              uint32_t y, enum Item item,
+                              const struct MessageSink *sink);
+static void __sink_player_moved(const struct GameState *state,
+                                enum Item player, struct Position to,
+                                const struct MessageSink *sink);
+static void __sink_eat_food(const struct GameState *state, enum Item player,
+                            enum Item food, struct Position to,
+                            const struct MessageSink *sink);
+static void __sink_game_over(enum Item winner, const struct MessageSink *sink);
+
+void message_buffer_init(struct MessageBuffer *buf, size_t capacity) {
+  buf->count = 0;
+  buf->capacity = capacity > 0 ? capacity : 1;
+  buf->msgs = smalloc(buf->capacity * sizeof(union Message));
+}
+
+static void __message_buffer_grow(struct MessageBuffer *buf, size_t capacity) {
+  union Message *msgs = realloc(buf->msgs, capacity * sizeof(union Message));
+  if (msgs == NULL) {
+    perror("realloc message buffer:");
+    exit(EXIT_FAILURE);
+  }
+  buf->msgs = msgs;
+  buf->capacity = capacity;
+}
+
+void message_buffer_reserve(struct MessageBuffer *buf, size_t count) {
+  if (buf->capacity - buf->count < count) {
+    __message_buffer_grow(buf, buf->count + count);
+  }
+}
+
+void message_buffer_push(struct MessageBuffer *buf, const union Message *msg) {
+  if (buf->count == buf->capacity) {
+    __message_buffer_grow(buf, buf->capacity * 2);
+  }
+  buf->msgs[buf->count++] = *msg;
+}
+
+void message_buffer_clear(struct MessageBuffer *buf) { buf->count = 0; }
+
+void message_buffer_flush(struct MessageBuffer *buf, FileDescriptor fd) {
+  if (buf->count > 0) {
+    nwrite(fd, buf->msgs, buf->count * sizeof(union Message));
+  }
+  message_buffer_clear(buf);
+}
+
+void message_buffer_free(struct MessageBuffer *buf) {
+  free(buf->msgs);
+  buf->msgs = NULL;
+  buf->count = 0;
+  buf->capacity = 0;
+}
+
+size_t message_buffer_coalesce(struct MessageBuffer *buf) {
+  // Parcours à reculons : le premier MOVEMENT rencontré pour un élément est
+  // le dernier envoyé, les suivants sont périmés. Les messages gardés sont
+  // recopiés vers la fin du buffer puis ramenés au début.
+  uint32_t moved[NB_PLAYERS];
+  int nb_moved = 0;
+  size_t kept = buf->count;
+  for (size_t i = buf->count; i-- > 0;) {
+    const union Message *msg = &buf->msgs[i];
+    if (msg->msgt == MOVEMENT) {
+      bool superseded = false;
+      for (int j = 0; j < nb_moved && !superseded; j++) {
+        superseded = moved[j] == msg->movement.id;
+      }
+      if (superseded) {
+        continue;
+      }
+      if (nb_moved < NB_PLAYERS) {
+        moved[nb_moved++] = msg->movement.id;
+      }
+    }
+    buf->msgs[--kept] = *msg;
+  }
+  size_t dropped = kept;
+  memmove(buf->msgs, buf->msgs + kept,
+          (buf->count - kept) * sizeof(union Message));
+  buf->count -= dropped;
+  return dropped;
+}
+
+// Nombre de mots de 64 bits d'une bitboard pour une carte width x height.
+static size_t __layer_words(uint32_t width, uint32_t height) {
+  return ((size_t)width * height + 63) / 64;
+}
+
+// Nombre d'octets nécessaires pour stocker les bitboards d'une carte.
+static size_t __tiles_size(uint32_t width, uint32_t height) {
+  return NB_LAYERS * __layer_words(width, height) * sizeof(uint64_t);
+}
+
+size_t gamestate_size(uint32_t width, uint32_t height) {
+  return sizeof(struct GameState) + __tiles_size(width, height);
+}
+
+size_t gamestate_layer_words(const struct GameState *state) {
+  return __layer_words(state->width, state->height);
+}
+
+const uint64_t *gamestate_layer(const struct GameState *state, int layer) {
+  return state->map + layer * gamestate_layer_words(state);
+}
+
+#define BIT(index) ((uint64_t)1 << ((index) % 64))
+
+// Une carte remplie de zéros ne contient que des murs.
+enum Item gamestate_tile(const struct GameState *state, size_t index) {
+  size_t words = gamestate_layer_words(state);
+  const uint64_t *word = &state->map[index / 64];
+  if (word[LAYER_FOOD * words] & BIT(index)) {
+    return FOOD;
+  }
+  if (word[LAYER_SUPERFOOD * words] & BIT(index)) {
+    return SUPERFOOD;
+  }
+  return (word[LAYER_FLOOR * words] & BIT(index)) ? FLOOR : WALL;
+}
+
+void gamestate_set_tile(struct GameState *state, size_t index,
+                        enum Item item) {
+  size_t words = gamestate_layer_words(state);
+  uint64_t *word = &state->map[index / 64];
+  word[LAYER_FLOOR * words] &= ~BIT(index);
+  word[LAYER_FOOD * words] &= ~BIT(index);
+  word[LAYER_SUPERFOOD * words] &= ~BIT(index);
+  if (item != WALL) {
+    word[LAYER_FLOOR * words] |= BIT(index);
+  }
+  if (item == FOOD) {
+    word[LAYER_FOOD * words] |= BIT(index);
+  } else if (item == SUPERFOOD) {
+    word[LAYER_SUPERFOOD * words] |= BIT(index);
+  }
+}
+
+// Compte les bits à 1 de 'layer' dans l'intervalle [from, to).
+static int __count_bits(const uint64_t *layer, size_t from, size_t to) {
+  int count = 0;
+  while (from < to) {
+    size_t end = (from / 64 + 1) * 64;
+    if (end > to) {
+      end = to;
+    }
+    uint64_t mask = ~(uint64_t)0 << (from % 64);
+    if (end % 64 != 0) {
+      mask &= ~(~(uint64_t)0 << (end % 64));
+    }
+    count += __builtin_popcountll(layer[from / 64] & mask);
+    from = end;
+  }
+  return count;
+}
+
+int gamestate_count_food(const struct GameState *state) {
+  size_t words = gamestate_layer_words(state);
+  const uint64_t *food = gamestate_layer(state, LAYER_FOOD);
+  const uint64_t *superfood = gamestate_layer(state, LAYER_SUPERFOOD);
+  int count = 0;
+  for (size_t i = 0; i < words; i++) {
+    count += __builtin_popcountll(food[i] | superfood[i]);
+  }
+  return count;
+}
+
+int gamestate_region_food(const struct GameState *state, uint32_t x,
+                          uint32_t y, uint32_t w, uint32_t h) {
+  if (x >= state->width || y >= state->height) {
+    return 0;
+  }
+  uint32_t right = w > state->width - x ? state->width : x + w;
+  uint32_t bottom = h > state->height - y ? state->height : y + h;
+  const uint64_t *food = gamestate_layer(state, LAYER_FOOD);
+  const uint64_t *superfood = gamestate_layer(state, LAYER_SUPERFOOD);
+  int count = 0;
+  for (uint32_t row = y; row < bottom; row++) {
+    size_t from = (size_t)row * state->width + x;
+    size_t to = (size_t)row * state->width + right;
+    // FOOD et SUPERFOOD ne se trouvent jamais sur la même case.
+    count += __count_bits(food, from, to) + __count_bits(superfood, from, to);
+  }
+  return count;
+}
+
+size_t gamestate_food_diff(const struct GameState *a, const struct GameState *b,
+                           uint64_t *diff) {
+  size_t words = gamestate_layer_words(a);
+  const uint64_t *food_a = gamestate_layer(a, LAYER_FOOD);
+  const uint64_t *food_b = gamestate_layer(b, LAYER_FOOD);
+  const uint64_t *superfood_a = gamestate_layer(a, LAYER_SUPERFOOD);
+  const uint64_t *superfood_b = gamestate_layer(b, LAYER_SUPERFOOD);
+  size_t count = 0;
+  for (size_t i = 0; i < words; i++) {
+    uint64_t changed =
+        (food_a[i] ^ food_b[i]) | (superfood_a[i] ^ superfood_b[i]);
+    if (diff != NULL) {
+      diff[i] = changed;
+    }
+    count += __builtin_popcountll(changed);
+  }
+  return count;
+}
+
+struct GameState *gamestate_create(uint32_t width, uint32_t height) {
+  struct GameState *state = smalloc(gamestate_size(width, height));
+  state->width = width;
+  state->height = height;
+  reset_gamestate(state);
+  return state;
+}
+
+void gamestate_copy(struct GameState *dst, const struct GameState *src) {
+  memcpy(dst, src, gamestate_size(src->width, src->height));
+}
+
 // Renvoie le début du range d'id pour ce type d'items.
-static uint32_t __base_id(enum Item item) {
+static uint32_t __base_id(const struct GameState *state, enum Item item) {
+  uint32_t map_size = state->width * state->height;
   switch (item) {
   case FOOD:
   case SUPERFOOD:
     return 0;
   case WALL:
   case FLOOR:
-    return MAP_SIZE;
+    return map_size;
   case PLAYER1:
   case PLAYER2:
-    return 3 * MAP_SIZE;
+    return PLAYER1_ID(map_size);
   default:
     perror("The given item type is invalid");
     exit(EXIT_FAILURE);
@@ -66,25 +304,28 @@ static uint32_t __base_id(enum Item item) {
 
 // Cette fonction utilitaire permet de connaitre l'identifiant
 // d'une resource qui se trouve à une position donnée sur la carte.
-int32_t id_at(struct Position pos, enum Item item) {
-  return id(pos.x, pos.y, item);
+int32_t id_at(const struct GameState *state, struct Position pos,
+              enum Item item) {
+  return id(state, pos.x, pos.y, item);
 }
 
 // Cette fonction utilitaire permet de connaitre l'identifiant
 // d'une resource qui se trouve à une position donnée sur la carte.
-int32_t id(uint32_t x, uint32_t y, enum Item item) {
+int32_t id(const struct GameState *state, uint32_t x, uint32_t y,
+           enum Item item) {
+  uint32_t map_size = state->width * state->height;
   if (item == PLAYER1) {
-    return PLAYER1_ID;
+    return PLAYER1_ID(map_size);
   }
   if (item == PLAYER2) {
-    return PLAYER2_ID;
+    return PLAYER2_ID(map_size);
   }
-  return __base_id(item) + (y * WIDTH + x);
+  return __base_id(state, item) + (y * state->width + x);
 }
 // Cette fonction utilitaire permet de connaitre l'offset d'une
 // position dans la carte.
-size_t position2index(struct Position pos) {
-  return (size_t)(pos.y * WIDTH + pos.x);
+size_t position2index(const struct GameState *state, struct Position pos) {
+  return (size_t)pos.y * state->width + pos.x;
 }
 
 // Cette réinitialise un objet GameState ce qui permet de s'assurer
@@ -93,7 +334,7 @@ size_t position2index(struct Position pos) {
 void reset_gamestate(struct GameState *state) {
   state->game_over = true;
   state->food_count = 0;
-  if (!memset(state->map, 0, sizeof(state->map))) {
+  if (!memset(state->map, 0, __tiles_size(state->width, state->height))) {
     perror("memset map:");
     exit(EXIT_FAILURE);
   }
@@ -107,97 +348,234 @@ void reset_gamestate(struct GameState *state) {
   }
 }
 
-/* Cette fonction lit la map stockée dans le fichier 'resources/map.txt' et
- * génère une suite de messages qui sont écrits l'un à la suite de lautre sur la
- * sortie standard du programme.
- *
- * De plus, va peupler une structure de type GameState passée en parametre que
- * vous pouvez utiliser pour maintenir une copie l'état courant du jeu.
- */
-void load_map(FileDescriptor fdmap, FileDescriptor fdbcast,
-              struct GameState *state) {
-  reset_gamestate(state);
+// Lit en une seule fois tout ce qui reste à lire dans le fichier 'fd'.
+// Le buffer renvoyé est alloué dynamiquement et doit être libéré par
+// l'appelant; sa taille est stockée dans 'len'.
+static char *__read_all(FileDescriptor fd, size_t *len) {
+  struct stat st;
+  size_t capacity = 4096;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    capacity = (size_t)st.st_size;
+  }
+  char *text = smalloc(capacity);
+  *len = 0;
+  while (1) {
+    if (*len == capacity) {
+      capacity *= 2;
+      text = realloc(text, capacity);
+      if (text == NULL) {
+        perror("realloc map:");
+        exit(EXIT_FAILURE);
+      }
+    }
+    ssize_t r = sread(fd, text + *len, capacity - *len);
+    if (r == 0) {
+      return text;
+    }
+    *len += (size_t)r;
+  }
+}
 
-  size_t pos = 0;
+// Convertit le texte d'une carte en tableau de tuiles.
+uint8_t *map_text_to_tiles(const char *text, size_t len, uint32_t *width,
+                           uint32_t *height, size_t *ignored) {
+  // Premier passage: les dimensions de la carte sont celles de sa plus
+  // longue ligne et son nombre de lignes. Un octet nul n'est pas une tuile,
+  // bien que strchr() trouve le '\0' qui termine la chaîne.
   uint32_t x = 0;
   uint32_t y = 0;
-  char c = '\0';
-  while (sread(fdmap, &c, sizeof(char)) > 0) {
-    // on a lu tout le fichier en une fois, maintenant on peut le parcourir
-    // charactere par charactere pour voir creer les messages nécessaires à
-    // dessiner la map.
-    // - Lorsqu'on rencontrera un caractere '#' on ajoutera un mur
-    // - Lorsqu'on rencontrera un caractere '.' on ajoutera un tuile de sol et
-    // de la nourriture
-    // - Lorsqu'on rencontrera un caractere '*' on ajoutera un tuile de sol et
-    // de la superfood
-    // - Lorsqu'on rencontrera un caractere ' ' on ajoutera uniquement une tuile
-    // de sol.
-    // - Lorsqu'on rencontrera un caractere '@' on injectera le 1er joueur
-    // - Lorsqu'on rencontrera un caractere '!' on injectera le 2nd joueur
-    switch (c) {
-    case '#':
-      send_spawn_item(x, y, WALL, fdbcast);
-      state->map[pos] = WALL;
+  *width = 0;
+  *height = 0;
+  for (size_t i = 0; i < len; i++) {
+    if (text[i] == '\n') {
+      y++;
+      x = 0;
+    } else if (text[i] != '\0' && strchr("#.* @!", text[i]) != NULL) {
       x++;
-      pos++;
+      if (x > *width) {
+        *width = x;
+      }
+      *height = y + 1;
+    }
+  }
+  if (*width > MAX_WIDTH) {
+    *width = MAX_WIDTH;
+  }
+  if (*height > MAX_HEIGHT) {
+    *height = MAX_HEIGHT;
+  }
+  // +1: une carte vide reste une allocation valide
+  uint8_t *tiles = smalloc((size_t)*width * *height + 1);
+  memset(tiles, TILE_NONE, (size_t)*width * *height);
+
+  // Second passage: on parcourt la carte charactere par charactere.
+  // - Lorsqu'on rencontrera un caractere '#' on ajoutera un mur
+  // - Lorsqu'on rencontrera un caractere '.' on ajoutera un tuile de sol et
+  // de la nourriture
+  // - Lorsqu'on rencontrera un caractere '*' on ajoutera un tuile de sol et
+  // de la superfood
+  // - Lorsqu'on rencontrera un caractere ' ' on ajoutera uniquement une tuile
+  // de sol.
+  // - Lorsqu'on rencontrera un caractere '@' on injectera le 1er joueur
+  // - Lorsqu'on rencontrera un caractere '!' on injectera le 2nd joueur
+  *ignored = 0;
+  x = 0;
+  y = 0;
+  for (size_t i = 0; i < len; i++) {
+    uint8_t tile;
+    switch (text[i]) {
+    case '#':
+      tile = WALL;
       break;
     case '.':
-      send_spawn_item(x, y, FLOOR, fdbcast);
-      send_spawn_item(x, y, FOOD, fdbcast);
-      state->map[pos] = FOOD;
-      state->food_count++;
-      x++;
-      pos++;
+      tile = FOOD;
       break;
     case '*':
-      send_spawn_item(x, y, FLOOR, fdbcast);
-      send_spawn_item(x, y, SUPERFOOD, fdbcast);
-      state->map[pos] = SUPERFOOD;
-      state->food_count++;
-      x++;
-      pos++;
+      tile = SUPERFOOD;
       break;
     case ' ':
-      send_spawn_item(x, y, FLOOR, fdbcast);
-      state->map[pos] = FLOOR;
-      x++;
-      pos++;
+      tile = FLOOR;
       break;
     case '@':
-      send_spawn_item(x, y, PLAYER1, fdbcast); // player 1
-      send_spawn_item(x, y, FLOOR, fdbcast);
-      state->map[pos] = FLOOR;
-      state->positions[0].x = x;
-      state->positions[0].y = y;
-      x++;
-      pos++;
+      tile = PLAYER1;
       break;
     case '!':
-      send_spawn_item(x, y, PLAYER2, fdbcast); // player 2
-      send_spawn_item(x, y, FLOOR, fdbcast);
-      state->map[pos] = FLOOR;
-      state->positions[1].x = x;
-      state->positions[1].y = y;
-      x++;
-      pos++;
+      tile = PLAYER2;
       break;
     case '\n':
       y++;
       x = 0;
-      break;
+      continue;
     default:
       // par défaut on ne fait simplement rien
-      break;
+      if (text[i] != '\r') {
+        (*ignored)++;
+      }
+      continue;
+    }
+    if (x < *width && y < *height) {
+      tiles[y * *width + x] = tile;
+    } else {
+      (*ignored)++;
+    }
+    x++;
+  }
+  return tiles;
+}
+
+/* Cette fonction génère, à partir des tuiles d'une carte, la suite de
+ * messages nécessaires à la dessiner et renvoie la structure GameState, à la
+ * taille de la carte, qui sera utilisée pour maintenir l'état courant du jeu.
+ */
+static struct GameState *__load_tiles(const uint8_t *tiles, uint32_t width,
+                                      uint32_t height,
+                                      const struct MessageSink *sink) {
+  struct GameState *state = gamestate_create(width, height);
+  if (sink->buf != NULL) {
+    message_buffer_reserve(sink->buf, spawn_capacity(width, height));
+  }
+
+  for (uint32_t y = 0; y < height; y++) {
+    for (uint32_t x = 0; x < width; x++) {
+      size_t pos = (size_t)y * width + x;
+      switch (tiles[y * width + x]) {
+      case WALL:
+        __sink_spawn_item(state, x, y, WALL, sink);
+        gamestate_set_tile(state, pos, WALL);
+        break;
+      case FOOD:
+        __sink_spawn_item(state, x, y, FLOOR, sink);
+        __sink_spawn_item(state, x, y, FOOD, sink);
+        gamestate_set_tile(state, pos, FOOD);
+        state->food_count++;
+        break;
+      case SUPERFOOD:
+        __sink_spawn_item(state, x, y, FLOOR, sink);
+        __sink_spawn_item(state, x, y, SUPERFOOD, sink);
+        gamestate_set_tile(state, pos, SUPERFOOD);
+        state->food_count++;
+        break;
+      case FLOOR:
+        __sink_spawn_item(state, x, y, FLOOR, sink);
+        gamestate_set_tile(state, pos, FLOOR);
+        break;
+      case PLAYER1:
+        __sink_spawn_item(state, x, y, PLAYER1, sink); // player 1
+        __sink_spawn_item(state, x, y, FLOOR, sink);
+        gamestate_set_tile(state, pos, FLOOR);
+        state->positions[0].x = x;
+        state->positions[0].y = y;
+        break;
+      case PLAYER2:
+        __sink_spawn_item(state, x, y, PLAYER2, sink); // player 2
+        __sink_spawn_item(state, x, y, FLOOR, sink);
+        gamestate_set_tile(state, pos, FLOOR);
+        state->positions[1].x = x;
+        state->positions[1].y = y;
+        break;
+      default:
+        // TILE_NONE: cette case n'existe pas
+        break;
+      }
     }
   }
 
   if (state->food_count == 0) {
     state->game_over = true;
-    send_game_over(PLAYER1, fdbcast);
+    __sink_game_over(PLAYER1, sink);
   } else {
     state->game_over = false;
   }
+  return state;
+}
+
+/* Cette fonction lit la map stockée dans le fichier 'resources/map.txt' et
+ * génère une suite de messages qui sont écrits l'un à la suite de lautre sur la
+ * sortie standard du programme.
+ *
+ * De plus, renvoie une structure de type GameState que vous pouvez utiliser
+ * pour maintenir une copie l'état courant du jeu.
+ */
+static struct GameState *__load_map(FileDescriptor fdmap,
+                                    const struct MessageSink *sink) {
+  size_t len = 0;
+  char *text = __read_all(fdmap, &len);
+  uint32_t width;
+  uint32_t height;
+  size_t ignored;
+  uint8_t *tiles = map_text_to_tiles(text, len, &width, &height, &ignored);
+  free(text);
+  struct GameState *state = __load_tiles(tiles, width, height, sink);
+  free(tiles);
+  return state;
+}
+
+size_t spawn_capacity(uint32_t width, uint32_t height) {
+  return 2 * (size_t)width * height + 1;
+}
+
+// Les messages sont d'abord accumulés dans un buffer contigu puis envoyés en
+// un seul appel: sinon, dessiner la carte coute un write par tuile.
+struct GameState *load_map(FileDescriptor fdmap, FileDescriptor fdbcast) {
+  struct MessageBuffer buf;
+  // agrandi à la taille de la carte une fois celle-ci lue
+  message_buffer_init(&buf, 1);
+  struct GameState *state = load_map_buf(fdmap, &buf);
+  message_buffer_flush(&buf, fdbcast);
+  message_buffer_free(&buf);
+  return state;
+}
+
+struct GameState *load_map_buf(FileDescriptor fdmap,
+                               struct MessageBuffer *out) {
+  struct MessageSink sink = {.fd = -1, .buf = out};
+  return __load_map(fdmap, &sink);
+}
+
+struct GameState *load_tiles_buf(const uint8_t *tiles, uint32_t width,
+                                 uint32_t height, struct MessageBuffer *out) {
+  struct MessageSink sink = {.fd = -1, .buf = out};
+  return __load_tiles(tiles, width, height, &sink);
 }
 
 // Cette fonction ecrit le message approprié pour signifier à un client qu'il
@@ -211,51 +589,82 @@ void send_registered(uint32_t player, FileDescriptor socket) {
 
 // Cette fonction ecrit le message approprié pour signifier aux clients qu'une
 // resource donnée est introduite dans le jeu.
-void send_spawn_item(uint32_t x, uint32_t y, enum Item item,
-                     FileDescriptor fdbcast) {
+void send_spawn_item(const struct GameState *state, uint32_t x, uint32_t y,
+                     enum Item item, FileDescriptor fdbcast) {
+  struct MessageSink sink = {.fd = fdbcast, .buf = NULL};
+  __sink_spawn_item(state, x, y, item, &sink);
+}
+
+static void __sink_spawn_item(const struct GameState *state, uint32_t x,
+                              uint32_t y, enum Item item,
+                              const struct MessageSink *sink) {
   union Message msg = {.spawn = {.msgt = SPAWN,
-                                 .id = id(x, y, item),
+                                 .id = id(state, x, y, item),
                                  .item = item,
                                  .pos = {.x = x, .y = y}}};
 
-  swrite(fdbcast, &msg, sizeof(union Message));
+  __emit(sink, &msg);
 }
 
 // Cette fonction ecrit le message approprié pour signifier aux clients qu'un
 // des joueurs a bougé sur le plateau de jeu.
-void send_player_moved(enum Item player, struct Position to,
-                       FileDescriptor fdbcast) {
-  union Message msg = {
-      .movement = {.msgt = MOVEMENT, .id = id_at(to, player), .pos = to}};
-  swrite(fdbcast, &msg, sizeof(union Message));
+void send_player_moved(const struct GameState *state, enum Item player,
+                       struct Position to, FileDescriptor fdbcast) {
+  struct MessageSink sink = {.fd = fdbcast, .buf = NULL};
+  __sink_player_moved(state, player, to, &sink);
+}
+
+static void __sink_player_moved(const struct GameState *state,
+                                enum Item player, struct Position to,
+                                const struct MessageSink *sink) {
+  union Message msg = {.movement = {
+                           .msgt = MOVEMENT,
+                           .id = id_at(state, to, player),
+                           .pos = to,
+                       }};
+  __emit(sink, &msg);
 }
 
 // Cette fonction ecrit le message approprié pour signifier aux clients que
 // de la nourriture ou superfood a été mangée par un joueur.
-void send_eat_food(enum Item player, enum Item food, struct Position to,
-                   FileDescriptor fdbcast) {
+void send_eat_food(const struct GameState *state, enum Item player,
+                   enum Item food, struct Position to, FileDescriptor fdbcast) {
+  struct MessageSink sink = {.fd = fdbcast, .buf = NULL};
+  __sink_eat_food(state, player, food, to, &sink);
+}
+
+static void __sink_eat_food(const struct GameState *state, enum Item player,
+                            enum Item food, struct Position to,
+                            const struct MessageSink *sink) {
   union Message msg = {.eat_food = {
                            .msgt = EAT_FOOD,
-                           .eater = id_at(to, player),
-                           .food = id_at(to, food),
+                           .eater = id_at(state, to, player),
+                           .food = id_at(state, to, food),
                        }};
 
-  swrite(fdbcast, &msg, sizeof(union Message));
+  __emit(sink, &msg);
 }
 
 // Cette fonction ecrit le message approprié pour signifier aux clients que
 // la partie est terminée.
 void send_game_over(enum Item winner, FileDescriptor fdbcast) {
+  struct MessageSink sink = {.fd = fdbcast, .buf = NULL};
+  __sink_game_over(winner, &sink);
+}
+
+static void __sink_game_over(enum Item winner,
+                             const struct MessageSink *sink) {
   union Message msg = {
       .game_over = {.msgt = GAME_OVER, .winner = winner == PLAYER1 ? 1 : 2}};
-  swrite(fdbcast, &msg, sizeof(union Message));
+  __emit(sink, &msg);
 }
 
 // Cette fonction renvoie la prochaine position du joueur après
 // avoir traité le déplacement dans la direction 'dir'. Il est
 // important de noter que la position renvoyée peut être impossible
 //  à atteindre.
-static struct Position __next_position(struct Position pos,
+static struct Position __next_position(const struct GameState *state,
+                                       struct Position pos,
                                        enum Direction dir) {
   struct Position next = pos;
   switch (dir) {
@@ -265,7 +674,7 @@ static struct Position __next_position(struct Position pos,
     }
     break;
   case DOWN:
-    if (next.y < HEIGHT - 1) {
+    if (next.y + 1 < state->height) {
       next.y += 1;
     }
     break;
@@ -275,7 +684,7 @@ static struct Position __next_position(struct Position pos,
     }
     break;
   case RIGHT:
-    if (next.x < WIDTH - 1) {
+    if (next.x + 1 < state->width) {
       next.x += 1;
     }
     break;
@@ -290,56 +699,57 @@ static struct Position __next_position(struct Position pos,
 //
 // Par ailleurs, cette fonction renvoie 'true' si la partie est
 // terminée, false sinon.
-bool process_user_command(struct GameState *state, enum Item player,
-                          enum Direction dir, FileDescriptor fdbcast) {
+static bool __process_user_command(struct GameState *state, enum Item player,
+                                   enum Direction dir,
+                                   const struct MessageSink *sink) {
   if (state->game_over) {
     enum Item winner = state->scores[0] > state->scores[1] ? PLAYER1 : PLAYER2;
-    send_game_over(winner, fdbcast);
+    __sink_game_over(winner, sink);
     return true;
   }
 
   size_t player_offset = player == PLAYER1 ? 0 : 1;
-  struct Position next = __next_position(state->positions[player_offset], dir);
+  struct Position next = __next_position(state, state->positions[player_offset], dir);
   struct Position other = state->positions[(player_offset + 1) % 2];
 
   // Si l'autre joueur se trouve sur la case destination, le jeu est fini.
   if (next.x == other.x && next.y == other.y) {
     state->game_over = true;
     enum Item winner = state->scores[0] > state->scores[1] ? PLAYER1 : PLAYER2;
-    send_game_over(winner, fdbcast);
+    __sink_game_over(winner, sink);
     return true;
   }
 
   // La partie n'est pas finie, il faut mettre l'état à jour et envoyer une
   // série de messages.
-  size_t next_offset = position2index(next);
-  enum Item at_next = state->map[next_offset];
+  size_t next_offset = position2index(state, next);
+  enum Item at_next = gamestate_tile(state, next_offset);
   switch (at_next) {
   case FLOOR:
     state->positions[player_offset] = next;
-    send_player_moved(player, next, fdbcast);
+    __sink_player_moved(state, player, next, sink);
     break;
   case FOOD:
-    state->map[next_offset] = FLOOR;
+    gamestate_set_tile(state, next_offset, FLOOR);
     state->positions[player_offset] = next;
     state->scores[player_offset] += 1;
     state->food_count--;
     if (state->food_count == 0) {
       state->game_over = true;
     }
-    send_player_moved(player, next, fdbcast);
-    send_eat_food(player, at_next, next, fdbcast);
+    __sink_player_moved(state, player, next, sink);
+    __sink_eat_food(state, player, at_next, next, sink);
     break;
   case SUPERFOOD:
-    state->map[next_offset] = FLOOR;
+    gamestate_set_tile(state, next_offset, FLOOR);
     state->positions[player_offset] = next;
     state->scores[player_offset] += 17;
     state->food_count--;
     if (state->food_count == 0) {
       state->game_over = true;
     }
-    send_player_moved(player, next, fdbcast);
-    send_eat_food(player, at_next, next, fdbcast);
+    __sink_player_moved(state, player, next, sink);
+    __sink_eat_food(state, player, at_next, next, sink);
     break;
   default:
     /* do nothing */
@@ -348,7 +758,19 @@ bool process_user_command(struct GameState *state, enum Item player,
 
   if (state->game_over) {
     enum Item winner = state->scores[0] > state->scores[1] ? PLAYER1 : PLAYER2;
-    send_game_over(winner, fdbcast);
+    __sink_game_over(winner, sink);
   }
   return state->game_over;
 }
+
+bool process_user_command(struct GameState *state, enum Item player,
+                          enum Direction dir, FileDescriptor fdbcast) {
+  struct MessageSink sink = {.fd = fdbcast, .buf = NULL};
+  return __process_user_command(state, player, dir, &sink);
+}
+
+bool process_user_command_buf(struct GameState *state, enum Item player,
+                              enum Direction dir, struct MessageBuffer *out) {
+  struct MessageSink sink = {.fd = -1, .buf = out};
+  return __process_user_command(state, player, dir, &sink);
+}
@@ -9,22 +9,32 @@
 
 #define NB_PLAYERS 2
 
+// Les dimensions d'une carte sont lues avec la carte elle-même. WIDTH et
+// HEIGHT (cf. pascman.h) ne sont plus que les dimensions des cartes que
+// l'interface graphique sait afficher; le serveur accepte des cartes
+// jusqu'à MAX_WIDTH x MAX_HEIGHT.
+#define MAX_WIDTH 4096
+#define MAX_HEIGHT 4096
+
 // Tous les éléments du jeu ont un identifiant qui peut être 
 // choisi arbitrairement. Par facilité, on va opter pour le
-// schéma suivant:
+// schéma suivant, où map_size = width * height est la taille
+// de la carte en cours:
 // - Les items de type FOOD et SUPERFOOD sont dans le range
-//   (0..MAP_SIZE), ce qui veut dire qu'on peut directement 
+//   (0..map_size), ce qui veut dire qu'on peut directement 
 //   convertir l'identifiant en position sur la map et vice
 //   versa.
 // - Les items de type WALL et FLOOR ont un identifiant dans
-//   le range (MAP_SIZE, 2*MAP_SIZE) parce qu'en fait, on 
+//   le range (map_size, 2*map_size) parce qu'en fait, on 
 //   n'aura jamais besoin de manipuler leurs id.
-// - Les itesm de type PLAYER1, PLAYER2 sont dans le range 3*MAP_SIZE
-//   et 3*MAP_SIZE + 1. Ce qui permet de connaitre immédiatement
+// - Les itesm de type PLAYER1, PLAYER2 sont dans le range 3*map_size
+//   et 3*map_size + 1. Ce qui permet de connaitre immédiatement
 //   l'id d'un joueur, de retrouver le joueur en fonction de
 //   son id.
-#define PLAYER1_ID (3 * MAP_SIZE)
-#define PLAYER2_ID (3 * MAP_SIZE + 1)
+// Sur une carte de 30x20, ces identifiants sont ceux qu'attend l'interface
+// graphique.
+#define PLAYER1_ID(map_size) (3 * (map_size))
+#define PLAYER2_ID(map_size) (3 * (map_size) + 1)
 
 // Juste histoire de rendre le code plus facile à lire.
 typedef int FileDescriptor;
@@ -36,26 +46,132 @@ typedef int FileDescriptor;
 // Il s'agit ici de l'état partagé par tous les processus
 // qui tournent sur le server. C'est lui qui sera stocké en
 // mémoire partagée.
+//
+// Sa taille dépend des dimensions de la carte: elle doit être allouée avec
+// gamestate_create() (ou gamestate_size() octets en mémoire partagée) et
+// copiée avec gamestate_copy().
 struct GameState
 {
-    // Pour chaque position de la carte, on va stocker le
-    // type d'item qui se trouve à la position. Les joueurs, 
-    // par contre, ne sont pas stockés comme éléments de la 
-    // carte: leur position est gérée à part.
-    // Dans la pratique, ca nous permettra de savoir:
-    // 1. Si un mouvement est possible (destionation != wall)
-    // 2. Quelle food ou superfood on a mangé.
-    enum Item map[MAP_SIZE];
+    // Les dimensions de la carte.
+    uint32_t width;
+    uint32_t height;
     // Ce tableau stocke le score de chacun des deux joueurs.
     int scores[NB_PLAYERS];
     // Compte le nombre d'éléménts qui peuvent encore être mangés sur le plateau.
+    // C'est toujours le popcount des couches FOOD et SUPERFOOD (cf.
+    // gamestate_count_food), tenu à jour pour que la fin de partie se teste
+    // en O(1).
     int food_count;
     // Ce tableau stocke la position de chacun des deux joueurs.
     struct Position positions[NB_PLAYERS];
     // la partie est-elle en cours ou bien terminée ?
     bool game_over;
+    // Pour chaque position de la carte (width x height, ligne par ligne), on
+    // va stocker le type d'item qui se trouve à la position. Les joueurs, 
+    // par contre, ne sont pas stockés comme éléments de la 
+    // carte: leur position est gérée à part.
+    // Dans la pratique, ca nous permettra de savoir:
+    // 1. Si un mouvement est possible (destionation != wall)
+    // 2. Quelle food ou superfood on a mangé.
+    //
+    // Une tuile ne vaut jamais que WALL, FLOOR, FOOD ou SUPERFOOD. La carte
+    // est stockée sous forme de 3 bitboards (un bit par case, ligne par
+    // ligne) de gamestate_layer_words() mots chacune, l'une après l'autre:
+    // - LAYER_FLOOR: les cases où l'on peut marcher (tout sauf les murs),
+    // - LAYER_FOOD: les cases où il reste de la nourriture,
+    // - LAYER_SUPERFOOD: les cases où il reste de la superfood.
+    // Elle ne doit être lue ou modifiée qu'avec gamestate_tile() et
+    // gamestate_set_tile(), les comptages se font par popcount. Une carte de
+    // 30x20 tient ainsi en 240 octets au lieu de 2400.
+    uint64_t map[];
 };
 
+#define LAYER_FLOOR 0
+#define LAYER_FOOD 1
+#define LAYER_SUPERFOOD 2
+#define NB_LAYERS 3
+
+// Renvoie le nombre de mots de 64 bits d'une bitboard de la carte.
+size_t gamestate_layer_words(const struct GameState *state);
+
+// Renvoie la bitboard 'layer' (LAYER_FLOOR, LAYER_FOOD ou LAYER_SUPERFOOD).
+const uint64_t *gamestate_layer(const struct GameState *state, int layer);
+
+// Renvoie l'item (WALL, FLOOR, FOOD ou SUPERFOOD) qui se trouve à la position
+// 'index' (cf. position2index) de la carte. Une case inexistante est un mur.
+enum Item gamestate_tile(const struct GameState *state, size_t index);
+
+// Place l'item 'item' (WALL, FLOOR, FOOD ou SUPERFOOD) à la position 'index'
+// de la carte.
+void gamestate_set_tile(struct GameState *state, size_t index, enum Item item);
+
+// Renvoie le nombre de FOOD et SUPERFOOD restant sur la carte, recompté par
+// popcount (state->food_count en est la version tenue à jour).
+int gamestate_count_food(const struct GameState *state);
+
+// Renvoie le nombre de FOOD et SUPERFOOD restant dans le rectangle de
+// 'w' x 'h' cases dont le coin supérieur gauche est en (x, y). Le rectangle
+// est tronqué aux bords de la carte.
+int gamestate_region_food(const struct GameState *state, uint32_t x, uint32_t y, uint32_t w, uint32_t h);
+
+// Compare la nourriture de deux états d'une même carte (par exemple un
+// snapshot et l'état courant) et renvoie le nombre de cases qui diffèrent.
+// Si 'diff' n'est pas NULL, il reçoit la bitboard (gamestate_layer_words()
+// mots) de ces cases.
+size_t gamestate_food_diff(const struct GameState *a, const struct GameState *b, uint64_t *diff);
+
+// Renvoie la taille en octets d'un GameState pour une carte width x height.
+size_t gamestate_size(uint32_t width, uint32_t height);
+
+// Alloue (malloc) un GameState pour une carte width x height et le
+// réinitialise (cf. reset_gamestate).
+struct GameState *gamestate_create(uint32_t width, uint32_t height);
+
+// Copie 'src' dans 'dst', qui doit pouvoir contenir une carte de la taille
+// de celle de 'src'.
+void gamestate_copy(struct GameState *dst, const struct GameState *src);
+
+//#############################################################################
+// MESSAGE BUFFER
+//#############################################################################
+
+// Un MessageBuffer accumule en mémoire les messages produits par le jeu au
+// lieu de les écrire un par un sur un FileDescriptor. C'est ce qui permet à
+// un serveur qui n'utilise pas de broadcaster d'envoyer le résultat d'une
+// commande à chacun des joueurs en un seul appel système.
+struct MessageBuffer
+{
+    union Message *msgs;
+    size_t count;
+    size_t capacity;
+};
+
+// Initialise un buffer vide pouvant contenir 'capacity' messages avant de
+// devoir grandir.
+void message_buffer_init(struct MessageBuffer *buf, size_t capacity);
+
+// Agrandit le buffer (en une fois) pour qu'il puisse recevoir 'count'
+// messages de plus sans grandir.
+void message_buffer_reserve(struct MessageBuffer *buf, size_t count);
+
+// Ajoute une copie de 'msg' à la fin du buffer (qui grandit si nécessaire).
+void message_buffer_push(struct MessageBuffer *buf, const union Message *msg);
+
+// Vide le buffer sans libérer sa mémoire.
+void message_buffer_clear(struct MessageBuffer *buf);
+
+// Ecrit tous les messages du buffer sur 'fd' en un seul appel puis le vide.
+void message_buffer_flush(struct MessageBuffer *buf, FileDescriptor fd);
+
+// Libère la mémoire du buffer.
+void message_buffer_free(struct MessageBuffer *buf);
+
+// Retire du buffer chaque MOVEMENT suivi plus loin d'un autre MOVEMENT du
+// même élément : seule la dernière position de chaque joueur est gardée. Les
+// autres messages (EAT_FOOD, GAME_OVER...) et l'ordre sont conservés.
+// RES: le nombre de messages retirés.
+size_t message_buffer_coalesce(struct MessageBuffer *buf);
+
 //#############################################################################
 // INITIALISATION
 //#############################################################################
@@ -63,17 +179,54 @@ struct GameState
 // Cette réinitialise un objet GameState ce qui permet de s'assurer
 // que toutes les valeurs soient correctement initialisées
 // (par exemple en mettant -1 partout dans le champ 'food').
+// Les dimensions de la carte sont conservées.
 void reset_gamestate(struct GameState *state);
 
 // Cette fonction lit la map stockée dans le fichier 'fdmap' et génère une suite
 // de messages qui sont écrits l'un à la suite de lautre sur le pipe 'fdbcast'.
 // 
-// De plus, va peupler une structure de type GameState passée en parametre qui 
-// sera utilisée pour maintenir une l'état courant du jeu.
+// De plus, renvoie une structure de type GameState (allouée dynamiquement, à
+// libérer avec free) qui sera utilisée pour maintenir une l'état courant du
+// jeu.
+//
+// La carte est lue en une seule fois et tous les messages sont envoyés sur
+// 'fdbcast' en un seul write.
 //
 // NOTE: Cette fonction ne ferme AUCUN FileDescriptor. C'est dont l'appelant
 //       qui doit s'en charger.
-void load_map(FileDescriptor fdmap, FileDescriptor fdbcast, struct GameState *state);
+struct GameState *load_map(FileDescriptor fdmap, FileDescriptor fdbcast);
+
+// Idem load_map, mais les messages sont ajoutés au buffer 'out' au lieu d'être
+// écrits sur un FileDescriptor.
+struct GameState *load_map_buf(FileDescriptor fdmap, struct MessageBuffer *out);
+
+//#############################################################################
+// TUILES
+//#############################################################################
+
+// Une carte peut aussi être décrite par un tableau de width x height tuiles
+// d'un octet, ligne par ligne. Chaque tuile vaut l'item qui s'y trouve au
+// début de la partie (WALL, FLOOR, FOOD, SUPERFOOD, ou PLAYER1/PLAYER2 pour
+// la case de départ d'un joueur, qui est du sol) ou TILE_NONE si la case
+// n'existe pas.
+#define TILE_NONE 0
+
+// Cette fonction convertit le texte d'une carte (cf. load_map) en tuiles.
+// 'width'/'height' reçoivent les dimensions de la carte (sa plus longue ligne
+// et son nombre de lignes), qui ne dépassent jamais MAX_WIDTH x MAX_HEIGHT,
+// et 'ignored' le nombre de caractères ignorés (inconnus ou hors de la carte).
+//
+// Renvoie les tuiles, allouées dynamiquement (à libérer avec free).
+uint8_t *map_text_to_tiles(const char *text, size_t len, uint32_t *width, uint32_t *height, size_t *ignored);
+
+// Idem load_map_buf, mais la carte est donnée sous forme de tuiles.
+struct GameState *load_tiles_buf(const uint8_t *tiles, uint32_t width, uint32_t height, struct MessageBuffer *out);
+
+// Renvoie le nombre maximal de messages envoyés pour dessiner une carte de
+// width x height tuiles (deux par case, plus un GAME_OVER si elle n'a pas de
+// nourriture). load_map_buf et load_tiles_buf réservent cette place dans
+// 'out' avant d'y écrire.
+size_t spawn_capacity(uint32_t width, uint32_t height);
 
 // Cette fonction ecrit le message approprié pour signifier à un client qu'il enregistré
 // et qu'il peut commencer à jouer.
@@ -92,4 +245,8 @@ void send_registered(uint32_t player, FileDescriptor socket);
 // terminée, false sinon.
 bool process_user_command(struct GameState* state, enum Item player, enum Direction dir, FileDescriptor fdbcast);
 
+// Idem process_user_command, mais les messages sont ajoutés au buffer 'out'
+// au lieu d'être écrits sur un FileDescriptor.
+bool process_user_command_buf(struct GameState* state, enum Item player, enum Direction dir, struct MessageBuffer *out);
+
 #endif //__SERVER_SHARED__
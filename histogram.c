@@ -0,0 +1,101 @@
+#include <string.h>
+
+#include "histogram.h"
+
+// Index of the bucket of 'value'. Values below HISTOGRAM_SUB_BUCKETS each
+// have their own bucket, the others keep their HISTOGRAM_SUB_BUCKET_BITS
+// most significant bits.
+static int __bucket(uint64_t value) {
+  if (value < HISTOGRAM_SUB_BUCKETS) {
+    return (int)value;
+  }
+  int magnitude = 63 - __builtin_clzll(value);
+  if (magnitude >= HISTOGRAM_MAGNITUDES) {
+    return HISTOGRAM_BUCKETS - 1;
+  }
+  int shift = magnitude - HISTOGRAM_SUB_BUCKET_BITS + 1;
+  // the top bit is implied by the magnitude
+  int sub = (int)(value >> shift) - HISTOGRAM_SUB_BUCKETS / 2;
+  return HISTOGRAM_SUB_BUCKETS + (shift - 1) * (HISTOGRAM_SUB_BUCKETS / 2) +
+         sub;
+}
+
+// Highest value counted in bucket 'index'.
+static uint64_t __bucket_high(int index) {
+  if (index < HISTOGRAM_SUB_BUCKETS) {
+    return (uint64_t)index;
+  }
+  int shift = (index - HISTOGRAM_SUB_BUCKETS) / (HISTOGRAM_SUB_BUCKETS / 2) + 1;
+  uint64_t sub = (index - HISTOGRAM_SUB_BUCKETS) % (HISTOGRAM_SUB_BUCKETS / 2) +
+                 HISTOGRAM_SUB_BUCKETS / 2;
+  return ((sub + 1) << shift) - 1;
+}
+
+void histogram_reset(struct Histogram *h) {
+  memset(h, 0, sizeof(*h));
+  h->min = UINT64_MAX;
+}
+
+void histogram_record(struct Histogram *h, uint64_t value) {
+  h->buckets[__bucket(value)]++;
+  h->count++;
+  h->sum += value;
+  if (value < h->min) {
+    h->min = value;
+  }
+  if (value > h->max) {
+    h->max = value;
+  }
+}
+
+void histogram_merge(struct Histogram *into, const struct Histogram *from) {
+  for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    into->buckets[i] += from->buckets[i];
+  }
+  into->count += from->count;
+  into->sum += from->sum;
+  if (from->min < into->min) {
+    into->min = from->min;
+  }
+  if (from->max > into->max) {
+    into->max = from->max;
+  }
+}
+
+uint64_t histogram_percentile(const struct Histogram *h, double percentile) {
+  if (h->count == 0) {
+    return 0;
+  }
+  uint64_t rank = (uint64_t)(percentile / 100.0 * h->count + 0.5);
+  if (rank == 0) {
+    rank = 1;
+  }
+  uint64_t seen = 0;
+  for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    seen += h->buckets[i];
+    if (seen >= rank) {
+      // the bucket may be wider than the values it actually holds, the
+      // last one holds every value out of range
+      uint64_t high = __bucket_high(i);
+      return high < h->max && i < HISTOGRAM_BUCKETS - 1 ? high : h->max;
+    }
+  }
+  return h->max;
+}
+
+void histogram_print(const struct Histogram *h, const char *name,
+                     const char *unit, FILE *out) {
+  if (h->count == 0) {
+    fprintf(out, "%s: n=0\n", name);
+    return;
+  }
+  fprintf(out,
+          "%s: n=%llu min=%llu%s p50=%llu%s p90=%llu%s p99=%llu%s "
+          "p99.9=%llu%s max=%llu%s\n",
+          name, (unsigned long long)h->count, (unsigned long long)h->min, unit,
+          (unsigned long long)histogram_percentile(h, 50), unit,
+          (unsigned long long)histogram_percentile(h, 90), unit,
+          (unsigned long long)histogram_percentile(h, 99), unit,
+          (unsigned long long)histogram_percentile(h, 99.9), unit,
+          (unsigned long long)h->max, unit);
+}
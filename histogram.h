@@ -0,0 +1,58 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * A histogram counts values (durations, in whatever unit the caller picks)
+ * in log-linear buckets, like an HDR histogram: every power of two is split
+ * into HISTOGRAM_SUB_BUCKETS / 2 buckets of equal width, so any percentile
+ * is known within 2/HISTOGRAM_SUB_BUCKETS (about 3%) of its value whatever
+ * the range, and recording a value is a few shifts and an increment. The
+ * buckets live in the structure itself: a histogram can be put in shared
+ * memory and needs no allocation.
+ */
+
+#define HISTOGRAM_SUB_BUCKET_BITS 6
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BUCKET_BITS)
+// values up to 2^HISTOGRAM_MAGNITUDES - 1 are told apart, larger ones land
+// in the last bucket
+#define HISTOGRAM_MAGNITUDES 40
+#define HISTOGRAM_BUCKETS                                                      \
+  (HISTOGRAM_SUB_BUCKETS + (HISTOGRAM_MAGNITUDES - HISTOGRAM_SUB_BUCKET_BITS) * \
+                               (HISTOGRAM_SUB_BUCKETS / 2))
+
+struct Histogram {
+  uint64_t count;
+  uint64_t sum;
+  uint64_t min;
+  uint64_t max;
+  uint64_t buckets[HISTOGRAM_BUCKETS];
+};
+
+// POST: 'h' is empty.
+void histogram_reset(struct Histogram *h);
+
+// POST: 'value' has been counted in 'h'.
+void histogram_record(struct Histogram *h, uint64_t value);
+
+// POST: every value counted in 'from' is counted in 'into' too.
+void histogram_merge(struct Histogram *into, const struct Histogram *from);
+
+/**
+ * PRE: 0 <= 'percentile' <= 100.
+ * RES: the value below which 'percentile' % of the values of 'h' are (the
+ *      highest value of its bucket), 0 if 'h' is empty.
+ */
+uint64_t histogram_percentile(const struct Histogram *h, double percentile);
+
+/**
+ * POST: one line "<name>: n=.. min=.. p50=.. p90=.. p99=.. p99.9=.. max=.."
+ *       describing 'h' has been written on 'out', the values followed by
+ *       'unit'.
+ */
+void histogram_print(const struct Histogram *h, const char *name,
+                     const char *unit, FILE *out);
+
+#endif // HISTOGRAM_H
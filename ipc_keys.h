@@ -1,11 +0,0 @@
-#ifndef IPC_KEYS_H
-#define IPC_KEYS_H
-
-/**
- * This header file contains the definitions of the keys used for IPC
- * The keys has been chosen randomly (with command $RANDOM)
- */
-#define SEM_KEY 26078
-#define SHM_KEY 4597
-
-#endif // IPC_KEYS_H
@@ -0,0 +1,154 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "map_cache.h"
+#include "metrics.h"
+#include "utils_v3.h"
+
+static pthread_mutex_t __cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct CompiledMap *__cache = NULL;
+
+// Rebuilds the tiles of the map from its spawn stream (a tile spawns its
+// floor before, or after, what stands on it).
+static uint8_t *__spawn_tiles(const struct CompiledMap *map) {
+  uint32_t width = map->initial->width;
+  size_t size = (size_t)width * map->initial->height;
+  uint8_t *tiles = smalloc(size);
+  memset(tiles, TILE_NONE, size);
+  for (size_t i = 0; i < map->spawn.count; i++) {
+    const union Message *msg = &map->spawn.msgs[i];
+    if (msg->msgt != SPAWN) {
+      continue;
+    }
+    size_t index = (size_t)msg->spawn.pos.y * width + msg->spawn.pos.x;
+    if (msg->spawn.item != FLOOR || tiles[index] == TILE_NONE) {
+      tiles[index] = (uint8_t)msg->spawn.item;
+    }
+  }
+  return tiles;
+}
+
+// Encodes the spawn stream of 'map' as a MAP_SNAPSHOT, provided that
+// expanding the snapshot gives back exactly the same stream.
+static void __compile_snapshot(struct CompiledMap *map) {
+  uint8_t *tiles = __spawn_tiles(map);
+  struct MessageBuffer expanded;
+  message_buffer_init(&expanded, map->spawn.count);
+  free(load_tiles_buf(tiles, map->initial->width, map->initial->height,
+                      &expanded));
+  map->snapshot = NULL;
+  map->snapshot_len = 0;
+  if (expanded.count == map->spawn.count &&
+      memcmp(expanded.msgs, map->spawn.msgs,
+             expanded.count * sizeof(union Message)) == 0) {
+    map->snapshot = wire_encode_snapshot(tiles, map->initial->width,
+                                         map->initial->height,
+                                         &map->snapshot_len);
+  }
+  message_buffer_free(&expanded);
+  free(tiles);
+}
+
+static struct CompiledMap *__compile(const char *path) {
+  // Binary maps (see pas_mapc) are mapped as is, text maps are parsed.
+  size_t image_len = 0;
+  const struct MapHeader *image = map_format_map(path, &image_len);
+  FileDescriptor fd = -1;
+  if (image == NULL) {
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+      perror(path);
+      return NULL;
+    }
+  }
+
+  struct CompiledMap *map = smalloc(sizeof(struct CompiledMap));
+  map->path = strdup(path);
+  checkNull(map->path, "Error strdup");
+  map->image = image;
+  map->image_len = image_len;
+  // sized by the loader once the dimensions are known
+  message_buffer_init(&map->spawn, 1);
+  if (image != NULL) {
+    map->initial = load_tiles_buf(map_format_tiles(image), image->width,
+                                  image->height, &map->spawn);
+  } else {
+    map->initial = load_map_buf(fd, &map->spawn);
+    sclose(fd);
+  }
+  map->spawn_v2 = wire_encode_all(WIRE_V2, map->spawn.msgs, map->spawn.count,
+                                  &map->spawn_v2_len);
+  __compile_snapshot(map);
+  map->next = NULL;
+  return map;
+}
+
+const struct CompiledMap *map_cache_get(const char *path) {
+  pthread_mutex_lock(&__cache_lock);
+  struct CompiledMap *map = __cache;
+  while (map != NULL && strcmp(map->path, path) != 0) {
+    map = map->next;
+  }
+  if (map == NULL) {
+    map = __compile(path);
+    if (map != NULL) {
+      map->next = __cache;
+      __cache = map;
+    }
+  }
+  pthread_mutex_unlock(&__cache_lock);
+  return map;
+}
+
+size_t map_cache_state_size(const struct CompiledMap *map) {
+  return gamestate_size(map->initial->width, map->initial->height);
+}
+
+void map_cache_reset_state(const struct CompiledMap *map,
+                           struct GameState *state) {
+  gamestate_copy(state, map->initial);
+}
+
+const void *map_cache_spawn(const struct CompiledMap *map, int version,
+                            size_t *len) {
+  if (version == WIRE_V3 && map->snapshot != NULL) {
+    *len = map->snapshot_len;
+    return map->snapshot;
+  }
+  if (version != WIRE_V1) {
+    *len = map->spawn_v2_len;
+    return map->spawn_v2;
+  }
+  *len = map->spawn.count * sizeof(union Message);
+  return map->spawn.msgs;
+}
+
+void map_cache_send(const struct CompiledMap *map, FileDescriptor fd,
+                    int version) {
+  size_t len;
+  const void *spawn = map_cache_spawn(map, version, &len);
+  nwrite(fd, spawn, len);
+  metrics_sent(METRICS_MSG_MAP, 1, len);
+}
+
+void map_cache_clear(void) {
+  pthread_mutex_lock(&__cache_lock);
+  while (__cache != NULL) {
+    struct CompiledMap *map = __cache;
+    __cache = map->next;
+    free(map->path);
+    free(map->initial);
+    if (map->image != NULL) {
+      map_format_unmap(map->image, map->image_len);
+    }
+    message_buffer_free(&map->spawn);
+    free(map->spawn_v2);
+    free(map->snapshot);
+    free(map);
+  }
+  pthread_mutex_unlock(&__cache_lock);
+}
@@ -0,0 +1,78 @@
+#ifndef MAP_CACHE_H
+#define MAP_CACHE_H
+
+#include "game.h"
+#include "map_format.h"
+#include "wire.h"
+
+/**
+ * A compiled map is a map file parsed once and for all: it holds the
+ * GameState of a match which has just started on that map and the
+ * pre-serialized spawn stream sent to every player. Starting a match is then
+ * a memcpy of the state and a single buffered send.
+ *
+ * Binary maps (see map_format.h) are mmap()ed read-only instead of being
+ * parsed, their pages are shared by every process of the server.
+ *
+ * Compiled maps are immutable and live until map_cache_clear() is called,
+ * they can be shared freely between rooms, processes (after fork) and
+ * threads.
+ */
+struct CompiledMap {
+  char *path;
+  // read-only mapping of a binary map, NULL for a text map
+  const struct MapHeader *image;
+  size_t image_len;
+  struct GameState *initial;
+  struct MessageBuffer spawn;
+  // the spawn stream in the compact encoding (see wire.h)
+  uint8_t *spawn_v2;
+  size_t spawn_v2_len;
+  // the same stream as a single MAP_SNAPSHOT message (wire version 3), NULL
+  // if the tiles cannot describe it exactly
+  uint8_t *snapshot;
+  size_t snapshot_len;
+  struct CompiledMap *next;
+};
+
+/**
+ * RES: the compiled version of the map stored at 'path'. The map is compiled
+ *      the first time it is requested and served from the cache afterwards,
+ *      so several maps may be cached at once. Thread safe.
+ *      Returns NULL if the map cannot be opened.
+ */
+const struct CompiledMap *map_cache_get(const char *path);
+
+/**
+ * RES: the size of the GameState of a match played on 'map' (see
+ *      gamestate_size()).
+ */
+size_t map_cache_state_size(const struct CompiledMap *map);
+
+/**
+ * PRE:  'state' can hold map_cache_state_size(map) bytes.
+ * POST: 'state' is the initial state of a match played on 'map'.
+ */
+void map_cache_reset_state(const struct CompiledMap *map,
+                           struct GameState *state);
+
+/**
+ * RES: the spawn stream of 'map' encoded in the wire 'version' (see
+ *      wire.h), whose size is put in 'len'.
+ */
+const void *map_cache_spawn(const struct CompiledMap *map, int version,
+                            size_t *len);
+
+/**
+ * POST: the spawn stream of 'map' has been written on 'fd' in one call,
+ *       encoded in the wire 'version'.
+ */
+void map_cache_send(const struct CompiledMap *map, FileDescriptor fd,
+                    int version);
+
+/**
+ * POST: every compiled map has been released.
+ */
+void map_cache_clear(void);
+
+#endif // MAP_CACHE_H
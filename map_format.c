@@ -0,0 +1,122 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "map_format.h"
+#include "utils_v3.h"
+
+int map_format_validate(const uint8_t *tiles, uint32_t width, uint32_t height,
+                        const char *name) {
+  if (width == 0 || height == 0 || width > MAX_WIDTH || height > MAX_HEIGHT) {
+    fprintf(stderr, "%s: invalid dimensions %ux%u (max %dx%d)\n", name, width,
+            height, MAX_WIDTH, MAX_HEIGHT);
+    return 1;
+  }
+  if (width != WIDTH || height != HEIGHT) {
+    fprintf(stderr, "%s: warning: %ux%u map, the GUI only displays %dx%d maps\n",
+            name, width, height, WIDTH, HEIGHT);
+  }
+
+  int errors = 0;
+  int spawns[NB_PLAYERS] = {0};
+  int food = 0;
+  int holes = 0;
+  for (size_t i = 0; i < (size_t)width * height; i++) {
+    switch (tiles[i]) {
+    case PLAYER1:
+      spawns[0]++;
+      break;
+    case PLAYER2:
+      spawns[1]++;
+      break;
+    case FOOD:
+    case SUPERFOOD:
+      food++;
+      break;
+    case WALL:
+    case FLOOR:
+      break;
+    case TILE_NONE:
+      holes++;
+      break;
+    default:
+      fprintf(stderr, "%s: unknown tile %u at (%zu, %zu)\n", name, tiles[i],
+              i % width, i / width);
+      errors++;
+    }
+  }
+  for (int i = 0; i < NB_PLAYERS; i++) {
+    if (spawns[i] != 1) {
+      fprintf(stderr, "%s: %d spawn(s) for player %d, expected 1\n", name,
+              spawns[i], i + 1);
+      errors++;
+    }
+  }
+  if (food == 0) {
+    fprintf(stderr, "%s: warning: no food, matches end immediately\n", name);
+  }
+  if (holes > 0) {
+    fprintf(stderr, "%s: warning: %d missing tile(s) (short lines)\n", name,
+            holes);
+  }
+  return errors;
+}
+
+void map_format_write(FileDescriptor fd, const uint8_t *tiles, uint32_t width,
+                      uint32_t height) {
+  struct MapHeader header = {.version = MAP_FORMAT_VERSION,
+                             .width = width,
+                             .height = height};
+  memcpy(header.magic, MAP_FORMAT_MAGIC, sizeof(header.magic));
+  for (size_t i = 0; i < (size_t)width * height; i++) {
+    if (tiles[i] == FOOD || tiles[i] == SUPERFOOD) {
+      header.food_count++;
+    } else if (tiles[i] == PLAYER1 || tiles[i] == PLAYER2) {
+      struct Position *spawn = &header.spawns[tiles[i] - PLAYER1];
+      spawn->x = i % width;
+      spawn->y = i / width;
+    }
+  }
+  nwrite(fd, &header, sizeof(header));
+  nwrite(fd, tiles, (size_t)width * height);
+}
+
+const struct MapHeader *map_format_map(const char *path, size_t *len) {
+  FileDescriptor fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return NULL;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(struct MapHeader)) {
+    close(fd);
+    return NULL;
+  }
+  void *image = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (image == MAP_FAILED) {
+    return NULL;
+  }
+
+  const struct MapHeader *header = image;
+  if (memcmp(header->magic, MAP_FORMAT_MAGIC, sizeof(header->magic)) != 0 ||
+      header->version != MAP_FORMAT_VERSION || header->width > MAX_WIDTH ||
+      header->height > MAX_HEIGHT ||
+      (size_t)st.st_size <
+          sizeof(struct MapHeader) + (size_t)header->width * header->height) {
+    munmap(image, st.st_size);
+    return NULL;
+  }
+  *len = st.st_size;
+  return header;
+}
+
+const uint8_t *map_format_tiles(const struct MapHeader *header) {
+  return (const uint8_t *)(header + 1);
+}
+
+void map_format_unmap(const struct MapHeader *header, size_t len) {
+  munmap((void *)header, len);
+}
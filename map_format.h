@@ -0,0 +1,62 @@
+#ifndef MAP_FORMAT_H
+#define MAP_FORMAT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "game.h"
+
+/**
+ * Binary map format produced by pas_mapc from the text maps. A binary map is
+ * a MapHeader immediately followed by width * height tiles of one byte each,
+ * row after row (see TILE_NONE in game.h for the tile values).
+ *
+ * The file is meant to be mmap()ed read-only: every process and room of a
+ * server instance then shares the same physical pages and starting a match
+ * never parses anything.
+ */
+#define MAP_FORMAT_MAGIC "PCMB"
+#define MAP_FORMAT_VERSION 1
+
+struct MapHeader {
+  char magic[4];
+  uint32_t version;
+  uint32_t width;
+  uint32_t height;
+  uint32_t food_count;
+  struct Position spawns[NB_PLAYERS];
+};
+
+/**
+ * Checks that a map is playable and prints a diagnostic on stderr for every
+ * problem, prefixed by 'name'. Errors are: dimensions out of bounds, not
+ * exactly one spawn per player. A map without food, with holes (TILE_NONE)
+ * or that the GUI cannot display (not WIDTH x HEIGHT) only gets a warning.
+ * RES: the number of errors found.
+ */
+int map_format_validate(const uint8_t *tiles, uint32_t width, uint32_t height,
+                        const char *name);
+
+/**
+ * POST: the binary image (header and tiles) of the map has been written on
+ *       'fd'.
+ */
+void map_format_write(FileDescriptor fd, const uint8_t *tiles, uint32_t width,
+                      uint32_t height);
+
+/**
+ * RES: a read-only mapping of the binary map stored at 'path' and its length
+ *      in 'len', or NULL if the file cannot be opened or is not a valid
+ *      binary map (e.g. a text map).
+ */
+const struct MapHeader *map_format_map(const char *path, size_t *len);
+
+// The tiles following 'header'.
+const uint8_t *map_format_tiles(const struct MapHeader *header);
+
+/**
+ * POST: the mapping returned by map_format_map() has been released.
+ */
+void map_format_unmap(const struct MapHeader *header, size_t len);
+
+#endif // MAP_FORMAT_H
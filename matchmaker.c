@@ -0,0 +1,391 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "matchmaker.h"
+#include "metrics.h"
+#include "utils_v3.h"
+#include "wire.h"
+
+// Time a new connection has to send its REGISTRATION word before it is
+// closed.
+#define REGISTRATION_TIMEOUT_S 5
+#define MAX_EVENTS 64
+
+static uint64_t __now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static void __set_cloexec(FileDescriptor fd) {
+  checkNeg(fcntl(fd, F_SETFD, FD_CLOEXEC), "Error fcntl F_SETFD");
+}
+
+static FileDescriptor __listen(int port, int backlog, bool reuseport) {
+  FileDescriptor fd = ssocket();
+  __set_cloexec(fd);
+  int on = 1;
+  checkNeg(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)),
+           "Error setsockopt SO_REUSEADDR");
+  if (reuseport) {
+    checkNeg(setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)),
+             "Error setsockopt SO_REUSEPORT");
+  }
+  sbind(port, fd);
+  slisten(fd, backlog);
+  return fd;
+}
+
+struct PendingConn {
+  FileDescriptor fd;
+  // when it is closed if it has not registered yet, in µs
+  uint64_t deadline_us;
+  // bytes of the REGISTRATION word received so far
+  size_t received;
+  unsigned char word[sizeof(int)];
+  struct PendingConn *prev;
+  struct PendingConn *next;
+};
+
+static void __set_nonblocking(FileDescriptor fd, bool on) {
+  int flags = fcntl(fd, F_GETFL);
+  checkNeg(flags, "Error fcntl F_GETFL");
+  flags = on ? flags | O_NONBLOCK : flags & ~O_NONBLOCK;
+  checkNeg(fcntl(fd, F_SETFL, flags), "Error fcntl F_SETFL");
+}
+
+static void __watch(struct Acceptor *acceptor, FileDescriptor fd, void *ptr) {
+  struct epoll_event event = {.events = EPOLLIN, .data.ptr = ptr};
+  checkNeg(epoll_ctl(acceptor->epfd, EPOLL_CTL_ADD, fd, &event),
+           "Error epoll_ctl ADD");
+}
+
+// Forgets the pending connection 'conn', whose socket is left open.
+static void __pending_remove(struct Acceptor *acceptor,
+                             struct PendingConn *conn) {
+  epoll_ctl(acceptor->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+  if (conn->prev != NULL) {
+    conn->prev->next = conn->next;
+  } else {
+    acceptor->oldest = conn->next;
+  }
+  if (conn->next != NULL) {
+    conn->next->prev = conn->prev;
+  } else {
+    acceptor->newest = conn->prev;
+  }
+  free(conn);
+}
+
+static void __reject(struct Acceptor *acceptor, struct PendingConn *conn) {
+  fprintf(stderr, "Failed to register a player, closing connection\n");
+  sclose(conn->fd);
+  __pending_remove(acceptor, conn);
+  pthread_mutex_lock(&acceptor->mm->lock);
+  acceptor->mm->rejected++;
+  pthread_mutex_unlock(&acceptor->mm->lock);
+}
+
+static void __queue(struct Matchmaker *mm, struct WaitingPlayer *player) {
+  metrics_add(METRIC_PLAYERS_REGISTERED, 1);
+  pthread_mutex_lock(&mm->lock);
+  if (mm->count == mm->capacity) {
+    mm->capacity = mm->capacity == 0 ? 16 : 2 * mm->capacity;
+    mm->queue = realloc(mm->queue, mm->capacity * sizeof(*mm->queue));
+    checkNull(mm->queue, "Error realloc");
+  }
+  player->since_us = __now_us();
+  mm->queue[mm->count++] = *player;
+  pthread_cond_signal(&mm->queued);
+  pthread_mutex_unlock(&mm->lock);
+}
+
+// Reads what 'conn' sent of its REGISTRATION word. Once it is complete, the
+// player is acknowledged and queued.
+static void __pending_readable(struct Acceptor *acceptor,
+                               struct PendingConn *conn) {
+  ssize_t n = read(conn->fd, conn->word + conn->received,
+                   sizeof(conn->word) - conn->received);
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+    return;
+  }
+  if (n <= 0) {
+    __reject(acceptor, conn);
+    return;
+  }
+  conn->received += (size_t)n;
+  if (conn->received < sizeof(conn->word)) {
+    return;
+  }
+
+  int word;
+  memcpy(&word, conn->word, sizeof(word));
+  struct WaitingPlayer player = {.fd = conn->fd,
+                                 .wire_version =
+                                     wire_parse_registration(word)};
+  // a fresh socket always has room for the single byte of the answer
+  if (player.wire_version == -1 ||
+      !wire_send_ack(conn->fd, player.wire_version)) {
+    __reject(acceptor, conn);
+    return;
+  }
+  // the client handlers read the key presses with blocking reads
+  __set_nonblocking(conn->fd, false);
+  __pending_remove(acceptor, conn);
+
+  int map = wire_registration_map(word);
+  if (map > acceptor->mm->nb_maps) {
+    fprintf(stderr, "A player asked for the unknown map %d, any map will "
+                    "do\n",
+            map);
+    map = 0;
+  }
+  player.map = map - 1;
+  __queue(acceptor->mm, &player);
+}
+
+static void __accept_ready(struct Acceptor *acceptor) {
+  while (1) {
+    FileDescriptor fd = accept(acceptor->listener, NULL, NULL);
+    if (fd < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR &&
+          errno != ECONNABORTED && !atomic_load(&acceptor->mm->stopping)) {
+        perror("accept failure");
+      }
+      return;
+    }
+    __set_cloexec(fd);
+    __set_nonblocking(fd, true);
+    struct PendingConn *conn = smalloc(sizeof(struct PendingConn));
+    conn->fd = fd;
+    conn->deadline_us = __now_us() + REGISTRATION_TIMEOUT_S * 1000000ull;
+    conn->received = 0;
+    conn->prev = acceptor->newest;
+    conn->next = NULL;
+    if (acceptor->newest != NULL) {
+      acceptor->newest->next = conn;
+    } else {
+      acceptor->oldest = conn;
+    }
+    acceptor->newest = conn;
+    __watch(acceptor, fd, conn);
+  }
+}
+
+// Closes the connections which did not register in time.
+// RES: the time left to the next deadline in ms, -1 if none.
+static int __expire(struct Acceptor *acceptor) {
+  uint64_t now = __now_us();
+  while (acceptor->oldest != NULL && acceptor->oldest->deadline_us <= now) {
+    __reject(acceptor, acceptor->oldest);
+  }
+  if (acceptor->oldest == NULL) {
+    return -1;
+  }
+  return (int)((acceptor->oldest->deadline_us - now + 999) / 1000);
+}
+
+static void *__acceptor_main(void *arg) {
+  struct Acceptor *acceptor = arg;
+  struct Matchmaker *mm = acceptor->mm;
+
+  while (!atomic_load(&mm->stopping)) {
+    struct epoll_event events[MAX_EVENTS];
+    int n = epoll_wait(acceptor->epfd, events, MAX_EVENTS, __expire(acceptor));
+    if (n < 0) {
+      checkCond(errno != EINTR, "Error epoll_wait");
+      continue;
+    }
+    for (int i = 0; i < n && !atomic_load(&mm->stopping); i++) {
+      void *ptr = events[i].data.ptr;
+      if (ptr == NULL) {
+        __accept_ready(acceptor);
+      } else if (ptr != &acceptor->wakeup) {
+        __pending_readable(acceptor, ptr);
+      }
+    }
+  }
+  while (acceptor->oldest != NULL) {
+    sclose(acceptor->oldest->fd);
+    __pending_remove(acceptor, acceptor->oldest);
+  }
+  return NULL;
+}
+
+void matchmaker_start(struct Matchmaker *mm, int port, int backlog,
+                      int nb_acceptors, int nb_maps) {
+  pthread_mutex_init(&mm->lock, NULL);
+  // the deadlines of matchmaker_next are monotonic
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&mm->queued, &attr);
+  pthread_condattr_destroy(&attr);
+  mm->queue = NULL;
+  mm->count = 0;
+  mm->capacity = 0;
+  mm->nb_maps = nb_maps;
+  mm->nb_acceptors = nb_acceptors;
+  atomic_init(&mm->stopping, false);
+  histogram_reset(&mm->wait_us);
+  mm->matches = 0;
+  mm->left = 0;
+  mm->rejected = 0;
+
+  for (int i = 0; i < nb_acceptors; i++) {
+    struct Acceptor *acceptor = &mm->acceptors[i];
+    acceptor->mm = mm;
+    acceptor->listener = __listen(port, backlog, nb_acceptors > 1);
+    __set_nonblocking(acceptor->listener, true);
+    acceptor->epfd = epoll_create1(EPOLL_CLOEXEC);
+    checkNeg(acceptor->epfd, "Error epoll_create1");
+    acceptor->wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    checkNeg(acceptor->wakeup, "Error eventfd");
+    acceptor->oldest = NULL;
+    acceptor->newest = NULL;
+    __watch(acceptor, acceptor->listener, NULL);
+    __watch(acceptor, acceptor->wakeup, &acceptor->wakeup);
+  }
+
+  // The acceptors inherit a mask blocking every signal: the signals of the
+  // server are always handled by the engine.
+  sigset_t all;
+  sigset_t orig;
+  ssigfillset(&all);
+  ssigprocmask(SIG_BLOCK, &all, &orig);
+  for (int i = 0; i < nb_acceptors; i++) {
+    int ret = pthread_create(&mm->acceptors[i].thread, NULL, __acceptor_main,
+                             &mm->acceptors[i]);
+    checkCond(ret != 0, "Error pthread_create");
+  }
+  ssigprocmask(SIG_SETMASK, &orig, NULL);
+}
+
+// True if the waiting player has left (or sent garbage we cannot tell from
+// a departure).
+static bool __has_left(const struct WaitingPlayer *player) {
+  char byte;
+  ssize_t n = recv(player->fd, &byte, sizeof(byte), MSG_PEEK | MSG_DONTWAIT);
+  return n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK);
+}
+
+static void __remove(struct Matchmaker *mm, size_t i) {
+  memmove(&mm->queue[i], &mm->queue[i + 1],
+          (mm->count - i - 1) * sizeof(*mm->queue));
+  mm->count--;
+}
+
+// Takes the first two players of the queue who can play together.
+// RES: false if there are none.
+static bool __pair(struct Matchmaker *mm, struct Match *match) {
+  for (size_t i = 0; i < mm->count; i++) {
+    if (__has_left(&mm->queue[i])) {
+      sclose(mm->queue[i].fd);
+      __remove(mm, i--);
+      mm->left++;
+      metrics_add(METRIC_PLAYERS_DISCONNECTED, 1);
+      continue;
+    }
+    for (size_t j = i + 1; j < mm->count; j++) {
+      struct WaitingPlayer *first = &mm->queue[i];
+      struct WaitingPlayer *second = &mm->queue[j];
+      if (first->map != -1 && second->map != -1 && first->map != second->map) {
+        continue;
+      }
+      if (__has_left(second)) {
+        sclose(second->fd);
+        __remove(mm, j--);
+        mm->left++;
+        metrics_add(METRIC_PLAYERS_DISCONNECTED, 1);
+        continue;
+      }
+      uint64_t now = __now_us();
+      struct WaitingPlayer *pair[NB_PLAYERS] = {first, second};
+      for (int p = 0; p < NB_PLAYERS; p++) {
+        match->players_fd[p] = pair[p]->fd;
+        match->wire_versions[p] = pair[p]->wire_version;
+        histogram_record(&mm->wait_us, now - pair[p]->since_us);
+      }
+      match->map = first->map != -1 ? first->map : second->map;
+      // the second one first: it is further in the queue
+      __remove(mm, j);
+      __remove(mm, i);
+      mm->matches++;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool matchmaker_next(struct Matchmaker *mm, struct Match *match,
+                     int timeout_ms) {
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  if (timeout_ms > 0) {
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+  }
+
+  pthread_mutex_lock(&mm->lock);
+  bool paired;
+  while (!(paired = __pair(mm, match))) {
+    int ret = timeout_ms < 0
+                  ? pthread_cond_wait(&mm->queued, &mm->lock)
+                  : pthread_cond_timedwait(&mm->queued, &mm->lock, &deadline);
+    if (ret == ETIMEDOUT) {
+      break;
+    }
+  }
+  pthread_mutex_unlock(&mm->lock);
+  return paired;
+}
+
+void matchmaker_stop(struct Matchmaker *mm) {
+  atomic_store(&mm->stopping, true);
+  uint64_t one = 1;
+  for (int i = 0; i < mm->nb_acceptors; i++) {
+    // wakes up the acceptor waiting in epoll_wait()
+    checkNeg(write(mm->acceptors[i].wakeup, &one, sizeof(one)),
+             "Error write eventfd");
+  }
+  for (int i = 0; i < mm->nb_acceptors; i++) {
+    pthread_join(mm->acceptors[i].thread, NULL);
+    sclose(mm->acceptors[i].listener);
+    sclose(mm->acceptors[i].epfd);
+    sclose(mm->acceptors[i].wakeup);
+  }
+  for (size_t i = 0; i < mm->count; i++) {
+    sclose(mm->queue[i].fd);
+  }
+  metrics_add(METRIC_PLAYERS_DISCONNECTED, mm->count);
+  free(mm->queue);
+  mm->queue = NULL;
+  mm->count = 0;
+  mm->capacity = 0;
+  mm->nb_acceptors = 0;
+  pthread_cond_destroy(&mm->queued);
+  pthread_mutex_destroy(&mm->lock);
+}
+
+void matchmaker_print_stats(struct Matchmaker *mm, FILE *out) {
+  pthread_mutex_lock(&mm->lock);
+  fprintf(out,
+          "Matchmaker: %llu match(es), %zu player(s) waiting, %llu left "
+          "while waiting, %llu failed to register\n",
+          (unsigned long long)mm->matches, mm->count,
+          (unsigned long long)mm->left, (unsigned long long)mm->rejected);
+  histogram_print(&mm->wait_us, "Matchmaker: queue wait", "us", out);
+  pthread_mutex_unlock(&mm->lock);
+}
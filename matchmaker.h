@@ -0,0 +1,120 @@
+#ifndef MATCHMAKER_H
+#define MATCHMAKER_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "game.h"
+#include "histogram.h"
+
+/**
+ * The matchmaker decouples accepting the players from playing the matches
+ * (fork and rooms engines). Acceptor threads accept and register the players
+ * at any time, even while a match runs, and queue them; the engine takes
+ * pairs of waiting players out of the queue whenever it can start a match.
+ *
+ * An acceptor never waits for a client: its listening socket and the
+ * connections which have not sent their REGISTRATION word yet are
+ * non-blocking and multiplexed in its own epoll set. A connection which does
+ * not register in time is closed.
+ *
+ * The queue is FIFO: the player waiting for the longest time is paired with
+ * the next player who can play the same map. A player may ask for a map in
+ * its REGISTRATION word (see wire.h), two players asking for different maps
+ * are never paired. A waiting player who leaves is dropped from the queue.
+ *
+ * With several acceptors, each one has its own listening socket bound to the
+ * port with SO_REUSEPORT and the kernel spreads the connections among them.
+ */
+
+#define MATCHMAKER_MAX_ACCEPTORS 16
+#define MATCHMAKER_DEFAULT_BACKLOG 128
+
+// A registered player waiting for a match.
+struct WaitingPlayer {
+  FileDescriptor fd;
+  int wire_version;
+  // map asked for (index in the maps of the server), -1 for any map
+  int map;
+  // when the player was queued, in µs (CLOCK_MONOTONIC)
+  uint64_t since_us;
+};
+
+struct Match {
+  FileDescriptor players_fd[NB_PLAYERS];
+  int wire_versions[NB_PLAYERS];
+  // map asked for by the players, -1 if none of them asked for one
+  int map;
+};
+
+struct Matchmaker;
+
+// A connection waiting for its REGISTRATION word.
+struct PendingConn;
+
+// An acceptor thread, its listening socket and the connections it
+// registers.
+struct Acceptor {
+  struct Matchmaker *mm;
+  FileDescriptor listener;
+  FileDescriptor epfd;
+  // eventfd waking the acceptor up when the matchmaker stops
+  FileDescriptor wakeup;
+  // oldest connection first: their deadlines are in the same order
+  struct PendingConn *oldest;
+  struct PendingConn *newest;
+  pthread_t thread;
+};
+
+struct Matchmaker {
+  pthread_mutex_t lock;
+  // signaled when a player is queued
+  pthread_cond_t queued;
+  // oldest player first
+  struct WaitingPlayer *queue;
+  size_t count;
+  size_t capacity;
+  int nb_maps;
+  int nb_acceptors;
+  struct Acceptor acceptors[MATCHMAKER_MAX_ACCEPTORS];
+  atomic_bool stopping;
+  // time spent in the queue by the matched players, in µs
+  struct Histogram wait_us;
+  uint64_t matches;
+  // players who left while waiting
+  uint64_t left;
+  // connections which failed to register
+  uint64_t rejected;
+};
+
+/**
+ * PRE:  1 <= nb_acceptors <= MATCHMAKER_MAX_ACCEPTORS, backlog > 0.
+ * POST: 'nb_acceptors' threads accept the players on 'port' (listen backlog
+ *       'backlog') and queue them for a match on one of the 'nb_maps' maps.
+ *       The acceptors block every signal, the calling thread handles them.
+ *       The listening and player sockets are close-on-exec.
+ */
+void matchmaker_start(struct Matchmaker *mm, int port, int backlog,
+                      int nb_acceptors, int nb_maps);
+
+/**
+ * Waits for two players who can play together, at most 'timeout_ms' ms (-1
+ * to wait forever).
+ * RES: true if they have been taken out of the queue into 'match', false on
+ *      timeout.
+ */
+bool matchmaker_next(struct Matchmaker *mm, struct Match *match,
+                     int timeout_ms);
+
+// POST: the acceptors are stopped and the players still waiting are
+//       disconnected.
+void matchmaker_stop(struct Matchmaker *mm);
+
+// POST: the counters and the percentiles of the time spent waiting in the
+//       queue have been written on 'out'.
+void matchmaker_print_stats(struct Matchmaker *mm, FILE *out);
+
+#endif // MATCHMAKER_H
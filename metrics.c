@@ -0,0 +1,334 @@
+// memfd_create(), gettid()
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common_fd.h"
+#include "game.h"
+#include "metrics.h"
+#include "utils_v3.h"
+
+#define METRICS_MAGIC 0x70617363ull
+// Time a scraper has to send its request.
+#define METRICS_READ_TIMEOUT_S 1
+#define METRICS_BACKLOG 16
+// Pause after a failed accept (out of descriptors...), doubled while the
+// failures go on, in ms.
+#define METRICS_RETRY_MIN_MS 10
+#define METRICS_RETRY_MAX_MS 1000
+
+struct MetricsRegion *metrics_region = NULL;
+_Thread_local struct MetricsSlot *metrics_slot = NULL;
+
+static const char *__metric_names[NB_METRICS] = {
+    [METRIC_PLAYERS_REGISTERED] = "pas_players_registered_total",
+    [METRIC_PLAYERS_DISCONNECTED] = "pas_players_disconnected_total",
+    [METRIC_MATCHES_STARTED] = "pas_matches_started_total",
+    [METRIC_MATCHES_FINISHED] = "pas_matches_finished_total",
+    [METRIC_LOCK_WAITS] = "pas_lock_waits_total",
+    [METRIC_LOCK_WAIT_NS] = "pas_lock_wait_seconds_total",
+    [METRIC_FORKS] = "pas_forks_total",
+    [METRIC_HANDLERS_STARTED] = "pas_handlers_started_total",
+    [METRIC_HANDLERS_FAILED] = "pas_handlers_failed_total",
+};
+
+static const char *__metric_help[NB_METRICS] = {
+    [METRIC_PLAYERS_REGISTERED] = "Players who registered.",
+    [METRIC_PLAYERS_DISCONNECTED] = "Registered players whose connection "
+                                    "was closed.",
+    [METRIC_MATCHES_STARTED] = "Matches started.",
+    [METRIC_MATCHES_FINISHED] = "Matches over, played to the end or left.",
+    [METRIC_LOCK_WAITS] = "Times a room lock was found taken.",
+    [METRIC_LOCK_WAIT_NS] = "Time spent waiting for a room lock.",
+    [METRIC_FORKS] = "Processes forked by the server and its rooms.",
+    [METRIC_HANDLERS_STARTED] = "Client handlers started, forked or pooled.",
+    [METRIC_HANDLERS_FAILED] = "Client handlers which died or failed.",
+};
+
+static const char *__msg_names[METRICS_MSG_TYPES] = {
+    [REGISTRATION] = "registration", [SPAWN] = "spawn",
+    [MOVEMENT] = "movement",         [EAT_FOOD] = "eat_food",
+    [GAME_OVER] = "game_over",       [METRICS_MSG_MAP] = "map",
+};
+
+static uint64_t __owner_id(void) {
+  return (uint64_t)getpid() << 32 | (uint32_t)gettid();
+}
+
+static bool __owner_gone(uint64_t owner) {
+  pid_t pid = (pid_t)(owner >> 32);
+  pid_t tid = (pid_t)(uint32_t)owner;
+  return syscall(SYS_tgkill, pid, tid, 0) == -1 && errno == ESRCH;
+}
+
+struct MetricsSlot *metrics_claim(void) {
+  int saved_errno = errno;
+  uint64_t self = __owner_id();
+  // slot 0 is the overflow slot, shared by whoever finds no free slot
+  for (int i = 1; i < METRICS_SLOTS && metrics_slot == NULL; i++) {
+    struct MetricsSlot *slot = &metrics_region->slots[i];
+    uint64_t owner = atomic_load_explicit(&slot->owner, memory_order_relaxed);
+    if ((owner == 0 || __owner_gone(owner)) &&
+        atomic_compare_exchange_strong(&slot->owner, &owner, self)) {
+      metrics_slot = slot;
+    }
+  }
+  if (metrics_slot == NULL) {
+    metrics_slot = &metrics_region->slots[0];
+  }
+  errno = saved_errno;
+  return metrics_slot;
+}
+
+uint64_t metrics_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static void __count_fork(void) { metrics_add(METRIC_FORKS, 1); }
+
+// The child of a fork is a new owner: it claims its own slot.
+static void __forget_slot(void) { metrics_slot = NULL; }
+
+static void __map(FileDescriptor fd) {
+  void *base = mmap(NULL, sizeof(struct MetricsRegion),
+                    PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  checkCond(base == MAP_FAILED, "Error mmap metrics");
+  metrics_region = base;
+  pthread_atfork(NULL, __count_fork, __forget_slot);
+}
+
+void metrics_create(void) {
+  FileDescriptor fd = memfd_create("pas_metrics", 0);
+  checkNeg(fd, "Error memfd_create");
+  checkNeg(ftruncate(fd, sizeof(struct MetricsRegion)), "Error ftruncate");
+  if (fd != METRICS_FD) {
+    sdup2(fd, METRICS_FD);
+    sclose(fd);
+  }
+  __map(METRICS_FD);
+  // a fresh memfd is zeroed: every slot is free
+  metrics_region->magic = METRICS_MAGIC;
+}
+
+void metrics_attach(void) {
+  struct stat st;
+  if (fstat(METRICS_FD, &st) != 0 || !S_ISREG(st.st_mode) ||
+      st.st_size != sizeof(struct MetricsRegion)) {
+    return;
+  }
+  __map(METRICS_FD);
+  if (metrics_region->magic != METRICS_MAGIC) {
+    munmap(metrics_region, sizeof(struct MetricsRegion));
+    metrics_region = NULL;
+  }
+}
+
+static void __write_counter(FILE *out, const char *name, const char *help,
+                            const char *type, uint64_t value) {
+  fprintf(out, "# HELP %s %s\n# TYPE %s %s\n%s %lu\n", name, help, name, type,
+          name, (unsigned long)value);
+}
+
+void metrics_write(FILE *out) {
+  uint64_t counters[NB_METRICS] = {0};
+  uint64_t messages[METRICS_MSG_TYPES] = {0};
+  uint64_t bytes[METRICS_MSG_TYPES] = {0};
+  int slots_used = 0;
+  for (int i = 0; i < METRICS_SLOTS; i++) {
+    struct MetricsSlot *slot = &metrics_region->slots[i];
+    slots_used += atomic_load_explicit(&slot->owner, memory_order_relaxed) != 0;
+    for (int m = 0; m < NB_METRICS; m++) {
+      counters[m] +=
+          atomic_load_explicit(&slot->counters[m], memory_order_relaxed);
+    }
+    for (int t = 0; t < METRICS_MSG_TYPES; t++) {
+      messages[t] +=
+          atomic_load_explicit(&slot->messages[t], memory_order_relaxed);
+      bytes[t] += atomic_load_explicit(&slot->bytes[t], memory_order_relaxed);
+    }
+  }
+
+  // The gauges are differences of counters bumped by different processes:
+  // a scrape may see the end of a match before its start.
+  uint64_t started = counters[METRIC_MATCHES_STARTED];
+  uint64_t finished = counters[METRIC_MATCHES_FINISHED];
+  uint64_t registered = counters[METRIC_PLAYERS_REGISTERED];
+  uint64_t disconnected = counters[METRIC_PLAYERS_DISCONNECTED];
+  __write_counter(out, "pas_rooms_active", "Matches being played.", "gauge",
+                  started > finished ? started - finished : 0);
+  __write_counter(out, "pas_players_connected",
+                  "Registered players still connected.", "gauge",
+                  registered > disconnected ? registered - disconnected : 0);
+  for (int m = 0; m < NB_METRICS; m++) {
+    if (m == METRIC_LOCK_WAIT_NS) {
+      fprintf(out, "# HELP %s %s\n# TYPE %s counter\n%s %.9f\n",
+              __metric_names[m], __metric_help[m], __metric_names[m],
+              __metric_names[m], counters[m] / 1e9);
+      continue;
+    }
+    __write_counter(out, __metric_names[m], __metric_help[m], "counter",
+                    counters[m]);
+  }
+
+  fprintf(out, "# HELP pas_messages_sent_total Messages sent to the players, "
+               "per type.\n# TYPE pas_messages_sent_total counter\n");
+  for (int t = 0; t < METRICS_MSG_TYPES; t++) {
+    fprintf(out, "pas_messages_sent_total{type=\"%s\"} %lu\n", __msg_names[t],
+            (unsigned long)messages[t]);
+  }
+  fprintf(out, "# HELP pas_sent_bytes_total Bytes sent to the players, per "
+               "message type.\n# TYPE pas_sent_bytes_total counter\n");
+  for (int t = 0; t < METRICS_MSG_TYPES; t++) {
+    fprintf(out, "pas_sent_bytes_total{type=\"%s\"} %lu\n", __msg_names[t],
+            (unsigned long)bytes[t]);
+  }
+  __write_counter(out, "pas_metrics_slots",
+                  "Counter slots claimed by a thread or process.", "gauge",
+                  slots_used);
+}
+
+// Answers one scraper: whatever it asks for, it gets every counter.
+static void __answer(FileDescriptor fd) {
+  struct timeval timeout = {.tv_sec = METRICS_READ_TIMEOUT_S};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  // the request itself does not matter, a short read will do
+  char request[1024];
+  if (read(fd, request, sizeof(request)) <= 0) {
+    return;
+  }
+
+  char *body;
+  size_t body_len;
+  FILE *out = open_memstream(&body, &body_len);
+  checkNull(out, "Error open_memstream");
+  metrics_write(out);
+  fclose(out);
+
+  char header[128];
+  int header_len =
+      snprintf(header, sizeof(header),
+               "HTTP/1.0 200 OK\r\nContent-Type: text/plain; "
+               "version=0.0.4\r\nContent-Length: %zu\r\n\r\n",
+               body_len);
+  if (send(fd, header, header_len, MSG_NOSIGNAL) == header_len) {
+    for (size_t sent = 0; sent < body_len;) {
+      ssize_t n = send(fd, body + sent, body_len - sent, MSG_NOSIGNAL);
+      if (n <= 0) {
+        break;
+      }
+      sent += n;
+    }
+  }
+  free(body);
+}
+
+static void *__serve_main(void *arg) {
+  FileDescriptor listener = (FileDescriptor)(intptr_t)arg;
+  int retry_ms = 0;
+  while (true) {
+    FileDescriptor fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0 && (errno == EINTR || errno == ECONNABORTED)) {
+      continue;
+    }
+    if (fd < 0) {
+      // EMFILE or ENFILE lasts: the thread must neither spin nor flood
+      // stderr, only the first failure in a row is printed
+      if (retry_ms == 0) {
+        perror("Error accept metrics");
+        retry_ms = METRICS_RETRY_MIN_MS;
+      } else if (2 * retry_ms <= METRICS_RETRY_MAX_MS) {
+        retry_ms *= 2;
+      }
+      usleep(retry_ms * 1000);
+      continue;
+    }
+    retry_ms = 0;
+    __answer(fd);
+    close(fd);
+  }
+  return NULL;
+}
+
+static bool __bind_unix(FileDescriptor fd, const char *path) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return false;
+  }
+  strcpy(addr.sun_path, path);
+  // a socket left by a previous server
+  unlink(path);
+  return bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+}
+
+static bool __bind_loopback(FileDescriptor fd, const char *port) {
+  int number = atoi(port);
+  if (number <= 0) {
+    errno = EINVAL;
+    return false;
+  }
+  struct sockaddr_in addr = {.sin_family = AF_INET,
+                             .sin_port = htons(number),
+                             .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+  int on = 1;
+  return setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == 0 &&
+         bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+}
+
+// RES: a socket listening on 'address', -1 if it cannot be listened on.
+static FileDescriptor __listen(const char *address) {
+  bool local = strchr(address, '/') != NULL;
+  FileDescriptor fd =
+      socket(local ? AF_UNIX : AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  checkNeg(fd, "Error socket");
+  bool bound =
+      local ? __bind_unix(fd, address) : __bind_loopback(fd, address);
+  if (!bound || listen(fd, METRICS_BACKLOG) < 0) {
+    perror("Error listening for the metrics");
+    sclose(fd);
+    return -1;
+  }
+  return fd;
+}
+
+bool metrics_serve(const char *address) {
+  FileDescriptor listener = __listen(address);
+  if (listener < 0) {
+    return false;
+  }
+  // The thread inherits a mask blocking every signal: the signals of the
+  // server are always handled by the engine.
+  sigset_t all;
+  sigset_t orig;
+  ssigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &orig);
+  pthread_t thread;
+  int rv = pthread_create(&thread, NULL, __serve_main,
+                          (void *)(intptr_t)listener);
+  pthread_sigmask(SIG_SETMASK, &orig, NULL);
+  if (rv != 0) {
+    errno = rv;
+    perror("Error pthread_create");
+    close(listener);
+    return false;
+  }
+  pthread_detach(thread);
+  return true;
+}
@@ -0,0 +1,132 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "pascman.h"
+
+/**
+ * Counters of the server, scraped in the Prometheus text format
+ * (pas_server -M).
+ *
+ * They live in a shared memory region created by the server and inherited
+ * by every process it forks or execs (at METRICS_FD, see common_fd.h). The
+ * region is split into slots of their own cache lines: each thread or
+ * process claims a slot the first time it counts, after which counting is a
+ * relaxed atomic add on a line no other CPU writes. No lock is taken, no line
+ * bounces between the handlers. The slot of a process or thread which is
+ * gone is claimed again with its counts, so the totals never go down. A
+ * scrape adds every slot up.
+ *
+ * Without a region (no -M, or a worker started by another program), counting
+ * costs a single branch.
+ */
+
+enum Metric {
+  METRIC_PLAYERS_REGISTERED,
+  METRIC_PLAYERS_DISCONNECTED,
+  METRIC_MATCHES_STARTED,
+  METRIC_MATCHES_FINISHED,
+  // times a handler found the lock of its room taken, and how long it waited
+  METRIC_LOCK_WAITS,
+  METRIC_LOCK_WAIT_NS,
+  METRIC_FORKS,
+  // client handlers forked or handed a match by their pool
+  METRIC_HANDLERS_STARTED,
+  // client handlers which died or failed instead of ending their match
+  METRIC_HANDLERS_FAILED,
+  NB_METRICS
+};
+
+// The messages sent to the players are counted per type: the types of
+// pascman.h, then the spawn stream or snapshot of the map (one per match and
+// player).
+#define METRICS_MSG_MAP (GAME_OVER + 1)
+#define METRICS_MSG_TYPES (METRICS_MSG_MAP + 1)
+
+#define METRICS_SLOTS 512
+
+struct MetricsSlot {
+  // pid << 32 | thread id of the owner, 0 if never claimed
+  _Alignas(64) atomic_uint_fast64_t owner;
+  atomic_uint_fast64_t counters[NB_METRICS];
+  atomic_uint_fast64_t messages[METRICS_MSG_TYPES];
+  atomic_uint_fast64_t bytes[METRICS_MSG_TYPES];
+};
+
+struct MetricsRegion {
+  uint64_t magic;
+  struct MetricsSlot slots[METRICS_SLOTS];
+};
+
+// NULL while the counters are off.
+extern struct MetricsRegion *metrics_region;
+// The slot of the calling thread, NULL until it counts.
+extern _Thread_local struct MetricsSlot *metrics_slot;
+
+/**
+ * PRE:  metrics_region != NULL.
+ * POST: the calling thread owns a slot (or shares the overflow slot when
+ *       every slot is owned).
+ * RES:  its slot.
+ */
+struct MetricsSlot *metrics_claim(void);
+
+static inline bool metrics_enabled(void) { return metrics_region != NULL; }
+
+static inline struct MetricsSlot *__metrics_own_slot(void) {
+  return metrics_slot != NULL ? metrics_slot : metrics_claim();
+}
+
+// POST: 'metric' has been increased by 'n'.
+static inline void metrics_add(enum Metric metric, uint64_t n) {
+  if (metrics_region == NULL) {
+    return;
+  }
+  atomic_fetch_add_explicit(&__metrics_own_slot()->counters[metric], n,
+                            memory_order_relaxed);
+}
+
+// POST: 'count' messages of 'type' ('bytes' in total) have been counted.
+static inline void metrics_sent(int type, uint64_t count, uint64_t bytes) {
+  if (metrics_region == NULL || type < 0 || type >= METRICS_MSG_TYPES) {
+    return;
+  }
+  struct MetricsSlot *slot = __metrics_own_slot();
+  atomic_fetch_add_explicit(&slot->messages[type], count,
+                            memory_order_relaxed);
+  atomic_fetch_add_explicit(&slot->bytes[type], bytes, memory_order_relaxed);
+}
+
+// RES: CLOCK_MONOTONIC in ns.
+uint64_t metrics_now_ns(void);
+
+/**
+ * PRE:  METRICS_FD is free.
+ * POST: the counters are on, their region is open at METRICS_FD for the
+ *       children of the process.
+ */
+void metrics_create(void);
+
+/**
+ * POST: the counters are on if METRICS_FD holds the region of the server
+ *       (a client handler or broadcaster exec'd by it).
+ */
+void metrics_attach(void);
+
+// POST: every counter, summed over the slots, has been written on 'out'.
+void metrics_write(FILE *out);
+
+/**
+ * PRE:  the counters are on.
+ * POST: a thread answers every connection to 'address' with the counters:
+ *       a Unix socket if it holds a '/', a TCP port of the loopback
+ *       otherwise.
+ * RES:  false if 'address' cannot be listened on.
+ */
+bool metrics_serve(const char *address);
+
+#endif // METRICS_H
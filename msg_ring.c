@@ -0,0 +1,149 @@
+#include <sched.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "msg_ring.h"
+
+#define CACHE_LINE 64
+
+size_t msg_ring_offset(size_t state_size) {
+  return (state_size + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+}
+
+size_t msg_ring_size(size_t capacity) {
+  return sizeof(struct MsgRing) + capacity * sizeof(struct MsgRingSlot);
+}
+
+void msg_ring_init(struct MsgRing *ring, size_t capacity) {
+  ring->capacity = capacity;
+  atomic_init(&ring->enqueue_pos, 0);
+  atomic_init(&ring->dequeue_pos, 0);
+  atomic_init(&ring->sleeping, false);
+  for (size_t i = 0; i < capacity; i++) {
+    atomic_init(&ring->slots[i].seq, i);
+  }
+}
+
+// Publishes one message. A free slot has seq == pos, a published one
+// seq == pos + 1. RES: false if the ring is full.
+static bool __try_push(struct MsgRing *ring, const union RingEntry *entry) {
+  size_t mask = ring->capacity - 1;
+  size_t pos = atomic_load_explicit(&ring->enqueue_pos, memory_order_relaxed);
+  while (1) {
+    struct MsgRingSlot *slot = &ring->slots[pos & mask];
+    size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&ring->enqueue_pos, &pos,
+                                                pos + 1, memory_order_relaxed,
+                                                memory_order_relaxed)) {
+        slot->entry = *entry;
+        atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+        return true;
+      }
+    } else if (diff < 0) {
+      return false;
+    } else {
+      pos = atomic_load_explicit(&ring->enqueue_pos, memory_order_relaxed);
+    }
+  }
+}
+
+static void __ring_bell(FileDescriptor doorbell) {
+  uint64_t one = 1;
+  write(doorbell, &one, sizeof(one));
+}
+
+static void __push(struct MsgRing *ring, const union RingEntry *entry,
+                   FileDescriptor doorbell) {
+  while (!__try_push(ring, entry)) {
+    // full: the broadcaster is behind, make sure it is awake
+    if (atomic_exchange(&ring->sleeping, false)) {
+      __ring_bell(doorbell);
+    }
+    sched_yield();
+  }
+}
+
+// Pairs with msg_ring_prepare_wait: either the consumer sees what has been
+// pushed or we see it sleeping.
+static void __wake_consumer(struct MsgRing *ring, FileDescriptor doorbell) {
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load(&ring->sleeping) &&
+      atomic_exchange(&ring->sleeping, false)) {
+    __ring_bell(doorbell);
+  }
+}
+
+void msg_ring_push(struct MsgRing *ring, const union Message *msgs,
+                   size_t count, FileDescriptor doorbell) {
+  for (size_t i = 0; i < count; i++) {
+    __push(ring, &(union RingEntry){.msg = msgs[i]}, doorbell);
+  }
+  if (count > 0) {
+    __wake_consumer(ring, doorbell);
+  }
+}
+
+void msg_ring_push_command(struct MsgRing *ring, const struct PlayerCommand *cmd,
+                           FileDescriptor doorbell) {
+  __push(ring, &(union RingEntry){.cmd = *cmd}, doorbell);
+  __wake_consumer(ring, doorbell);
+}
+
+// RES: the slot of the oldest entry, NULL if the ring is empty.
+static struct MsgRingSlot *__oldest(struct MsgRing *ring, size_t pos) {
+  struct MsgRingSlot *slot = &ring->slots[pos & (ring->capacity - 1)];
+  size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+  return seq == pos + 1 ? slot : NULL;
+}
+
+// Hands the slot of the entry at 'pos' back to the producers.
+static void __release(struct MsgRing *ring, struct MsgRingSlot *slot,
+                      size_t pos) {
+  atomic_store_explicit(&slot->seq, pos + ring->capacity,
+                        memory_order_release);
+}
+
+size_t msg_ring_pop(struct MsgRing *ring, union Message *out, size_t max) {
+  size_t pos = atomic_load_explicit(&ring->dequeue_pos, memory_order_relaxed);
+  size_t n = 0;
+  struct MsgRingSlot *slot;
+  while (n < max && (slot = __oldest(ring, pos)) != NULL) {
+    out[n++] = slot->entry.msg;
+    __release(ring, slot, pos++);
+  }
+  atomic_store_explicit(&ring->dequeue_pos, pos, memory_order_relaxed);
+  return n;
+}
+
+size_t msg_ring_pop_commands(struct MsgRing *ring, struct PlayerCommand *out,
+                             size_t max) {
+  size_t pos = atomic_load_explicit(&ring->dequeue_pos, memory_order_relaxed);
+  size_t n = 0;
+  struct MsgRingSlot *slot;
+  while (n < max && (slot = __oldest(ring, pos)) != NULL) {
+    out[n++] = slot->entry.cmd;
+    __release(ring, slot, pos++);
+  }
+  atomic_store_explicit(&ring->dequeue_pos, pos, memory_order_relaxed);
+  return n;
+}
+
+bool msg_ring_prepare_wait(struct MsgRing *ring) {
+  atomic_store(&ring->sleeping, true);
+  atomic_thread_fence(memory_order_seq_cst);
+  size_t pos = atomic_load_explicit(&ring->dequeue_pos, memory_order_relaxed);
+  if (__oldest(ring, pos) != NULL) {
+    atomic_store(&ring->sleeping, false);
+    return false;
+  }
+  return true;
+}
+
+void msg_ring_woken(struct MsgRing *ring, FileDescriptor doorbell) {
+  atomic_store(&ring->sleeping, false);
+  uint64_t count;
+  // non-blocking eventfd: fails with EAGAIN when nothing was rung
+  read(doorbell, &count, sizeof(count));
+}
@@ -0,0 +1,112 @@
+#ifndef MSG_RING_H
+#define MSG_RING_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "game.h"
+
+/**
+ * A message ring carries the messages of the client handlers of a room to
+ * its broadcaster through shared memory, in place of the pipe. It lives in
+ * the shared memory segment of the room, right after the GameState (see
+ * msg_ring_offset).
+ *
+ * It is a bounded multi-producer/single-consumer queue (D. Vyukov's bounded
+ * queue): each slot carries a sequence number telling whether it is free or
+ * holds a message, so publishing a message is a compare-and-swap and a copy,
+ * with no system call. The only system call left is the doorbell, an eventfd
+ * written by a producer when the consumer is about to sleep.
+ */
+
+#define MSG_RING_DEFAULT_CAPACITY 4096
+
+// A key press of a player. When the broadcaster is the game actor (see
+// TRANSPORT_ACTOR in room.h), the handlers publish commands instead of
+// messages.
+struct PlayerCommand {
+  enum Item player;
+  enum Direction dir;
+  // stamps of the key press when the latency is traced (see stage_trace.h)
+  bool traced;
+  uint32_t read_ns;
+  uint32_t published_ns;
+};
+
+// A ring carries either messages or commands, never both.
+union RingEntry {
+  union Message msg;
+  struct PlayerCommand cmd;
+};
+
+struct MsgRingSlot {
+  atomic_size_t seq;
+  union RingEntry entry;
+};
+
+struct MsgRing {
+  // number of slots, a power of two
+  size_t capacity;
+  // the producers and the consumer write their positions on their own cache
+  // lines
+  _Alignas(64) atomic_size_t enqueue_pos;
+  _Alignas(64) atomic_size_t dequeue_pos;
+  // true while the consumer waits on the doorbell
+  _Alignas(64) atomic_bool sleeping;
+  _Alignas(64) struct MsgRingSlot slots[];
+};
+
+/**
+ * RES: the offset of the ring in a segment starting with a GameState of
+ *      'state_size' bytes.
+ */
+size_t msg_ring_offset(size_t state_size);
+
+// The size of a ring of 'capacity' slots (a power of two).
+size_t msg_ring_size(size_t capacity);
+
+/**
+ * PRE:  'ring' points to msg_ring_size(capacity) bytes.
+ * POST: the ring is empty.
+ */
+void msg_ring_init(struct MsgRing *ring, size_t capacity);
+
+/**
+ * POST: the 'count' messages are in the ring, in order (waiting for the
+ *       consumer to make room if the ring is full). The consumer has been
+ *       woken up through 'doorbell' if it was sleeping.
+ */
+void msg_ring_push(struct MsgRing *ring, const union Message *msgs,
+                   size_t count, FileDescriptor doorbell);
+
+// Idem msg_ring_push for a single command.
+void msg_ring_push_command(struct MsgRing *ring, const struct PlayerCommand *cmd,
+                           FileDescriptor doorbell);
+
+/**
+ * Consumer only.
+ * POST: at most 'max' messages have been moved from the ring to 'out'.
+ * RES:  the number of messages moved.
+ */
+size_t msg_ring_pop(struct MsgRing *ring, union Message *out, size_t max);
+
+// Idem msg_ring_pop for a ring of commands.
+size_t msg_ring_pop_commands(struct MsgRing *ring, struct PlayerCommand *out,
+                             size_t max);
+
+/**
+ * Consumer only, before waiting for the doorbell to become readable.
+ * RES: false if messages arrived in the meantime, in which case the consumer
+ *      must not wait.
+ */
+bool msg_ring_prepare_wait(struct MsgRing *ring);
+
+/**
+ * Consumer only, after waking up (or deciding not to wait).
+ * POST: the doorbell has been drained.
+ */
+void msg_ring_woken(struct MsgRing *ring, FileDescriptor doorbell);
+
+#endif // MSG_RING_H
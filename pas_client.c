@@ -2,14 +2,23 @@
 #include "pascman.h"
 #include "pm_exec_paths.h"
 #include "utils_v3.h"
+#include "wire.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
+// Size of the chunks read on the socket by the decoder.
+#define DECODE_CHUNK 4096
+
 int sockfd = -1;
 
-void send_register(int fd);
+void send_register(int fd, int version, int map);
+int register_player(const char *host, int port, int version, int map);
+ssize_t decode_messages(const uint8_t *in, size_t len, int version,
+                        struct MessageBuffer *msgs);
+void decode_stream(FileDescriptor in, FileDescriptor out, int version);
 void sigint_handler(int signum) {
   printf("\nSIGINT received...\n");
   // Cleanup resources
@@ -18,8 +27,9 @@ void sigint_handler(int signum) {
   }
 }
 int main(int argc, char *argv[]) {
-  if (argv == NULL || argc < 3 || argc > 4) {
-    fprintf(stderr, "Usage: %s <host> <port> [-test]\n", argv[0]);
+  if (argv == NULL || argc < 3 || argc > 7) {
+    fprintf(stderr, "Usage: %s <host> <port> [-test] [-v1] [-map <n>]\n",
+            argv[0]);
     return EXIT_FAILURE;
   }
   char *host = argv[1];
@@ -28,16 +38,49 @@ int main(int argc, char *argv[]) {
     fprintf(stderr, "Invalid port number: %s\n", argv[2]);
     return EXIT_FAILURE;
   }
-  // Check if we're in test mode
+  // Check if we're in test mode and if the legacy protocol is forced
   int test_mode = 0;
-  if (argc == 4 && strcmp(argv[3], "-test") == 0) {
-    test_mode = 1;
-    printf("Running in test mode, reading commands from stdin\n");
+  int version = WIRE_V3;
+  // map asked for (1-based), 0 lets the server choose
+  int map = 0;
+  for (int i = 3; i < argc; i++) {
+    if (strcmp(argv[i], "-test") == 0) {
+      test_mode = 1;
+      printf("Running in test mode, reading commands from stdin\n");
+    } else if (strcmp(argv[i], "-v1") == 0) {
+      version = WIRE_V1;
+    } else if (strcmp(argv[i], "-map") == 0 && i + 1 < argc) {
+      map = atoi(argv[++i]);
+      if (map <= 0 || map > WIRE_MAX_MAP) {
+        fprintf(stderr, "Invalid map number: %s\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+    } else {
+      fprintf(stderr, "Unknown option: %s\n", argv[i]);
+      return EXIT_FAILURE;
+    }
   }
   // Set up signal handling to ensure cleanup on termination
   signal(SIGINT, sigint_handler);
-  // Create a socket
-  sockfd = ssocket();
+  version = register_player(host, port, version, map);
+  printf("Connected to server %s on port %d (protocol v%d)\n", host, port,
+         version);
+
+  // The GUI only understands the legacy messages: in v2 and v3, a decoder
+  // process sits between the socket and the GUI.
+  FileDescriptor gui_in = sockfd;
+  if (version != WIRE_V1) {
+    int wirefd[2];
+    spipe(wirefd);
+    if (sfork() == 0) {
+      sclose(wirefd[0]);
+      decode_stream(sockfd, wirefd[1], version);
+      exit(EXIT_SUCCESS);
+    }
+    sclose(wirefd[1]);
+    gui_in = wirefd[0];
+  }
+
   // Create a pipe for communication with the GUI
   int pipefd[2];
   int ret = spipe(pipefd);
@@ -52,12 +95,12 @@ int main(int argc, char *argv[]) {
       sdup2(pipefd[1], sysout);
     }
     printf("Redirected pipefd[1] to stdout...\n");
-    sconnect(host, port, sockfd);
-    send_register(sockfd);
-    printf("Connected to server %s on port %d\n", host, port);
     // Redirect stdin to the read end of the pipe
     printf("Redirecting sockfd to stdin...\n");
-    sdup2(sockfd, sysin);
+    sdup2(gui_in, sysin);
+    if (gui_in != sockfd) {
+      sclose(gui_in);
+    }
     sclose(sockfd);
     sexecl(PAS_CMAN_IPL_PATH, PAS_CMAN_IPL_PATH, NULL);
     perror("Failed to exec pas-cman-ipl");
@@ -66,6 +109,9 @@ int main(int argc, char *argv[]) {
   // Close the write pipe, because we just need to read from the GUI.
   // Read from the GUI
   sclose(pipefd[1]);
+  if (gui_in != sockfd) {
+    sclose(gui_in);
+  }
   int buffer[4];
   int fd;
   if (test_mode) {
@@ -90,7 +136,106 @@ int main(int argc, char *argv[]) {
   sockfd = -1;
   return EXIT_SUCCESS;
 }
-void send_register(int fd) {
-  int msg_type = REGISTRATION;
+void send_register(int fd, int version, int map) {
+  int msg_type = wire_registration_word(version, map);
   swrite(fd, &msg_type, sizeof(int));
 }
+
+// Connects 'sockfd' to the server and registers in 'version', asking for
+// 'map'. A server which knows the version answers with it in a single byte.
+// A legacy server takes the REGISTRATION word as is and sends the v1
+// messages of the match, which always start with a REGISTRATION or SPAWN
+// message: the first byte is only peeked at, so that it is left to the GUI
+// if it is not the answer. If the server closes the connection instead, the
+// client registers again in v1.
+// RES: the wire version of the connection.
+int register_player(const char *host, int port, int version, int map) {
+  sockfd = ssocket();
+  sconnect((char *)host, port, sockfd);
+  send_register(sockfd, version, map);
+  if (version == WIRE_V1) {
+    return version;
+  }
+  uint8_t ack;
+  ssize_t n = recv(sockfd, &ack, sizeof(ack), MSG_PEEK);
+  if (n == sizeof(ack) && ack == version) {
+    sread(sockfd, &ack, sizeof(ack));
+    return version;
+  }
+  if (n == sizeof(ack)) {
+    printf("The server only speaks protocol v1\n");
+    return WIRE_V1;
+  }
+  printf("The server does not speak protocol v%d, falling back to v1\n",
+         version);
+  sclose(sockfd);
+  return register_player(host, port, WIRE_V1, map);
+}
+
+// Decodes the complete messages at the start of 'in' into 'msgs'. A map
+// snapshot is expanded into the spawn stream the GUI expects.
+// RES: the number of bytes used, -1 if the stream is invalid.
+ssize_t decode_messages(const uint8_t *in, size_t len, int version,
+                        struct MessageBuffer *msgs) {
+  size_t used = 0;
+  while (used < len) {
+    ssize_t n;
+    if (wire_is_snapshot(version, in + used)) {
+      uint8_t *tiles;
+      uint32_t width;
+      uint32_t height;
+      n = wire_decode_snapshot(in + used, len - used, &tiles, &width,
+                               &height);
+      if (n > 0) {
+        free(load_tiles_buf(tiles, width, height, msgs));
+        free(tiles);
+      }
+    } else {
+      union Message msg;
+      n = wire_decode(version, in + used, len - used, &msg);
+      if (n > 0) {
+        message_buffer_push(msgs, &msg);
+      }
+    }
+    if (n <= 0) {
+      return n < 0 ? -1 : (ssize_t)used;
+    }
+    used += (size_t)n;
+  }
+  return (ssize_t)used;
+}
+
+// Turns the messages read on 'in' in 'version' into legacy messages written
+// on 'out', until 'in' is closed.
+void decode_stream(FileDescriptor in, FileDescriptor out, int version) {
+  // The buffer grows when a message (a large snapshot) does not fit in it.
+  size_t capacity = DECODE_CHUNK;
+  uint8_t *buf = smalloc(capacity);
+  struct MessageBuffer msgs;
+  message_buffer_init(&msgs, DECODE_CHUNK);
+  size_t len = 0;
+  while (1) {
+    if (len == capacity) {
+      capacity *= 2;
+      buf = realloc(buf, capacity);
+      checkNull(buf, "Error realloc");
+    }
+    ssize_t received = read(in, buf + len, capacity - len);
+    if (received <= 0) {
+      break;
+    }
+    len += (size_t)received;
+
+    ssize_t used = decode_messages(buf, len, version, &msgs);
+    if (used < 0) {
+      fprintf(stderr, "Invalid message received from the server\n");
+      break;
+    }
+    message_buffer_flush(&msgs, out);
+    memmove(buf, buf + used, len - (size_t)used);
+    len -= (size_t)used;
+  }
+  message_buffer_free(&msgs);
+  free(buf);
+  sclose(out);
+}
@@ -0,0 +1,843 @@
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "game.h"
+#include "histogram.h"
+#include "script.h"
+#include "utils_v3.h"
+#include "wire.h"
+
+/**
+ * Drives many synthetic players against a pas_server, without any GUI. Each
+ * player connects, registers with a REGISTRATION word, decodes everything the
+ * server sends and, once it knows which player it is, presses a key at a
+ * fixed rate: the moves of a script (a test*\/joueur*.txt file, player 1
+ * replays the first script and player 2 the second) or a random walk. A few
+ * threads share the players, each one serving its own with an epoll loop.
+ *
+ * The latency of a move is the time between the key press sent and the
+ * MOVEMENT of the player received. A move into a wall is never answered: the
+ * next MOVEMENT is credited to the latest move, which keeps the latency exact
+ * as long as it stays below the time between two moves of a player.
+ *
+ * Every second, the connects, moves and MOVEMENTs of the last second are
+ * printed; at the end, the totals, the errors and the percentiles of the
+ * connect and move latencies.
+ *
+ * usage: see __usage()
+ */
+
+#define DEFAULT_CLIENTS 100
+#define DEFAULT_RATE 10
+#define MAX_THREADS 64
+// Size of the first receive buffer of a player, which grows when a message
+// (a large snapshot) does not fit in it.
+#define RECV_CHUNK 4096
+#define MAX_EVENTS 256
+// Longest epoll_wait: the threads check whether they must stop that often.
+#define MAX_WAIT_MS 100
+#define NO_DEADLINE UINT64_MAX
+// With -l, a player whose connect failed tries again after a delay which
+// doubles with each failure in a row, between these bounds (in µs).
+#define RETRY_MIN_US 10000
+#define RETRY_MAX_US 1000000
+
+enum ClientState {
+  // not connected, waiting for its turn to connect
+  CLIENT_IDLE,
+  CLIENT_CONNECTING,
+  // registered in version 2 or 3, waiting for the answer of the server
+  CLIENT_REGISTERING,
+  CLIENT_PLAYING,
+  // its game is over (or failed) and it does not reconnect
+  CLIENT_DONE
+};
+
+struct Client {
+  FileDescriptor fd;
+  enum ClientState state;
+  // wire version of the connection: the one asked for, or 1 if the server
+  // turns out to be a legacy one
+  int version;
+  // 1 or 2 once the REGISTRATION message is received, 0 before
+  int player;
+  // ids of the two players on the map, -1 until they are spawned
+  int64_t ids[NB_PLAYERS];
+  // when connect() was called, in µs
+  uint64_t connect_us;
+  // delay before its next connect after a failed one, 0 once registered
+  uint64_t retry_delay_us;
+  // when it may connect again, while it waits among the retrying players
+  uint64_t retry_at_us;
+  // when the next key press is due, in µs
+  uint64_t next_move_us;
+  // when the latest key press not answered yet was sent, 0 if none
+  uint64_t pending_us;
+  // next move of the script
+  size_t cursor;
+  unsigned seed;
+  uint8_t *buf;
+  size_t len;
+  size_t capacity;
+};
+
+struct Counters {
+  atomic_uint_fast64_t connects;
+  atomic_uint_fast64_t games;
+  atomic_uint_fast64_t moves;
+  // MOVEMENTs of the player itself
+  atomic_uint_fast64_t movements;
+  atomic_uint_fast64_t messages;
+  atomic_uint_fast64_t bytes;
+  // connections currently registered
+  atomic_int_fast64_t playing;
+  atomic_uint_fast64_t connect_errors;
+  atomic_uint_fast64_t registration_errors;
+  // connections closed by the server before the end of the game
+  atomic_uint_fast64_t disconnects;
+  atomic_uint_fast64_t protocol_errors;
+  // key presses which did not fit in the socket
+  atomic_uint_fast64_t send_errors;
+};
+
+// A thread and the players it serves.
+struct Loader {
+  struct Client *clients;
+  size_t nb_clients;
+  // indices of the idle players, connected in turn
+  size_t *idle;
+  size_t nb_idle;
+  // indices of the players whose connect failed, waiting for their retry_at_us
+  size_t *retrying;
+  size_t nb_retrying;
+  // players whose game is over for good
+  size_t nb_done;
+  FileDescriptor epfd;
+  // time between two connects, 0 to connect every idle player at once
+  uint64_t connect_interval_us;
+  uint64_t next_connect_us;
+  struct Counters counters;
+  struct Histogram connect_lat_us;
+  struct Histogram move_lat_us;
+  atomic_bool finished;
+  pthread_t thread;
+};
+
+static struct sockaddr_in server;
+static int version = WIRE_V3;
+static int map = 0;
+static uint64_t move_interval_us;
+static struct Script scripts[NB_PLAYERS];
+static int nb_scripts = 0;
+// reconnect the players whose game is over
+static bool loop = false;
+static atomic_bool stopping;
+
+static uint64_t __now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static void __sigint_handler(int signum) { atomic_store(&stopping, true); }
+
+static void __usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [-c clients] [-t threads] [-r moves/s] [-R connects/s] "
+          "[-d seconds] [-w 1|2|3] [-m map] [-s script [-s script]] [-l] "
+          "<host> <port>\n",
+          prog);
+  fprintf(stderr, "  -c  number of concurrent players (default: %d)\n",
+          DEFAULT_CLIENTS);
+  fprintf(stderr, "  -t  number of threads serving them (default: 1)\n");
+  fprintf(stderr, "  -r  key presses per second of each player (default: "
+                  "%d)\n",
+          DEFAULT_RATE);
+  fprintf(stderr, "  -R  connects per second (default: 0, all at once)\n");
+  fprintf(stderr, "  -d  stop after d seconds (default: 0, when every game "
+                  "is over)\n");
+  fprintf(stderr, "  -w  protocol version (default: %d)\n", WIRE_V3);
+  fprintf(stderr, "  -m  map asked for (default: 0, any map)\n");
+  fprintf(stderr, "  -s  moves of player 1, then of player 2 (a "
+                  "test*/joueur*.txt file);\n");
+  fprintf(stderr, "      without scripts, the players walk at random\n");
+  fprintf(stderr, "  -l  reconnect the players whose game is over (use with "
+                  "-d);\n");
+  fprintf(stderr, "      a failed connect is retried after %d ms, doubled "
+                  "after each failure\n      in a row up to %d ms\n",
+          RETRY_MIN_US / 1000, RETRY_MAX_US / 1000);
+}
+
+// RES: the next move of 'c', -1 if its script is over.
+static int __next_move(struct Client *c) {
+  if (nb_scripts == 0) {
+    return rand_r(&c->seed) % 4;
+  }
+  const struct Script *script = &scripts[(c->player - 1) % nb_scripts];
+  return script_next(script, &c->cursor);
+}
+
+static void __close(struct Loader *l, struct Client *c) {
+  if (c->state == CLIENT_PLAYING) {
+    atomic_fetch_sub(&l->counters.playing, 1);
+  }
+  bool failed = c->state == CLIENT_CONNECTING;
+  // closing the socket removes it from the epoll set
+  if (c->fd >= 0) {
+    close(c->fd);
+  }
+  c->fd = -1;
+  c->len = 0;
+  if (loop && failed) {
+    // a server which is down or refuses the connections is not hammered:
+    // half of the delay is random so that the players refused together do
+    // not all come back together
+    c->retry_delay_us *= 2;
+    if (c->retry_delay_us < RETRY_MIN_US) {
+      c->retry_delay_us = RETRY_MIN_US;
+    } else if (c->retry_delay_us > RETRY_MAX_US) {
+      c->retry_delay_us = RETRY_MAX_US;
+    }
+    c->retry_at_us = __now_us() + c->retry_delay_us / 2 +
+                     rand_r(&c->seed) % (c->retry_delay_us / 2);
+    c->state = CLIENT_IDLE;
+    l->retrying[l->nb_retrying++] = c - l->clients;
+  } else if (loop) {
+    c->state = CLIENT_IDLE;
+    l->idle[l->nb_idle++] = c - l->clients;
+  } else {
+    c->state = CLIENT_DONE;
+    l->nb_done++;
+  }
+}
+
+// Starts connecting the idle player 'c'.
+static void __connect(struct Loader *l, struct Client *c, uint64_t now) {
+  c->state = CLIENT_CONNECTING;
+  // out of descriptors (EMFILE) is a failed connect like any other: with -l,
+  // the player backs off and tries again
+  c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (c->fd < 0) {
+    atomic_fetch_add(&l->counters.connect_errors, 1);
+    __close(l, c);
+    return;
+  }
+  // a key press is a lone int: it must not wait for the next one
+  int on = 1;
+  setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  c->player = 0;
+  for (int i = 0; i < NB_PLAYERS; i++) {
+    c->ids[i] = -1;
+  }
+  c->pending_us = 0;
+  c->cursor = 0;
+  c->connect_us = now;
+  if (connect(c->fd, (struct sockaddr *)&server, sizeof(server)) < 0 &&
+      errno != EINPROGRESS) {
+    atomic_fetch_add(&l->counters.connect_errors, 1);
+    __close(l, c);
+    return;
+  }
+  struct epoll_event ev = {.events = EPOLLOUT, .data.ptr = c};
+  checkNeg(epoll_ctl(l->epfd, EPOLL_CTL_ADD, c->fd, &ev), "Error epoll_ctl");
+}
+
+// Connects the idle players whose turn has come.
+// RES: when the next one is due.
+static uint64_t __connect_due(struct Loader *l, uint64_t now) {
+  uint64_t next = NO_DEADLINE;
+  for (size_t i = 0; i < l->nb_retrying;) {
+    struct Client *c = &l->clients[l->retrying[i]];
+    if (c->retry_at_us <= now) {
+      l->idle[l->nb_idle++] = l->retrying[i];
+      l->retrying[i] = l->retrying[--l->nb_retrying];
+      continue;
+    }
+    if (c->retry_at_us < next) {
+      next = c->retry_at_us;
+    }
+    i++;
+  }
+  while (l->nb_idle > 0 &&
+         (l->connect_interval_us == 0 || l->next_connect_us <= now)) {
+    struct Client *c = &l->clients[l->idle[--l->nb_idle]];
+    __connect(l, c, now);
+    l->next_connect_us += l->connect_interval_us;
+    if (l->next_connect_us < now) {
+      l->next_connect_us = now;
+    }
+  }
+  if (l->nb_idle > 0 && l->next_connect_us < next) {
+    next = l->next_connect_us;
+  }
+  return next;
+}
+
+// The connection of 'c' is registered: the player waits for its match.
+static void __registered(struct Loader *l, struct Client *c, uint64_t now) {
+  c->state = CLIENT_PLAYING;
+  c->retry_delay_us = 0;
+  atomic_fetch_add(&l->counters.connects, 1);
+  atomic_fetch_add(&l->counters.playing, 1);
+  histogram_record(&l->connect_lat_us, now - c->connect_us);
+}
+
+// The connection of 'c' is established: it sends its REGISTRATION word.
+static void __connected(struct Loader *l, struct Client *c, uint64_t now) {
+  int error = 0;
+  socklen_t len = sizeof(error);
+  getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &error, &len);
+  int word = wire_registration_word(version, map);
+  if (error != 0 ||
+      send(c->fd, &word, sizeof(word), MSG_NOSIGNAL) != sizeof(word)) {
+    atomic_fetch_add(&l->counters.connect_errors, 1);
+    __close(l, c);
+    return;
+  }
+  c->version = version;
+  if (version == WIRE_V1) {
+    __registered(l, c, now);
+  } else {
+    c->state = CLIENT_REGISTERING;
+  }
+  struct epoll_event ev = {.events = EPOLLIN, .data.ptr = c};
+  checkNeg(epoll_ctl(l->epfd, EPOLL_CTL_MOD, c->fd, &ev), "Error epoll_ctl");
+}
+
+// RES: false if the game of 'c' is over.
+static bool __on_message(struct Loader *l, struct Client *c,
+                         const union Message *msg, uint64_t now) {
+  atomic_fetch_add(&l->counters.messages, 1);
+  switch (msg->msgt) {
+  case REGISTRATION:
+    c->player = msg->registration.player;
+    // the players do not all press their keys at the same time
+    c->next_move_us = now + rand_r(&c->seed) % move_interval_us;
+    break;
+  case SPAWN:
+    if (msg->spawn.item == PLAYER1 || msg->spawn.item == PLAYER2) {
+      c->ids[msg->spawn.item - PLAYER1] = msg->spawn.id;
+    }
+    break;
+  case MOVEMENT:
+    if (c->player != 0 && msg->movement.id == c->ids[c->player - 1]) {
+      atomic_fetch_add(&l->counters.movements, 1);
+      if (c->pending_us != 0) {
+        histogram_record(&l->move_lat_us, now - c->pending_us);
+        c->pending_us = 0;
+      }
+    }
+    break;
+  case GAME_OVER:
+    atomic_fetch_add(&l->counters.games, 1);
+    return false;
+  default:
+    break;
+  }
+  return true;
+}
+
+// Handles the complete messages at the start of the buffer of 'c'.
+// RES: the number of bytes used, -1 if the stream is invalid or the game is
+//      over.
+static ssize_t __decode(struct Loader *l, struct Client *c, uint64_t now) {
+  size_t used = 0;
+  while (used < c->len) {
+    const uint8_t *in = c->buf + used;
+    size_t len = c->len - used;
+    union Message msg;
+    ssize_t n;
+    if (c->version == WIRE_V1) {
+      n = len >= sizeof(msg) ? (ssize_t)sizeof(msg) : 0;
+      if (n > 0) {
+        memcpy(&msg, in, sizeof(msg));
+      }
+    } else if (wire_is_snapshot(c->version, in)) {
+      uint8_t *tiles;
+      uint32_t width;
+      uint32_t height;
+      n = wire_decode_snapshot(in, len, &tiles, &width, &height);
+      if (n > 0) {
+        // the ids of the players only depend on the size of the map
+        c->ids[0] = PLAYER1_ID(width * height);
+        c->ids[1] = PLAYER2_ID(width * height);
+        free(tiles);
+        atomic_fetch_add(&l->counters.messages, 1);
+        used += (size_t)n;
+        continue;
+      }
+    } else {
+      n = wire_decode(c->version, in, len, &msg);
+    }
+    if (n < 0 || (n > 0 && c->player == 0 && msg.msgt == REGISTRATION &&
+                  msg.registration.player != 1 &&
+                  msg.registration.player != 2)) {
+      atomic_fetch_add(&l->counters.protocol_errors, 1);
+      return -1;
+    }
+    if (n == 0) {
+      break;
+    }
+    used += (size_t)n;
+    if (!__on_message(l, c, &msg, now)) {
+      return -1;
+    }
+  }
+  return (ssize_t)used;
+}
+
+// Reads everything the server sent to 'c'.
+static void __receive(struct Loader *l, struct Client *c) {
+  while (1) {
+    if (c->len == c->capacity) {
+      c->capacity = c->capacity == 0 ? RECV_CHUNK : 2 * c->capacity;
+      c->buf = realloc(c->buf, c->capacity);
+      checkNull(c->buf, "Error realloc");
+    }
+    ssize_t received = read(c->fd, c->buf + c->len, c->capacity - c->len);
+    if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return;
+    }
+    if (received <= 0) {
+      atomic_fetch_add(c->state == CLIENT_REGISTERING
+                           ? &l->counters.registration_errors
+                           : &l->counters.disconnects,
+                       1);
+      __close(l, c);
+      return;
+    }
+    uint64_t now = __now_us();
+    atomic_fetch_add(&l->counters.bytes, (uint64_t)received);
+    c->len += (size_t)received;
+
+    size_t start = 0;
+    if (c->state == CLIENT_REGISTERING) {
+      // a legacy server does not answer, it sends the v1 messages right away
+      // (see wire.h)
+      if (c->buf[0] == c->version) {
+        start = 1;
+      } else {
+        c->version = WIRE_V1;
+      }
+      __registered(l, c, now);
+    }
+    memmove(c->buf, c->buf + start, c->len - start);
+    c->len -= start;
+    ssize_t used = __decode(l, c, now);
+    if (used < 0) {
+      // the game is over (or the stream is invalid)
+      __close(l, c);
+      return;
+    }
+    memmove(c->buf, c->buf + used, c->len - (size_t)used);
+    c->len -= (size_t)used;
+  }
+}
+
+// Sends the key presses which are due.
+// RES: when the next one is due.
+static uint64_t __play_due(struct Loader *l, uint64_t now) {
+  uint64_t next = NO_DEADLINE;
+  for (size_t i = 0; i < l->nb_clients; i++) {
+    struct Client *c = &l->clients[i];
+    if (c->state != CLIENT_PLAYING || c->player == 0) {
+      continue;
+    }
+    if (c->next_move_us <= now) {
+      int dir = __next_move(c);
+      if (dir < 0) {
+        // its script is over: it waits for the end of the game
+        c->next_move_us = NO_DEADLINE;
+        continue;
+      }
+      ssize_t sent =
+          send(c->fd, &dir, sizeof(dir), MSG_NOSIGNAL | MSG_DONTWAIT);
+      if (sent == sizeof(dir)) {
+        atomic_fetch_add(&l->counters.moves, 1);
+        c->pending_us = now;
+      } else {
+        atomic_fetch_add(&l->counters.send_errors, 1);
+        // a full socket only loses this key press, but a short write breaks
+        // the framing of the next ones and any other error ends the
+        // connection
+        if (sent >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+          __close(l, c);
+          continue;
+        }
+      }
+      // a player late by more than a move does not catch up in a burst
+      c->next_move_us += move_interval_us;
+      if (c->next_move_us <= now) {
+        c->next_move_us = now + move_interval_us;
+      }
+    }
+    if (c->next_move_us < next) {
+      next = c->next_move_us;
+    }
+  }
+  return next;
+}
+
+static void *__loader_main(void *arg) {
+  struct Loader *l = arg;
+  struct epoll_event events[MAX_EVENTS];
+  l->next_connect_us = __now_us();
+  while (!atomic_load(&stopping) && l->nb_done < l->nb_clients) {
+    uint64_t now = __now_us();
+    uint64_t next = __connect_due(l, now);
+    uint64_t due = __play_due(l, now);
+    if (due < next) {
+      next = due;
+    }
+    int timeout = MAX_WAIT_MS;
+    if (next <= now) {
+      timeout = 0;
+    } else if (next - now < MAX_WAIT_MS * 1000) {
+      timeout = (int)((next - now + 999) / 1000);
+    }
+    int ready = epoll_wait(l->epfd, events, MAX_EVENTS, timeout);
+    if (ready < 0 && errno == EINTR) {
+      continue;
+    }
+    checkNeg(ready, "Error epoll_wait");
+    for (int i = 0; i < ready; i++) {
+      struct Client *c = events[i].data.ptr;
+      if (c->state == CLIENT_CONNECTING) {
+        __connected(l, c, __now_us());
+      } else if (c->fd >= 0) {
+        __receive(l, c);
+      }
+    }
+  }
+  for (size_t i = 0; i < l->nb_clients; i++) {
+    if (l->clients[i].fd >= 0) {
+      close(l->clients[i].fd);
+    }
+  }
+  atomic_store(&l->finished, true);
+  return NULL;
+}
+
+static void __loader_init(struct Loader *l, size_t nb_clients,
+                          size_t first_id, uint64_t connect_interval_us) {
+  l->clients = smalloc(nb_clients * sizeof(struct Client));
+  l->idle = smalloc(nb_clients * sizeof(size_t));
+  l->retrying = smalloc(nb_clients * sizeof(size_t));
+  l->nb_retrying = 0;
+  l->nb_clients = nb_clients;
+  l->nb_idle = nb_clients;
+  l->nb_done = 0;
+  for (size_t i = 0; i < nb_clients; i++) {
+    l->clients[i] = (struct Client){
+        .fd = -1,
+        .state = CLIENT_IDLE,
+        .seed = (unsigned)(time(NULL) ^ ((first_id + i) * 2654435761u))};
+    // the first player connects first
+    l->idle[i] = nb_clients - 1 - i;
+  }
+  l->epfd = epoll_create1(EPOLL_CLOEXEC);
+  checkNeg(l->epfd, "Error epoll_create1");
+  l->connect_interval_us = connect_interval_us;
+  memset(&l->counters, 0, sizeof(l->counters));
+  histogram_reset(&l->connect_lat_us);
+  histogram_reset(&l->move_lat_us);
+  atomic_init(&l->finished, false);
+}
+
+static void __loader_free(struct Loader *l) {
+  for (size_t i = 0; i < l->nb_clients; i++) {
+    free(l->clients[i].buf);
+  }
+  free(l->clients);
+  free(l->idle);
+  free(l->retrying);
+  sclose(l->epfd);
+}
+
+#define SUM(loaders, n, field, total)                                          \
+  do {                                                                         \
+    total = 0;                                                                 \
+    for (int _i = 0; _i < (n); _i++) {                                         \
+      total += atomic_load(&(loaders)[_i].counters.field);                     \
+    }                                                                          \
+  } while (0)
+
+// The counters of every loader added up.
+struct Totals {
+  uint64_t connects;
+  uint64_t games;
+  uint64_t moves;
+  uint64_t movements;
+  uint64_t messages;
+  uint64_t bytes;
+  int64_t playing;
+  uint64_t connect_errors;
+  uint64_t registration_errors;
+  uint64_t disconnects;
+  uint64_t protocol_errors;
+  uint64_t send_errors;
+};
+
+static void __totals(const struct Loader *loaders, int n, struct Totals *t) {
+  SUM(loaders, n, connects, t->connects);
+  SUM(loaders, n, games, t->games);
+  SUM(loaders, n, moves, t->moves);
+  SUM(loaders, n, movements, t->movements);
+  SUM(loaders, n, messages, t->messages);
+  SUM(loaders, n, bytes, t->bytes);
+  SUM(loaders, n, playing, t->playing);
+  SUM(loaders, n, connect_errors, t->connect_errors);
+  SUM(loaders, n, registration_errors, t->registration_errors);
+  SUM(loaders, n, disconnects, t->disconnects);
+  SUM(loaders, n, protocol_errors, t->protocol_errors);
+  SUM(loaders, n, send_errors, t->send_errors);
+}
+
+static uint64_t __errors(const struct Totals *t) {
+  return t->connect_errors + t->registration_errors + t->disconnects +
+         t->protocol_errors + t->send_errors;
+}
+
+// Resolves 'host' (a name or an IPv4 address) into 'server'.
+static bool __resolve(const char *host, int port) {
+  struct addrinfo hints = {.ai_family = AF_INET, .ai_socktype = SOCK_STREAM};
+  struct addrinfo *res;
+  if (getaddrinfo(host, NULL, &hints, &res) != 0) {
+    return false;
+  }
+  memcpy(&server, res->ai_addr, sizeof(server));
+  server.sin_port = htons(port);
+  freeaddrinfo(res);
+  return true;
+}
+
+// Every player holds a socket: the soft limit on the open files is raised to
+// the hard one.
+static void __raise_fd_limit(size_t nb_clients) {
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 &&
+      limit.rlim_cur < limit.rlim_max) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 &&
+      limit.rlim_cur != RLIM_INFINITY && limit.rlim_cur < nb_clients + 16) {
+    fprintf(stderr, "Warning: at most %llu open files, some players will not "
+                    "connect\n",
+            (unsigned long long)limit.rlim_cur);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  if (argv == NULL) {
+    return EXIT_FAILURE;
+  }
+  int nb_clients = DEFAULT_CLIENTS;
+  int nb_threads = 1;
+  int rate = DEFAULT_RATE;
+  int connect_rate = 0;
+  int duration = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "c:t:r:R:d:w:m:s:l")) != -1) {
+    switch (opt) {
+    case 'c':
+      nb_clients = atoi(optarg);
+      if (nb_clients <= 0) {
+        fprintf(stderr, "Invalid number of players: %s\n", optarg);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 't':
+      nb_threads = atoi(optarg);
+      if (nb_threads <= 0 || nb_threads > MAX_THREADS) {
+        fprintf(stderr, "Invalid number of threads: %s (1 to %d)\n", optarg,
+                MAX_THREADS);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'r':
+      rate = atoi(optarg);
+      if (rate <= 0 || rate > 1000000) {
+        fprintf(stderr, "Invalid move rate: %s\n", optarg);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'R':
+      connect_rate = atoi(optarg);
+      if (connect_rate < 0) {
+        fprintf(stderr, "Invalid connect rate: %s\n", optarg);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'd':
+      duration = atoi(optarg);
+      if (duration < 0) {
+        fprintf(stderr, "Invalid duration: %s\n", optarg);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'w':
+      version = atoi(optarg);
+      if (version < WIRE_V1 || version > WIRE_V3) {
+        fprintf(stderr, "Unknown protocol version: %s\n", optarg);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'm':
+      map = atoi(optarg);
+      if (map < 0 || map > WIRE_MAX_MAP) {
+        fprintf(stderr, "Invalid map number: %s\n", optarg);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 's':
+      if (nb_scripts == NB_PLAYERS) {
+        fprintf(stderr, "At most %d scripts\n", NB_PLAYERS);
+        return EXIT_FAILURE;
+      }
+      script_load(optarg, &scripts[nb_scripts++]);
+      break;
+    case 'l':
+      loop = true;
+      break;
+    default:
+      __usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  if (argc - optind != 2) {
+    __usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+  int port = atoi(argv[optind + 1]);
+  if (port <= 0) {
+    fprintf(stderr, "Invalid port number: %s\n", argv[optind + 1]);
+    return EXIT_FAILURE;
+  }
+  if (!__resolve(argv[optind], port)) {
+    fprintf(stderr, "Unknown host: %s\n", argv[optind]);
+    return EXIT_FAILURE;
+  }
+  if (nb_threads > nb_clients) {
+    nb_threads = nb_clients;
+  }
+  move_interval_us = 1000000 / rate;
+  if (move_interval_us == 0) {
+    move_interval_us = 1;
+  }
+  __raise_fd_limit(nb_clients);
+
+  atomic_init(&stopping, false);
+  ssigaction(SIGINT, __sigint_handler);
+  signal(SIGPIPE, SIG_IGN);
+
+  // Each thread connects its share of the connect rate.
+  uint64_t connect_interval_us =
+      connect_rate > 0 ? (uint64_t)1000000 * nb_threads / connect_rate : 0;
+  struct Loader *loaders = smalloc(nb_threads * sizeof(struct Loader));
+  size_t first = 0;
+  for (int t = 0; t < nb_threads; t++) {
+    size_t share = nb_clients / nb_threads + (t < nb_clients % nb_threads);
+    __loader_init(&loaders[t], share, first, connect_interval_us);
+    first += share;
+  }
+  printf("%d player(s) on %d thread(s) against %s:%d, protocol v%d, %d "
+         "move(s)/s each (%s)\n",
+         nb_clients, nb_threads, argv[optind], port, version, rate,
+         nb_scripts > 0 ? "scripts" : "random walks");
+
+  // The signals are handled by the main thread.
+  sigset_t blocked;
+  sigset_t orig;
+  ssigemptyset(&blocked);
+  ssigaddset(&blocked, SIGINT);
+  ssigprocmask(SIG_BLOCK, &blocked, &orig);
+  uint64_t start = __now_us();
+  for (int t = 0; t < nb_threads; t++) {
+    int ret = pthread_create(&loaders[t].thread, NULL, __loader_main,
+                             &loaders[t]);
+    checkCond(ret != 0, "Error pthread_create");
+  }
+  ssigprocmask(SIG_SETMASK, &orig, NULL);
+
+  struct Totals last = {0};
+  int elapsed = 0;
+  while (!atomic_load(&stopping) && (duration == 0 || elapsed < duration)) {
+    // interrupted by SIGINT
+    sleep(1);
+    elapsed++;
+    struct Totals now;
+    __totals(loaders, nb_threads, &now);
+    printf("[%4ds] %lld playing, %llu connects/s, %llu moves/s, %llu "
+           "movements/s, %llu games over, %llu errors\n",
+           elapsed, (long long)now.playing,
+           (unsigned long long)(now.connects - last.connects),
+           (unsigned long long)(now.moves - last.moves),
+           (unsigned long long)(now.movements - last.movements),
+           (unsigned long long)now.games, (unsigned long long)__errors(&now));
+    fflush(stdout);
+    last = now;
+    bool finished = true;
+    for (int t = 0; t < nb_threads; t++) {
+      finished = finished && atomic_load(&loaders[t].finished);
+    }
+    if (finished) {
+      break;
+    }
+  }
+  atomic_store(&stopping, true);
+
+  struct Histogram connect_lat_us;
+  struct Histogram move_lat_us;
+  histogram_reset(&connect_lat_us);
+  histogram_reset(&move_lat_us);
+  for (int t = 0; t < nb_threads; t++) {
+    pthread_join(loaders[t].thread, NULL);
+    histogram_merge(&connect_lat_us, &loaders[t].connect_lat_us);
+    histogram_merge(&move_lat_us, &loaders[t].move_lat_us);
+  }
+  double seconds = (__now_us() - start) / 1e6;
+  struct Totals total;
+  __totals(loaders, nb_threads, &total);
+
+  printf("%d player(s) during %.1f s\n", nb_clients, seconds);
+  printf("  connects: %llu (%.1f/s), games over: %llu\n",
+         (unsigned long long)total.connects, total.connects / seconds,
+         (unsigned long long)total.games);
+  printf("  moves: %llu (%.1f/s), movements: %llu (%.1f/s)\n",
+         (unsigned long long)total.moves, total.moves / seconds,
+         (unsigned long long)total.movements, total.movements / seconds);
+  printf("  received: %llu message(s), %llu bytes\n",
+         (unsigned long long)total.messages, (unsigned long long)total.bytes);
+  printf("  errors: %llu connect, %llu registration, %llu disconnected, %llu "
+         "protocol, %llu send\n",
+         (unsigned long long)total.connect_errors,
+         (unsigned long long)total.registration_errors,
+         (unsigned long long)total.disconnects,
+         (unsigned long long)total.protocol_errors,
+         (unsigned long long)total.send_errors);
+  histogram_print(&connect_lat_us, "connect", "us", stdout);
+  histogram_print(&move_lat_us, "move-to-MOVEMENT", "us", stdout);
+
+  for (int t = 0; t < nb_threads; t++) {
+    __loader_free(&loaders[t]);
+  }
+  free(loaders);
+  for (int s = 0; s < nb_scripts; s++) {
+    script_free(&scripts[s]);
+  }
+  return __errors(&total) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
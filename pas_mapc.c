@@ -0,0 +1,103 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "game.h"
+#include "map_format.h"
+#include "utils_v3.h"
+
+#define CHECK_ARG "-c"
+
+static void usage(const char *prog) {
+  printf("Usage: %s <map.txt> <map.pcm>\n", prog);
+  printf("       %s %s <map>...\n", prog, CHECK_ARG);
+  printf("  Converts a text map to the binary format loaded by pas_server,\n");
+  printf("  or, with %s, only validates text or binary maps.\n", CHECK_ARG);
+}
+
+// Reads the map stored at 'path', text or binary, into '*tiles' (to be freed
+// by the caller).
+// RES: the number of errors found in the map, -1 if it cannot be read.
+static int read_map(const char *path, uint8_t **tiles, uint32_t *width,
+                    uint32_t *height) {
+  size_t image_len;
+  const struct MapHeader *image = map_format_map(path, &image_len);
+  if (image != NULL) {
+    *width = image->width;
+    *height = image->height;
+    *tiles = smalloc((size_t)*width * *height + 1);
+    memcpy(*tiles, map_format_tiles(image), (size_t)*width * *height);
+    map_format_unmap(image, image_len);
+    return 0;
+  }
+
+  *tiles = NULL;
+  FileDescriptor fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    perror(path);
+    return -1;
+  }
+  struct stat st;
+  checkNeg(fstat(fd, &st), "Error fstat");
+  char *text = smalloc(st.st_size + 1);
+  size_t len = 0;
+  ssize_t n;
+  while ((n = sread(fd, text + len, st.st_size - len)) > 0) {
+    len += n;
+  }
+  sclose(fd);
+
+  size_t ignored;
+  *tiles = map_text_to_tiles(text, len, width, height, &ignored);
+  free(text);
+  if (ignored > 0) {
+    fprintf(stderr, "%s: %zu character(s) ignored (unknown or out of %dx%d)\n",
+            path, ignored, MAX_WIDTH, MAX_HEIGHT);
+    return 1;
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  uint8_t *tiles;
+  uint32_t width;
+  uint32_t height;
+
+  if (argc >= 3 && strcmp(argv[1], CHECK_ARG) == 0) {
+    int status = EXIT_SUCCESS;
+    for (int i = 2; i < argc; i++) {
+      int errors = read_map(argv[i], &tiles, &width, &height);
+      if (errors == 0) {
+        errors = map_format_validate(tiles, width, height, argv[i]);
+      }
+      free(tiles);
+      if (errors != 0) {
+        status = EXIT_FAILURE;
+      } else {
+        printf("%s: ok (%ux%u)\n", argv[i], width, height);
+      }
+    }
+    return status;
+  }
+
+  if (argc != 3) {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if (read_map(argv[1], &tiles, &width, &height) != 0 ||
+      map_format_validate(tiles, width, height, argv[1]) != 0) {
+    fprintf(stderr, "%s: not converted\n", argv[1]);
+    free(tiles);
+    return EXIT_FAILURE;
+  }
+  FileDescriptor out = sopen(argv[2], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  map_format_write(out, tiles, width, height);
+  sclose(out);
+  free(tiles);
+  printf("%s -> %s (%ux%u)\n", argv[1], argv[2], width, height);
+  return EXIT_SUCCESS;
+}
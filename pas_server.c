@@ -3,19 +3,27 @@
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/fcntl.h>
-#include <sys/ipc.h>
 #include <sys/socket.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 #include "common_fd.h"
+#include "epoll_engine.h"
 #include "game.h"
-#include "ipc_keys.h"
+#include "map_cache.h"
+#include "matchmaker.h"
+#include "metrics.h"
 #include "pascman.h"
 #include "pm_exec_paths.h"
+#include "room.h"
+#include "send_queue.h"
+#include "sharded_engine.h"
 #include "utils_v3.h"
+#include "wire.h"
+#include "worker_pool.h"
 
-#define PERM 0666
 // If you want to enable the CTRL-C during the game loop, set this to true
 #define FORCE_GAME_STOP false
 // Timeout in seconds for the game loop used in a Alarm signal handler
@@ -24,21 +32,35 @@
 #define DEBUG false
 
 int child_handler(void);
-int init_ipc(struct GameState **state, int *sem_id, int *shm_id);
-int handle_new_players(FileDescriptor *sockfd, struct GameState *state,
-                       FileDescriptor *map, FileDescriptor *players_fd,
-                       pid_t *client_handlers_pid);
+int init_ipc(struct RoomSegment **segment, size_t segment_size);
+int handle_new_players(const struct Match *match, struct GameState *state,
+                       const struct CompiledMap *map,
+                       FileDescriptor *players_fd, pid_t *client_handlers_pid,
+                       int pipefd[2]);
+void usage(const char *prog);
 
 struct GameState *state = NULL;
-FileDescriptor map = -1;
 FileDescriptor sockfd = -1;
 bool sigint_received = false;
 pid_t *client_handlers = NULL;
 FileDescriptor *players_fd = NULL;
+int wire_versions[NB_PLAYERS];
+enum MessageTransport transport = TRANSPORT_RING;
+// the handlers stamp the key presses (-L, see stage_trace.h)
+bool trace_latency = false;
+// message ring of the current match, NULL with the pipe transport
+struct RoomRing match_ring;
+const struct RoomRing *ring = NULL;
 int player_count = 0;
 int client_handler_count = 0;
-int shm_id = -1;
-int sem_id = -1;
+// segment of the matches (room 0 of the arena)
+struct ShmSegment shm = {.base = NULL};
+// pre-forked handlers and broadcaster, one set is enough here (-P)
+struct WorkerPool pool = {.sets = NULL, .size = 0};
+// the set serving the current match, NULL to fork and exec
+struct WorkerSet *workers = NULL;
+// accepts and queues the players (fork and rooms engines)
+struct Matchmaker mm;
 
 void cleanup(void) {
   printf("Stopping the game...\n");
@@ -48,21 +70,13 @@ void cleanup(void) {
     free(state);
   }
 
-  printf("- Closing the map...\n");
-  if (map != -1) {
-    sclose(map);
-  }
+  printf("- Freeing the compiled maps...\n");
+  map_cache_clear();
 
   printf("- Deleting the shared memory...\n");
   // shm delete
-  if (shm_id != -1) {
-    sshmdelete(shm_id);
-  }
-
-  printf("- Deleting the semaphore...\n");
-  // sem delete
-  if (sem_id != -1) {
-    sem_delete(sem_id);
+  if (shm.base != NULL) {
+    shm_arena_destroy(&shm);
   }
 
   printf("- Closing the socket...\n");
@@ -75,12 +89,17 @@ void cleanup(void) {
     for (int i = 0; i < player_count; i++) {
       if (players_fd[i] != -1) {
         printf("Closing player %d fd...\n", i);
+        // a pooled handler may still hold the socket
+        shutdown(players_fd[i], SHUT_RDWR);
         sclose(players_fd[i]);
       }
     }
     free(players_fd);
   }
 
+  printf("- Stopping the pre-forked workers...\n");
+  worker_pool_free(&pool);
+
   printf("- Freeing the client handlers pid list...\n");
   if (client_handlers != NULL) {
     free(client_handlers);
@@ -108,57 +127,305 @@ void sigalrm_handler(int signum) {
   cleanup();
 }
 
+void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [-e fork|rooms|epoll|sharded] [-n max_rooms] "
+          "[-t workers] [-S seconds] [-s policy] [-Q messages] "
+          "[-T ms] [-p pipe|ring|actor] [-P sets] [-b backlog] "
+          "[-A acceptors] [-L] [-M port|path] <port> <map> [<map>...]\n",
+          prog);
+  fprintf(stderr, "  -e  server engine: 'fork' plays one match at a time "
+                  "(default),\n");
+  fprintf(stderr, "      'rooms' keeps accepting players while earlier "
+                  "matches run,\n");
+  fprintf(stderr, "      'epoll' serves every match from a single event "
+                  "loop,\n");
+  fprintf(stderr, "      'sharded' runs one event loop per worker thread\n");
+  fprintf(stderr, "  -n  maximum number of concurrent rooms (0 = no limit, "
+                  "default)\n");
+  fprintf(stderr, "  -t  number of worker threads of the sharded engine "
+                  "(default: online cores)\n");
+  fprintf(stderr, "  -S  print the worker counters every S seconds "
+                  "(sharded engine)\n");
+  fprintf(stderr, "  -s  what to do with a player whose send queue is "
+                  "full:\n");
+  fprintf(stderr, "      'coalesce' keeps only its latest positions "
+                  "(default),\n");
+  fprintf(stderr, "      'drop' drops its oldest movement, 'disconnect' "
+                  "disconnects it\n");
+  fprintf(stderr, "  -Q  capacity of each send queue in messages "
+                  "(default: %d)\n",
+          SEND_QUEUE_DEFAULT_CAPACITY);
+  fprintf(stderr, "  -T  tick length: the moves of a tick are sent at its "
+                  "end, only the\n");
+  fprintf(stderr, "      last position of each player (default: 0, sent "
+                  "right away)\n");
+  fprintf(stderr, "  -p  how the client handlers pass their messages to "
+                  "the broadcaster\n");
+  fprintf(stderr, "      (fork and rooms engines): 'ring' through a ring "
+                  "in shared memory\n");
+  fprintf(stderr, "      (default), 'pipe' through the pipe, 'actor' "
+                  "makes the broadcaster\n");
+  fprintf(stderr, "      the only process applying the commands, the "
+                  "handlers pass them\n");
+  fprintf(stderr, "      through the ring\n");
+  fprintf(stderr, "  -P  number of sets of client handlers and broadcaster "
+                  "forked once at\n");
+  fprintf(stderr, "      startup and reused by the matches (fork and rooms "
+                  "engines, default: 0,\n");
+  fprintf(stderr, "      fork and exec them for every match)\n");
+  fprintf(stderr, "  -b  listen backlog (default: %d)\n",
+          MATCHMAKER_DEFAULT_BACKLOG);
+  fprintf(stderr, "  -A  number of acceptor threads queueing the players for "
+                  "a match, each\n");
+  fprintf(stderr, "      with its own SO_REUSEPORT socket (fork and rooms "
+                  "engines, default: 1)\n");
+  fprintf(stderr, "  -L  trace the latency of the key presses through the "
+                  "handler, the pipe\n");
+  fprintf(stderr, "      or ring and the broadcaster (fork and rooms "
+                  "engines): every broadcaster\n");
+  fprintf(stderr, "      prints the histograms of its match at its end and "
+                  "on SIGUSR1\n");
+  fprintf(stderr, "  -M  serve the counters of the server in the Prometheus "
+                  "text format on a\n");
+  fprintf(stderr, "      port of the loopback, or on a Unix socket if the "
+                  "argument is a path\n");
+  fprintf(stderr, "A player may ask for a map by its number (pas_client "
+                  "-map), it is then\n");
+  fprintf(stderr, "only matched with players asking for the same map or "
+                  "for any map.\n");
+  fprintf(stderr, "When several maps are given, the matches use them in "
+                  "turn.\n");
+  fprintf(stderr, "Maps are text maps or binary maps built by pas_mapc.\n");
+}
+
 int main(int argc, char *argv[]) {
-  if (argv == NULL || argc != 3) {
-    fprintf(stderr, "Usage: %s <port> <map>\n", argv[0]);
+  if (argv == NULL) {
     return EXIT_FAILURE;
   }
-  int port = atoi(argv[1]);
-  if (port <= 0) {
-    fprintf(stderr, "Invalid port number: %s\n", argv[1]);
+  char *engine = "fork";
+  int max_rooms = 0;
+  int nb_workers = sharded_engine_default_workers();
+  int stats_period = 0;
+  int tick_ms = 0;
+  int pool_size = 0;
+  int backlog = MATCHMAKER_DEFAULT_BACKLOG;
+  int nb_acceptors = 1;
+  const char *metrics_address = NULL;
+  struct SendQueueConfig sendq = {.policy = SLOW_CLIENT_COALESCE,
+                                  .capacity = SEND_QUEUE_DEFAULT_CAPACITY};
+  int opt;
+  while ((opt = getopt(argc, argv, "e:n:t:S:s:Q:T:p:P:b:A:LM:")) != -1) {
+    switch (opt) {
+    case 'e':
+      engine = optarg;
+      break;
+    case 'n':
+      max_rooms = atoi(optarg);
+      break;
+    case 't':
+      nb_workers = atoi(optarg);
+      break;
+    case 'S':
+      stats_period = atoi(optarg);
+      break;
+    case 's':
+      if (!send_queue_parse_policy(optarg, &sendq.policy)) {
+        fprintf(stderr, "Unknown slow client policy: %s\n", optarg);
+        usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'Q':
+      sendq.capacity = strtoul(optarg, NULL, 10);
+      if (sendq.capacity == 0) {
+        fprintf(stderr, "Invalid send queue capacity: %s\n", optarg);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'T':
+      tick_ms = atoi(optarg);
+      if (tick_ms < 0) {
+        fprintf(stderr, "Invalid tick length: %s\n", optarg);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'p':
+      if (!room_parse_transport(optarg, &transport)) {
+        fprintf(stderr, "Unknown transport: %s\n", optarg);
+        usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'P':
+      pool_size = atoi(optarg);
+      if (pool_size < 0) {
+        fprintf(stderr, "Invalid number of worker sets: %s\n", optarg);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'b':
+      backlog = atoi(optarg);
+      if (backlog <= 0) {
+        fprintf(stderr, "Invalid listen backlog: %s\n", optarg);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'A':
+      nb_acceptors = atoi(optarg);
+      if (nb_acceptors <= 0 || nb_acceptors > MATCHMAKER_MAX_ACCEPTORS) {
+        fprintf(stderr, "Invalid number of acceptors: %s (1 to %d)\n",
+                optarg, MATCHMAKER_MAX_ACCEPTORS);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'L':
+      trace_latency = true;
+      break;
+    case 'M':
+      metrics_address = optarg;
+      break;
+    default:
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  if (argc - optind < 2) {
+    usage(argv[0]);
     return EXIT_FAILURE;
   }
-
-  char *mapPath = argv[2];
-  if (mapPath == NULL) {
-    fprintf(stderr, "Invalid map path: %s\n", argv[2]);
+  if (strcmp(engine, "fork") != 0 && strcmp(engine, "rooms") != 0 &&
+      strcmp(engine, "epoll") != 0 && strcmp(engine, "sharded") != 0) {
+    fprintf(stderr, "Unknown engine: %s\n", engine);
+    usage(argv[0]);
     return EXIT_FAILURE;
   }
-
-  /**
-   * Create/init shm and sem
-   * */
-  struct GameState *state = NULL;
-  if (init_ipc(&state, &sem_id, &shm_id) != 0) {
-    fprintf(stderr, "Failed to initialize IPC\n");
+  if (nb_workers <= 0) {
+    fprintf(stderr, "Invalid number of workers: %d\n", nb_workers);
     return EXIT_FAILURE;
   }
 
-  FileDescriptor sout = 1;
-  // Create the pipe used by the broadcaster
-  int pipefd[2];
-  int ret = spipe(pipefd);
-  if (ret < 0) {
-    perror("Failed to create pipe");
+  int port = atoi(argv[optind]);
+  if (port <= 0) {
+    fprintf(stderr, "Invalid port number: %s\n", argv[optind]);
     return EXIT_FAILURE;
   }
 
-  map = sopen(mapPath, O_RDONLY, 0);
+  // The counters are created before anything is forked: every process of
+  // the server inherits them.
+  if (metrics_address != NULL) {
+    metrics_create();
+  }
+
+  // The segments of this instance are named after its pid.
+  int reclaimed = shm_arena_init();
+  if (reclaimed > 0) {
+    printf("Reclaimed %d shared memory segment(s) left by a previous "
+           "server\n",
+           reclaimed);
+  }
+
+  char *mapPath = argv[optind + 1];
+  // Every map is compiled once at startup, the matches only replay them.
+  int nb_maps = argc - optind - 1;
+  const struct CompiledMap **maps =
+      smalloc(nb_maps * sizeof(struct CompiledMap *));
+  for (int i = 0; i < nb_maps; i++) {
+    maps[i] = map_cache_get(argv[optind + 1 + i]);
+    if (maps[i] == NULL) {
+      fprintf(stderr, "Invalid map path: %s\n", argv[optind + 1 + i]);
+      return EXIT_FAILURE;
+    }
+    size_t v1_len;
+    size_t v2_len;
+    size_t v3_len;
+    map_cache_spawn(maps[i], WIRE_V1, &v1_len);
+    map_cache_spawn(maps[i], WIRE_V2, &v2_len);
+    map_cache_spawn(maps[i], WIRE_V3, &v3_len);
+    printf("Map %s: spawn stream of %zu bytes (v2: %zu, v3 snapshot: %zu)\n",
+           maps[i]->path, v1_len, v2_len, v3_len);
+  }
 
-  sockfd = ssocket();
-  int opt = 1;
-  if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
-    perror("setsockopt");
-    close(sockfd);
-    exit(EXIT_FAILURE);
+  // The launcher of the rooms is forked while the server still has a single
+  // thread (see room.h): before the metrics thread and the acceptors.
+  struct RoomsLauncher launcher;
+  if (strcmp(engine, "rooms") == 0) {
+    rooms_launcher_start(&launcher, maps, &sendq, tick_ms, transport,
+                         trace_latency, pool_size);
   }
-  if (sbind(port, sockfd) != 0) {
-    perror("Failed to bind socket");
+  if (metrics_address != NULL) {
+    if (!metrics_serve(metrics_address)) {
+      return EXIT_FAILURE;
+    }
+    printf("Serving the metrics on %s\n", metrics_address);
+  }
+
+  if (strcmp(engine, "rooms") == 0) {
+    matchmaker_start(&mm, port, backlog, nb_acceptors, nb_maps);
+    printf("Server listening on port %d with the rooms engine (%d "
+           "acceptor(s))\n",
+           port, nb_acceptors);
+    printf("With %d map(s), starting with %s\n", nb_maps, mapPath);
+    int ret = rooms_run(&mm, &launcher, maps, nb_maps, max_rooms);
+    matchmaker_stop(&mm);
+    matchmaker_print_stats(&mm, stdout);
+    free(maps);
+    map_cache_clear();
+    return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+  if (strcmp(engine, "fork") != 0) {
+    sockfd = ssocket();
+    int reuse = 1;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) <
+        0) {
+      perror("setsockopt");
+      exit(EXIT_FAILURE);
+    }
+    sbind(port, sockfd);
+    slisten(sockfd, backlog);
+    printf("Server listening on port %d with the %s engine\n", port, engine);
+    printf("With %d map(s), starting with %s\n", nb_maps, mapPath);
+    int ret;
+    if (strcmp(engine, "epoll") == 0) {
+      ret = epoll_engine_run(sockfd, maps, nb_maps, &sendq, tick_ms);
+    } else {
+      ret = sharded_engine_run(sockfd, maps, nb_maps, nb_workers,
+                               stats_period, &sendq, tick_ms);
+    }
+    sclose(sockfd);
+    free(maps);
+    map_cache_clear();
+    return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  /**
+   * Create/init shm
+   * */
+  // The segment is reused by every match: it must fit the largest map.
+  size_t state_size = 0;
+  for (int i = 0; i < nb_maps; i++) {
+    if (map_cache_state_size(maps[i]) > state_size) {
+      state_size = map_cache_state_size(maps[i]);
+    }
+  }
+  struct RoomSegment *segment = NULL;
+  if (init_ipc(&segment,
+               room_segment_size(state_size, transport != TRANSPORT_PIPE)) !=
+      0) {
+    fprintf(stderr, "Failed to initialize IPC\n");
     return EXIT_FAILURE;
   }
+  struct GameState *state = room_segment_state(segment);
 
-  // The BACKLOG is the maximum number of pending connections
-  slisten(sockfd, NB_PLAYERS);
+  FileDescriptor sout = 1;
+  // pipe used by the broadcaster, one per match
+  int pipefd[2];
+  // The sets of workers are forked before the matchmaker threads start.
+  worker_pool_init(&pool, pool_size > 0 ? 1 : 0);
+
+  // The players are accepted and queued even while a match is played: they
+  // wait in the matchmaker until the current match is over.
+  matchmaker_start(&mm, port, backlog, nb_acceptors, nb_maps);
 
   // Set the signal handler for SIGINT
   signal(SIGINT, sigint_handler);
@@ -175,15 +442,32 @@ int main(int argc, char *argv[]) {
   client_handlers = smalloc(NB_PLAYERS * sizeof(pid_t));
   players_fd = smalloc(NB_PLAYERS * sizeof(FileDescriptor));
 
+  int match_count = 0;
   while (1) {
     // This is the beginning of the game, so we wait the players,
     // We set an alarm to 30 seconds to stop the game if no players are
     // connected
     alarm(TIMEOUT);
     player_count = 0;
+    // A pipe per match: the broadcaster sees its end once the handlers of
+    // the match are done.
+    spipe(pipefd);
+    // a broken set (one of its workers died) is not handed out again
+    workers = worker_pool_acquire(&pool);
+    // the previous match is over: its ring can be reset
+    if (transport != TRANSPORT_PIPE) {
+      room_ring_create(&match_ring, &shm, state_size, transport);
+      ring = &match_ring;
+    }
 
-    int handle_players_value =
-        handle_new_players(&sockfd, state, &map, players_fd, client_handlers);
+    struct Match match;
+    matchmaker_next(&mm, &match, -1);
+    const struct CompiledMap *map =
+        maps[match.map != -1 ? match.map : match_count % nb_maps];
+    match_count++;
+    matchmaker_print_stats(&mm, stdout);
+    int handle_players_value = handle_new_players(
+        &match, state, map, players_fd, client_handlers, pipefd);
     if (handle_players_value != 0) {
       if (handle_players_value == EXIT_FAILURE) {
         printf("Failed to handle new players\n");
@@ -193,28 +477,52 @@ int main(int argc, char *argv[]) {
 
     // Disable the alarm
     alarm(0);
+    metrics_add(METRIC_MATCHES_STARTED, 1);
 
     // send registration to players
     for (int i = 0; i < NB_PLAYERS; i++) {
-      send_registered(i + 1, players_fd[i]);
+      union Message msg = {
+          .registration = {.msgt = REGISTRATION, .player = i + 1}};
+      metrics_sent(REGISTRATION, 1,
+                   wire_send(players_fd[i], wire_versions[i], &msg, 1));
     }
     // End of the loop, all players are connected
 
-    int broadcastId = sfork();
-    if (broadcastId == 0) {
-      // Redirect stdout to the broadcaster
-      sdup2(pipefd[0], WRITE_PIPE_TO_BROADCAST_FD);
-      sclose(pipefd[0]);
+    int broadcastId = -1;
+    if (workers != NULL) {
+      worker_start_broadcaster(workers, pipefd[0], players_fd, wire_versions,
+                               &sendq, tick_ms, ring);
+    } else {
+      FileDescriptor close_fds[] = {pipefd[1], -1};
+      broadcastId = room_spawn_broadcaster(pipefd[0], players_fd,
+                                           wire_versions, &sendq, tick_ms,
+                                           ring, close_fds);
+    }
+    sclose(pipefd[0]);
+    sclose(pipefd[1]);
+    if (ring != NULL) {
+      sclose(match_ring.doorbell);
+    }
+
+    if (workers != NULL) {
+      worker_set_finish_match(workers, players_fd, segment);
+      worker_pool_release(workers);
+      workers = NULL;
       for (int i = 0; i < NB_PLAYERS; i++) {
-        sdup2(players_fd[i], PLAYERS_RANGE_FD + i);
         sclose(players_fd[i]);
+        players_fd[i] = -1;
       }
-
-      int exec = sexecl(BROADCASTER_PATH, BROADCASTER_PATH, (char *)NULL);
-      if (exec == -1) {
-        perror("Failed to exec broadcaster");
-        exit(EXIT_FAILURE);
+      metrics_add(METRIC_PLAYERS_DISCONNECTED, NB_PLAYERS);
+      metrics_add(METRIC_MATCHES_FINISHED, 1);
+      printf("Restarting the game loop...\n");
+      room_segment_lock(segment);
+      reset_gamestate(state);
+      room_segment_unlock(segment);
+      if (sigint_received) {
+        printf("SIGINT received, stopping the game...\n");
+        cleanup();
       }
+      continue;
     }
 
     int wstatus;
@@ -225,7 +533,9 @@ int main(int argc, char *argv[]) {
     pid_t waitId;
     do {
       waitId = swaitpid(-1, &wstatus, 0);
-    } while (waitId == -1 && errno == EINTR);
+      // a worker of a broken set is not part of the match
+    } while ((waitId == -1 && errno == EINTR) ||
+             (waitId > 0 && worker_pool_reaped(&pool, waitId, wstatus)));
     if (waitId == -1) {
       perror("Failed to wait for child process");
       exit(EXIT_FAILURE);
@@ -240,6 +550,9 @@ int main(int argc, char *argv[]) {
       for (int i = 0; i < NB_PLAYERS; i++) {
         if (client_handlers[i] == waitId) {
           client_handlers[i] = -1;
+          if (!WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != EXIT_SUCCESS) {
+            metrics_add(METRIC_HANDLERS_FAILED, 1);
+          }
           if (DEBUG) {
             printf("The client handler process %d of player %d finished with "
                    "status %d\n",
@@ -280,10 +593,12 @@ int main(int argc, char *argv[]) {
              wait_broadcaster, wstatus);
       broadcastId = -1;
     }
+    metrics_add(METRIC_PLAYERS_DISCONNECTED, NB_PLAYERS);
+    metrics_add(METRIC_MATCHES_FINISHED, 1);
     //  Reset the game state
-    sem_down0(sem_id);
+    room_segment_lock(segment);
     reset_gamestate(state);
-    sem_up0(sem_id);
+    room_segment_unlock(segment);
 
     // Check if the CTRL-C has been called before
     if (sigint_received) {
@@ -291,8 +606,6 @@ int main(int argc, char *argv[]) {
       cleanup();
     }
   }
-  sclose(map);
-  sclose(sockfd);
   perror("The while loop has been breaked\n");
   cleanup();
   // Should never reach here
@@ -301,67 +614,45 @@ int main(int argc, char *argv[]) {
 
 int child_handler(void) { return 0; }
 
-int init_ipc(struct GameState **state, int *sem_id, int *shm_id) {
-  // Create the shared memory segment
-  *sem_id = sem_create(SEM_KEY, 1, PERM, 1);
-  if (*sem_id < 0) {
-    perror("Failed to create semaphore");
-    return EXIT_FAILURE;
-  }
-
-  *shm_id = sshmget(SHM_KEY, sizeof(struct GameState), IPC_CREAT | PERM);
-  if (*shm_id < 0) {
-    perror("Failed to get shared memory");
-    return EXIT_FAILURE;
-  }
-  *state = sshmat(*shm_id);
+int init_ipc(struct RoomSegment **segment, size_t segment_size) {
+  // Create the shared memory segment and its lock
+  shm_arena_create(&shm, 0, segment_size);
+  *segment = shm.base;
+  room_segment_init(*segment, trace_latency);
   return 0;
 }
 
-int handle_new_players(FileDescriptor *sockfd, struct GameState *state,
-                       FileDescriptor *map, FileDescriptor *players_fd,
-                       pid_t *client_handlers_pid) {
+int handle_new_players(const struct Match *match, struct GameState *state,
+                       const struct CompiledMap *map,
+                       FileDescriptor *players_fd, pid_t *client_handlers_pid,
+                       int pipefd[2]) {
   for (int i = 0; i < NB_PLAYERS; i++) {
-    printf("Waiting for player %d...\n", i + 1);
-    FileDescriptor player = saccept(*sockfd);
-    int msg_type;
-    if (sread(player, &msg_type, sizeof(int)) <= 0 &&
-        msg_type != REGISTRATION) {
-      fprintf(stderr, "Failed to register the player %d\n", i + 1);
-      i -= 1;
-      sclose(player);
-      continue;
-    }
+    FileDescriptor player = match->players_fd[i];
+    wire_versions[i] = match->wire_versions[i];
     players_fd[i] = player;
     player_count++;
     printf("Player %d connected\n", i + 1);
-    load_map(*map, player, state);
-    // We need to set the cursor to the beginning of the file after reading
-    // the map Lseek (unistd.h) set the cursor to the offset byte (0 in this
-    // case) check 'man lseek'
-    int lseek_value = lseek(*map, 0, SEEK_SET);
-    if (lseek_value < 0) {
-      perror("Failed to lseek");
-      return EXIT_FAILURE;
+    // The map has been compiled at startup: resetting the state is a
+    // memcpy and the whole spawn stream is sent in a single write.
+    map_cache_reset_state(map, state);
+    map_cache_send(map, player, wire_versions[i]);
+
+    if (workers != NULL) {
+      worker_start_handler(workers, i + 1, player, pipefd[1], shm.name, ring);
+      client_handlers_pid[i] = -1;
+      client_handler_count++;
+      continue;
     }
-
-    // create a client_handler for the player in this loop
-    client_handlers_pid[i] = sfork();
-    if (client_handlers_pid[i] == 0) {
-      sdup2(player, PLAYER_SOCKET_FD);
-      sclose(player);
-      sclose(*sockfd);
-
-      // exec the client client_handler and replace this child process by it
-      char player_no[12];
-      sprintf(player_no, "%d", i + 1);
-      int exec = sexecl(CLIENT_HANDLER_PATH, CLIENT_HANDLER_PATH, player_no,
-                        (char *)NULL);
-      if (exec == -1) {
-        perror("Failed to exec client_handler");
-        return EXIT_FAILURE;
-      }
+    // create a client_handler for the player in this loop (the matchmaker
+    // sockets are close-on-exec)
+    FileDescriptor close_fds[NB_PLAYERS + 2] = {pipefd[0]};
+    int n = 1;
+    for (int j = 0; j < i; j++) {
+      close_fds[n++] = players_fd[j];
     }
+    close_fds[n] = -1;
+    client_handlers_pid[i] = room_spawn_client_handler(
+        i + 1, player, pipefd[1], shm.name, ring, close_fds);
     client_handler_count++;
   }
   return 0;
@@ -0,0 +1,580 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "game.h"
+#include "histogram.h"
+#include "map_format.h"
+#include "script.h"
+#include "utils_v3.h"
+
+/**
+ * Plays matches of pas-cman without any server, client or socket: the game
+ * logic of game.c is called directly on a GameState in memory and its
+ * messages go to a MessageBuffer, which only counts them. The threads (one
+ * per core by default) share the games to play, each keeping its own
+ * counters, summed at the end.
+ *
+ * Each player follows a policy:
+ *   random  a random walk,
+ *   hungry  eats a neighbouring SUPERFOOD or FOOD if there is one, walks at
+ *           random among the other open directions otherwise,
+ *   script  replays the moves of a test*\/joueur*.txt file (player 1 the
+ *           first one, player 2 the second one), a player passes once its
+ *           script is over and the game is left unfinished when both are.
+ * Game n draws its moves from seeds derived from n and the -S seed: the
+ * results do not depend on the number of threads.
+ *
+ * For every map: the winners, why the games ended, the scores, the length of
+ * the matches (in key presses), the food left over the moves and the games
+ * played per second.
+ *
+ * usage: see __usage()
+ */
+
+#define DEFAULT_GAMES 100000
+#define DEFAULT_MAX_MOVES 20000
+#define DEFAULT_CURVE_STEP 100
+#define DEFAULT_SEED 1
+#define MAX_THREADS 256
+// Games claimed at once by a thread.
+#define GAMES_CHUNK 64
+// Points of the food consumption curve, the last one counts every later
+// move.
+#define CURVE_POINTS 32
+
+enum PolicyKind { POLICY_RANDOM, POLICY_HUNGRY, POLICY_SCRIPT };
+
+struct Player {
+  enum Item item;
+  enum PolicyKind policy;
+  uint32_t rng;
+  // next move of the script
+  size_t cursor;
+};
+
+// Counters of a thread.
+struct SimStats {
+  uint64_t games;
+  uint64_t moves;
+  uint64_t wins[NB_PLAYERS];
+  // won by player 2 with the same score as player 1
+  uint64_t ties;
+  // the players ran into each other
+  uint64_t collisions;
+  // every food was eaten
+  uint64_t cleared;
+  // stopped after the longest match allowed or the end of a script
+  uint64_t unfinished;
+  uint64_t scores[NB_PLAYERS];
+  // messages of the game, per type
+  uint64_t messages[GAME_OVER + 1];
+  // food eaten during each step of the curve, and games still running at
+  // its start
+  uint64_t eaten[CURVE_POINTS];
+  uint64_t running[CURVE_POINTS];
+  struct Histogram length;
+};
+
+struct Simulator {
+  pthread_t thread;
+  const struct GameState *initial;
+  atomic_uint_fast64_t *next_game;
+  uint64_t nb_games;
+  struct SimStats stats;
+};
+
+static const char *__policy_names[] = {
+    [POLICY_RANDOM] = "random",
+    [POLICY_HUNGRY] = "hungry",
+    [POLICY_SCRIPT] = "script",
+};
+
+static enum PolicyKind policies[NB_PLAYERS] = {POLICY_RANDOM, POLICY_RANDOM};
+static struct Script scripts[NB_PLAYERS];
+static int nb_scripts = 0;
+static uint64_t max_moves = DEFAULT_MAX_MOVES;
+static uint64_t curve_step = DEFAULT_CURVE_STEP;
+static uint32_t seed = DEFAULT_SEED;
+
+static double __now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void __usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [-g games] [-t threads] [-p policy[,policy]] "
+          "[-s script [-s script]] [-m moves] [-c step] [-S seed] <map> "
+          "[<map>...]\n",
+          prog);
+  fprintf(stderr, "  -g  games played on each map (default: %d)\n",
+          DEFAULT_GAMES);
+  fprintf(stderr, "  -t  number of threads (default: online cores)\n");
+  fprintf(stderr, "  -p  policy of player 1, then of player 2: 'random' "
+                  "(default), 'hungry'\n");
+  fprintf(stderr, "      or 'script'; a single policy is used by both "
+                  "players\n");
+  fprintf(stderr, "  -s  moves of player 1, then of player 2 (a "
+                  "test*/joueur*.txt file);\n");
+  fprintf(stderr, "      the players then follow their script unless -p "
+                  "says otherwise\n");
+  fprintf(stderr, "  -m  key presses after which a match is left "
+                  "unfinished (default: %d)\n",
+          DEFAULT_MAX_MOVES);
+  fprintf(stderr, "  -c  key presses between two points of the food curve "
+                  "(default: %d)\n",
+          DEFAULT_CURVE_STEP);
+  fprintf(stderr, "  -S  seed of the random policies (default: %d)\n",
+          DEFAULT_SEED);
+  fprintf(stderr, "Maps are text maps or binary maps built by pas_mapc.\n");
+}
+
+// RES: false if 'arg' is not a list of one or two policies.
+static bool __parse_policies(char *arg) {
+  char *second = strchr(arg, ',');
+  if (second != NULL) {
+    *second++ = '\0';
+  }
+  const char *names[NB_PLAYERS] = {arg, second != NULL ? second : arg};
+  for (int p = 0; p < NB_PLAYERS; p++) {
+    bool known = false;
+    for (size_t k = 0; k < sizeof(__policy_names) / sizeof(*__policy_names);
+         k++) {
+      if (strcmp(names[p], __policy_names[k]) == 0) {
+        policies[p] = (enum PolicyKind)k;
+        known = true;
+      }
+    }
+    if (!known) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// RES: the initial state of the map made of 'tiles', NULL if it is not
+//      playable (the problems are printed, see map_format_validate).
+static struct GameState *__load_tiles(const uint8_t *tiles, uint32_t width,
+                                      uint32_t height, const char *path) {
+  // a map without its two spawns, or a 0x0 one, cannot be simulated
+  if (map_format_validate(tiles, width, height, path) != 0) {
+    return NULL;
+  }
+  struct MessageBuffer spawn;
+  // sized by the loader once the dimensions are known
+  message_buffer_init(&spawn, 1);
+  struct GameState *initial = load_tiles_buf(tiles, width, height, &spawn);
+  message_buffer_free(&spawn);
+  return initial;
+}
+
+// RES: the initial state of the map at 'path', NULL if it cannot be read or
+//      is not playable.
+static struct GameState *__load(const char *path) {
+  // Binary maps (see pas_mapc) are mapped as is, text maps are parsed.
+  size_t image_len = 0;
+  const struct MapHeader *image = map_format_map(path, &image_len);
+  if (image != NULL) {
+    struct GameState *initial = __load_tiles(
+        map_format_tiles(image), image->width, image->height, path);
+    map_format_unmap(image, image_len);
+    return initial;
+  }
+  FileDescriptor fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    perror(path);
+    return NULL;
+  }
+  struct stat st;
+  checkNeg(fstat(fd, &st), "Error fstat");
+  char *text = smalloc(st.st_size + 1);
+  size_t len = 0;
+  ssize_t n;
+  while ((n = sread(fd, text + len, st.st_size - len)) > 0) {
+    len += n;
+  }
+  sclose(fd);
+  uint32_t width;
+  uint32_t height;
+  size_t ignored;
+  uint8_t *tiles = map_text_to_tiles(text, len, &width, &height, &ignored);
+  free(text);
+  struct GameState *initial = __load_tiles(tiles, width, height, path);
+  free(tiles);
+  return initial;
+}
+
+// splitmix64: independent xorshift seeds for every game and player.
+static uint32_t __player_seed(uint64_t game, int player) {
+  uint64_t z = seed + (2 * game + player + 1) * 0x9e3779b97f4a7c15ull;
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  z ^= z >> 31;
+  // xorshift never leaves 0
+  return (uint32_t)z | 1;
+}
+
+static uint32_t __next_random(struct Player *p) {
+  p->rng ^= p->rng << 13;
+  p->rng ^= p->rng >> 17;
+  p->rng ^= p->rng << 5;
+  return p->rng;
+}
+
+// RES: the tile next to 'pos' in direction 'dir', WALL off the map.
+static enum Item __neighbour(const struct GameState *state,
+                             struct Position pos, enum Direction dir) {
+  switch (dir) {
+  case UP:
+    if (pos.y == 0) {
+      return WALL;
+    }
+    pos.y--;
+    break;
+  case DOWN:
+    if (pos.y + 1 >= state->height) {
+      return WALL;
+    }
+    pos.y++;
+    break;
+  case LEFT:
+    if (pos.x == 0) {
+      return WALL;
+    }
+    pos.x--;
+    break;
+  case RIGHT:
+    if (pos.x + 1 >= state->width) {
+      return WALL;
+    }
+    pos.x++;
+    break;
+  }
+  return gamestate_tile(state, (size_t)pos.y * state->width + pos.x);
+}
+
+static enum Direction __hungry(struct Player *p,
+                               const struct GameState *state) {
+  struct Position pos = state->positions[p->item == PLAYER1 ? 0 : 1];
+  enum Direction open[4];
+  int nb_open = 0;
+  int food = -1;
+  for (int d = 0; d < 4; d++) {
+    enum Item item = __neighbour(state, pos, (enum Direction)d);
+    if (item == SUPERFOOD || (item == FOOD && food == -1)) {
+      food = d;
+    }
+    if (item != WALL) {
+      open[nb_open++] = (enum Direction)d;
+    }
+  }
+  if (food != -1) {
+    return (enum Direction)food;
+  }
+  if (nb_open == 0) {
+    return (enum Direction)(__next_random(p) % 4);
+  }
+  return open[__next_random(p) % nb_open];
+}
+
+// RES: the next move of 'p', -1 if its script is over.
+static int __next_move(struct Player *p, const struct GameState *state) {
+  switch (p->policy) {
+  case POLICY_RANDOM:
+    return (int)(__next_random(p) % 4);
+  case POLICY_HUNGRY:
+    return (int)__hungry(p, state);
+  case POLICY_SCRIPT: {
+    const struct Script *script = &scripts[(p->item == PLAYER1 ? 0 : 1) %
+                                           nb_scripts];
+    return script_next(script, &p->cursor);
+  }
+  }
+  return -1;
+}
+
+static int __curve_point(uint64_t move) {
+  uint64_t point = move / curve_step;
+  return point < CURVE_POINTS ? (int)point : CURVE_POINTS - 1;
+}
+
+static void __play(struct SimStats *stats, const struct GameState *initial,
+                   struct GameState *state, struct MessageBuffer *out,
+                   uint64_t game) {
+  gamestate_copy(state, initial);
+  struct Player players[NB_PLAYERS];
+  for (int p = 0; p < NB_PLAYERS; p++) {
+    players[p] = (struct Player){.item = p == 0 ? PLAYER1 : PLAYER2,
+                                 .policy = policies[p],
+                                 .rng = __player_seed(game, p)};
+  }
+
+  bool over = false;
+  uint64_t move = 0;
+  int last_point = -1;
+  // players whose script is over pass their turn
+  int passes = 0;
+  for (uint64_t turn = 0; !over && move < max_moves && passes < NB_PLAYERS;
+       turn++) {
+    struct Player *player = &players[turn % NB_PLAYERS];
+    int dir = __next_move(player, state);
+    if (dir == -1) {
+      passes++;
+      continue;
+    }
+    passes = 0;
+    int point = __curve_point(move);
+    if (point != last_point) {
+      stats->running[point]++;
+      last_point = point;
+    }
+    over = process_user_command_buf(state, player->item, (enum Direction)dir,
+                                    out);
+    for (size_t i = 0; i < out->count; i++) {
+      enum MessageType msgt = out->msgs[i].msgt;
+      stats->messages[msgt]++;
+      if (msgt == EAT_FOOD) {
+        stats->eaten[point]++;
+      } else if (msgt == GAME_OVER) {
+        stats->wins[out->msgs[i].game_over.winner - 1]++;
+      }
+    }
+    message_buffer_clear(out);
+    move++;
+  }
+
+  stats->games++;
+  stats->moves += move;
+  histogram_record(&stats->length, move);
+  for (int p = 0; p < NB_PLAYERS; p++) {
+    stats->scores[p] += state->scores[p];
+  }
+  if (!over) {
+    stats->unfinished++;
+  } else if (state->food_count == 0) {
+    stats->cleared++;
+  } else {
+    stats->collisions++;
+  }
+  if (over && state->scores[0] == state->scores[1]) {
+    stats->ties++;
+  }
+}
+
+static void *__simulator_main(void *arg) {
+  struct Simulator *sim = arg;
+  struct GameState *state =
+      gamestate_create(sim->initial->width, sim->initial->height);
+  // only counted: a move never produces more than a handful of messages
+  struct MessageBuffer out;
+  message_buffer_init(&out, 8);
+  while (true) {
+    uint64_t first = atomic_fetch_add(sim->next_game, GAMES_CHUNK);
+    if (first >= sim->nb_games) {
+      break;
+    }
+    uint64_t end = first + GAMES_CHUNK < sim->nb_games ? first + GAMES_CHUNK
+                                                       : sim->nb_games;
+    for (uint64_t game = first; game < end; game++) {
+      __play(&sim->stats, sim->initial, state, &out, game);
+    }
+  }
+  message_buffer_free(&out);
+  free(state);
+  return NULL;
+}
+
+static void __merge(struct SimStats *into, const struct SimStats *from) {
+  into->games += from->games;
+  into->moves += from->moves;
+  into->ties += from->ties;
+  into->collisions += from->collisions;
+  into->cleared += from->cleared;
+  into->unfinished += from->unfinished;
+  for (int p = 0; p < NB_PLAYERS; p++) {
+    into->wins[p] += from->wins[p];
+    into->scores[p] += from->scores[p];
+  }
+  for (int t = 0; t <= GAME_OVER; t++) {
+    into->messages[t] += from->messages[t];
+  }
+  for (int c = 0; c < CURVE_POINTS; c++) {
+    into->eaten[c] += from->eaten[c];
+    into->running[c] += from->running[c];
+  }
+  histogram_merge(&into->length, &from->length);
+}
+
+static double __percent(uint64_t part, uint64_t whole) {
+  return whole > 0 ? 100.0 * part / whole : 0;
+}
+
+static void __report(const char *path, const struct GameState *initial,
+                     const struct SimStats *total, double seconds) {
+  uint64_t games = total->games;
+  printf("%s: %ux%u, %d food, %llu game(s) in %.2f s (%.0f games/s, %.0f "
+         "moves/s)\n",
+         path, initial->width, initial->height, initial->food_count,
+         (unsigned long long)games, seconds, games / seconds,
+         total->moves / seconds);
+  printf("  winners: player 1 %.2f%%, player 2 %.2f%% (%.2f%% on a tie), "
+         "unfinished %.2f%%\n",
+         __percent(total->wins[0], games), __percent(total->wins[1], games),
+         __percent(total->ties, games), __percent(total->unfinished, games));
+  printf("  ended by: collision %.2f%%, all food eaten %.2f%%\n",
+         __percent(total->collisions, games),
+         __percent(total->cleared, games));
+  printf("  mean score: player 1 %.2f, player 2 %.2f\n",
+         games > 0 ? (double)total->scores[0] / games : 0,
+         games > 0 ? (double)total->scores[1] / games : 0);
+  printf("  mean length: %.1f key presses\n",
+         games > 0 ? (double)total->moves / games : 0);
+  histogram_print(&total->length, "  length", " moves", stdout);
+  printf("  messages: %llu movement, %llu eat_food, %llu game_over\n",
+         (unsigned long long)total->messages[MOVEMENT],
+         (unsigned long long)total->messages[EAT_FOOD],
+         (unsigned long long)total->messages[GAME_OVER]);
+
+  printf("  food left (mean over every game) and games running:\n");
+  uint64_t eaten = 0;
+  uint64_t food = (uint64_t)initial->food_count * games;
+  for (int c = 0; c < CURVE_POINTS && total->running[c] > 0; c++) {
+    printf("  %8llu%s %6.2f%% %6.2f%%\n",
+           (unsigned long long)(c * curve_step),
+           c == CURVE_POINTS - 1 ? "+" : " ", 100 - __percent(eaten, food),
+           __percent(total->running[c], games));
+    eaten += total->eaten[c];
+  }
+}
+
+int main(int argc, char *argv[]) {
+  if (argv == NULL) {
+    return EXIT_FAILURE;
+  }
+  long nb_games = DEFAULT_GAMES;
+  long nb_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  bool policy_given = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "g:t:p:s:m:c:S:")) != -1) {
+    switch (opt) {
+    case 'g':
+      nb_games = atol(optarg);
+      if (nb_games <= 0) {
+        fprintf(stderr, "Invalid number of games: %s\n", optarg);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 't':
+      nb_threads = atol(optarg);
+      if (nb_threads <= 0 || nb_threads > MAX_THREADS) {
+        fprintf(stderr, "Invalid number of threads: %s (1 to %d)\n", optarg,
+                MAX_THREADS);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'p':
+      if (!__parse_policies(optarg)) {
+        fprintf(stderr, "Unknown policy: %s\n", optarg);
+        __usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+      policy_given = true;
+      break;
+    case 's':
+      if (nb_scripts == NB_PLAYERS) {
+        fprintf(stderr, "At most %d scripts\n", NB_PLAYERS);
+        return EXIT_FAILURE;
+      }
+      script_load(optarg, &scripts[nb_scripts++]);
+      break;
+    case 'm':
+      max_moves = strtoull(optarg, NULL, 10);
+      if (max_moves == 0) {
+        fprintf(stderr, "Invalid number of moves: %s\n", optarg);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'c':
+      curve_step = strtoull(optarg, NULL, 10);
+      if (curve_step == 0) {
+        fprintf(stderr, "Invalid curve step: %s\n", optarg);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'S':
+      seed = (uint32_t)strtoul(optarg, NULL, 10);
+      break;
+    default:
+      __usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  if (optind == argc) {
+    __usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+  if (nb_scripts > 0 && !policy_given) {
+    policies[0] = POLICY_SCRIPT;
+    policies[1] = POLICY_SCRIPT;
+  }
+  if ((policies[0] == POLICY_SCRIPT || policies[1] == POLICY_SCRIPT) &&
+      nb_scripts == 0) {
+    fprintf(stderr, "The script policy needs a script (-s)\n");
+    return EXIT_FAILURE;
+  }
+  if (nb_threads <= 0) {
+    nb_threads = 1;
+  }
+  if (nb_threads > nb_games) {
+    nb_threads = nb_games;
+  }
+  printf("%ld game(s) per map on %ld thread(s), player 1 %s, player 2 %s, at "
+         "most %llu key presses\n",
+         nb_games, nb_threads, __policy_names[policies[0]],
+         __policy_names[policies[1]], (unsigned long long)max_moves);
+
+  int ret = EXIT_SUCCESS;
+  struct Simulator *sims = smalloc(nb_threads * sizeof(struct Simulator));
+  for (int m = optind; m < argc; m++) {
+    struct GameState *initial = __load(argv[m]);
+    if (initial == NULL) {
+      fprintf(stderr, "%s: skipped\n", argv[m]);
+      ret = EXIT_FAILURE;
+      continue;
+    }
+    atomic_uint_fast64_t next_game;
+    atomic_init(&next_game, 0);
+    double start = __now();
+    for (long t = 0; t < nb_threads; t++) {
+      sims[t] = (struct Simulator){.initial = initial,
+                                   .next_game = &next_game,
+                                   .nb_games = nb_games};
+      histogram_reset(&sims[t].stats.length);
+      int rv = pthread_create(&sims[t].thread, NULL, __simulator_main,
+                              &sims[t]);
+      checkCond(rv != 0, "Error pthread_create");
+    }
+    struct SimStats total = {0};
+    histogram_reset(&total.length);
+    for (long t = 0; t < nb_threads; t++) {
+      pthread_join(sims[t].thread, NULL);
+      __merge(&total, &sims[t].stats);
+    }
+    __report(argv[m], initial, &total, __now() - start);
+    free(initial);
+  }
+
+  free(sims);
+  for (int s = 0; s < nb_scripts; s++) {
+    script_free(&scripts[s]);
+  }
+  return ret;
+}
@@ -0,0 +1,597 @@
+// close_range()
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "common_fd.h"
+#include "metrics.h"
+#include "msg_ring.h"
+#include "pm_exec_paths.h"
+#include "room.h"
+#include "utils_v3.h"
+#include "wire.h"
+#include "worker_pool.h"
+
+// How long the listener waits for a match before checking for SIGINT.
+#define ROOMS_POLL_MS 200
+
+// Lowest file descriptor used when a child lifts its descriptors out of the
+// way before moving them to their well-known numbers (see common_fd.h).
+#define FD_LIFT_BASE 32
+
+static volatile sig_atomic_t __active_rooms = 0;
+static volatile sig_atomic_t __stop_requested = 0;
+// pre-forked handlers and broadcasters of the rooms (see worker_pool.h)
+static struct WorkerPool __pool;
+
+// Duplicates 'fd' above every descriptor of common_fd.h so that the dup2()
+// calls done afterwards in the child can never clobber one another.
+static FileDescriptor __lift_fd(FileDescriptor fd) {
+  FileDescriptor lifted = fcntl(fd, F_DUPFD, FD_LIFT_BASE);
+  checkNeg(lifted, "Error fcntl F_DUPFD");
+  return lifted;
+}
+
+// Closes every descriptor of the -1 terminated list. Some of them may have
+// been closed already, so errors are ignored on purpose.
+static void __close_all(const FileDescriptor *fds) {
+  if (fds == NULL) {
+    return;
+  }
+  for (int i = 0; fds[i] != -1; i++) {
+    close(fds[i]);
+  }
+}
+
+pid_t room_spawn_client_handler(int player_no, FileDescriptor player,
+                                FileDescriptor pipe_write,
+                                const char *segment_name,
+                                const struct RoomRing *ring,
+                                const FileDescriptor *close_fds) {
+  pid_t pid = sfork();
+  if (pid != 0) {
+    metrics_add(METRIC_HANDLERS_STARTED, 1);
+    return pid;
+  }
+
+  FileDescriptor socket = __lift_fd(player);
+  FileDescriptor pipe = __lift_fd(pipe_write);
+  FileDescriptor doorbell = ring != NULL ? __lift_fd(ring->doorbell) : -1;
+  __close_all(close_fds);
+  close(player);
+  close(pipe_write);
+  sdup2(socket, PLAYER_SOCKET_FD);
+  sdup2(pipe, WRITE_PIPE_TO_BROADCAST_FD);
+  sclose(socket);
+  sclose(pipe);
+  if (ring != NULL) {
+    sdup2(doorbell, RING_DOORBELL_FD);
+    sclose(doorbell);
+  }
+
+  char player_arg[12];
+  char offset_arg[24];
+  sprintf(player_arg, "%d", player_no);
+  if (ring != NULL) {
+    sprintf(offset_arg, "%zu", ring->offset);
+    sexecl(CLIENT_HANDLER_PATH, CLIENT_HANDLER_PATH, player_arg, segment_name,
+           offset_arg, ring->commands ? "actor" : (char *)NULL,
+           (char *)NULL);
+  }
+  sexecl(CLIENT_HANDLER_PATH, CLIENT_HANDLER_PATH, player_arg, segment_name,
+         (char *)NULL);
+  perror("Failed to exec client_handler");
+  exit(EXIT_FAILURE);
+}
+
+pid_t room_spawn_broadcaster(FileDescriptor pipe_read,
+                             const FileDescriptor *players_fd,
+                             const int *wire_versions,
+                             const struct SendQueueConfig *sendq, int tick_ms,
+                             const struct RoomRing *ring,
+                             const FileDescriptor *close_fds) {
+  pid_t pid = sfork();
+  if (pid != 0) {
+    return pid;
+  }
+
+  FileDescriptor pipe = __lift_fd(pipe_read);
+  FileDescriptor doorbell = ring != NULL ? __lift_fd(ring->doorbell) : -1;
+  FileDescriptor sockets[NB_PLAYERS];
+  for (int i = 0; i < NB_PLAYERS; i++) {
+    sockets[i] = __lift_fd(players_fd[i]);
+  }
+  __close_all(close_fds);
+  close(pipe_read);
+  for (int i = 0; i < NB_PLAYERS; i++) {
+    close(players_fd[i]);
+  }
+
+  sdup2(pipe, WRITE_PIPE_TO_BROADCAST_FD);
+  sclose(pipe);
+  for (int i = 0; i < NB_PLAYERS; i++) {
+    sdup2(sockets[i], PLAYERS_RANGE_FD + i);
+    sclose(sockets[i]);
+  }
+  if (ring != NULL) {
+    sdup2(doorbell, RING_DOORBELL_FD);
+    sclose(doorbell);
+  }
+
+  char capacity_arg[24];
+  char tick_arg[12];
+  char wire_args[NB_PLAYERS][12];
+  char offset_arg[24];
+  sprintf(capacity_arg, "%zu", sendq->capacity);
+  sprintf(tick_arg, "%d", tick_ms);
+  char *argv[] = {BROADCASTER_PATH,
+                  (char *)send_queue_policy_name(sendq->policy),
+                  capacity_arg,
+                  tick_arg,
+                  [4 + NB_PLAYERS + 3] = NULL};
+  for (int i = 0; i < NB_PLAYERS; i++) {
+    sprintf(wire_args[i], "%d", wire_versions[i]);
+    argv[4 + i] = wire_args[i];
+  }
+  if (ring != NULL) {
+    sprintf(offset_arg, "%zu", ring->offset);
+    argv[4 + NB_PLAYERS] = (char *)ring->segment_name;
+    argv[4 + NB_PLAYERS + 1] = offset_arg;
+    argv[4 + NB_PLAYERS + 2] = ring->commands ? "actor" : NULL;
+  }
+  execv(BROADCASTER_PATH, argv);
+  perror("Failed to exec broadcaster");
+  exit(EXIT_FAILURE);
+}
+
+// Stops (SIGTERM) and reaps every process of the room which is still alive.
+static void __room_teardown(struct Room *room) {
+  int wstatus;
+  for (int i = 0; i < NB_PLAYERS; i++) {
+    if (room->client_handlers[i] != -1) {
+      skill(room->client_handlers[i], SIGTERM);
+      swaitpid(room->client_handlers[i], &wstatus, 0);
+      room->client_handlers[i] = -1;
+    }
+  }
+  if (room->broadcaster != -1) {
+    skill(room->broadcaster, SIGTERM);
+    swaitpid(room->broadcaster, &wstatus, 0);
+    room->broadcaster = -1;
+  }
+}
+
+void room_ring_create(struct RoomRing *ring, const struct ShmSegment *shm,
+                      size_t state_size, enum MessageTransport transport) {
+  ring->segment_name = shm->name;
+  ring->commands = transport == TRANSPORT_ACTOR;
+  ring->offset = room_segment_ring_offset(state_size);
+  msg_ring_init((struct MsgRing *)((char *)shm->base + ring->offset),
+                MSG_RING_DEFAULT_CAPACITY);
+  ring->doorbell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  checkNeg(ring->doorbell, "Error eventfd");
+}
+
+bool room_parse_transport(const char *name, enum MessageTransport *transport) {
+  if (strcmp(name, "pipe") == 0) {
+    *transport = TRANSPORT_PIPE;
+  } else if (strcmp(name, "ring") == 0) {
+    *transport = TRANSPORT_RING;
+  } else if (strcmp(name, "actor") == 0) {
+    *transport = TRANSPORT_ACTOR;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+void room_play(struct Room *room, const struct CompiledMap *map,
+               const struct SendQueueConfig *sendq, int tick_ms,
+               enum MessageTransport transport, bool trace,
+               struct WorkerSet *workers) {
+  size_t state_size = map_cache_state_size(map);
+  shm_arena_create(&room->shm, room->id,
+                   room_segment_size(state_size, transport != TRANSPORT_PIPE));
+  room->segment = room->shm.base;
+  room_segment_init(room->segment, trace);
+  room->state = room_segment_state(room->segment);
+  metrics_add(METRIC_MATCHES_STARTED, 1);
+  spipe(room->pipefd);
+  const struct RoomRing *ring = NULL;
+  if (transport != TRANSPORT_PIPE) {
+    room_ring_create(&room->ring, &room->shm, state_size, transport);
+    ring = &room->ring;
+  }
+
+  map_cache_reset_state(map, room->state);
+  for (int i = 0; i < NB_PLAYERS; i++) {
+    map_cache_send(map, room->players_fd[i], room->wire_versions[i]);
+  }
+
+  for (int i = 0; i < NB_PLAYERS; i++) {
+    union Message msg = {
+        .registration = {.msgt = REGISTRATION, .player = i + 1}};
+    metrics_sent(REGISTRATION, 1,
+                 wire_send(room->players_fd[i], room->wire_versions[i], &msg,
+                           1));
+  }
+
+  if (workers != NULL) {
+    // pooled workers: no fork, no exec, only the descriptors change hands
+    worker_start_broadcaster(workers, room->pipefd[0], room->players_fd,
+                             room->wire_versions, sendq, tick_ms, ring);
+    for (int i = 0; i < NB_PLAYERS; i++) {
+      worker_start_handler(workers, i + 1, room->players_fd[i],
+                           room->pipefd[1], room->shm.name, ring);
+    }
+  } else {
+    FileDescriptor close_fds[NB_PLAYERS + 3];
+    close_fds[0] = room->pipefd[1];
+    close_fds[1] = -1;
+    room->broadcaster = room_spawn_broadcaster(
+        room->pipefd[0], room->players_fd, room->wire_versions, sendq, tick_ms,
+        ring, close_fds);
+
+    for (int i = 0; i < NB_PLAYERS; i++) {
+      int n = 0;
+      close_fds[n++] = room->pipefd[0];
+      for (int j = 0; j < NB_PLAYERS; j++) {
+        if (j != i) {
+          close_fds[n++] = room->players_fd[j];
+        }
+      }
+      close_fds[n] = -1;
+      room->client_handlers[i] = room_spawn_client_handler(
+          i + 1, room->players_fd[i], room->pipefd[1], room->shm.name, ring,
+          close_fds);
+    }
+  }
+
+  // The room process does not take part in the match itself: once the
+  // children hold their ends of the pipe, it can let them go.
+  sclose(room->pipefd[0]);
+  sclose(room->pipefd[1]);
+  if (ring != NULL) {
+    sclose(room->ring.doorbell);
+  }
+
+  if (workers != NULL) {
+    worker_set_finish_match(workers, room->players_fd, room->segment);
+  } else {
+    while (room->broadcaster != -1) {
+      int wstatus;
+      pid_t pid = swaitpid(-1, &wstatus, 0);
+      if (pid == room->broadcaster) {
+        room->broadcaster = -1;
+        break;
+      }
+      for (int i = 0; i < NB_PLAYERS; i++) {
+        if (room->client_handlers[i] == pid) {
+          room->client_handlers[i] = -1;
+          if (!WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != EXIT_SUCCESS) {
+            metrics_add(METRIC_HANDLERS_FAILED, 1);
+          }
+        }
+      }
+      // A handler which stopped because the game is over leaves the
+      // broadcaster some time to forward the GAME_OVER message. Any other
+      // reason (a player left) ends the match right away.
+      room_segment_lock(room->segment);
+      bool game_over = room->state->game_over;
+      room_segment_unlock(room->segment);
+      if (!game_over) {
+        break;
+      }
+    }
+  }
+  __room_teardown(room);
+
+  for (int i = 0; i < NB_PLAYERS; i++) {
+    sclose(room->players_fd[i]);
+    room->players_fd[i] = -1;
+  }
+  metrics_add(METRIC_PLAYERS_DISCONNECTED, NB_PLAYERS);
+  metrics_add(METRIC_MATCHES_FINISHED, 1);
+  shm_arena_destroy(&room->shm);
+  room->segment = NULL;
+  room->state = NULL;
+}
+
+// A match sent by the server to the launcher, the player sockets travel
+// with it.
+struct RoomOrder {
+  int id;
+  // index in the maps of the server
+  int map;
+  int wire_versions[NB_PLAYERS];
+};
+
+// Socket of the launcher to the server, written by its SIGCHLD handler.
+static FileDescriptor __launcher_ctl = -1;
+
+static void __launcher_sigchld_handler(int signum) {
+  int saved_errno = errno;
+  pid_t pid;
+  int wstatus;
+  while ((pid = waitpid(-1, &wstatus, WNOHANG)) > 0) {
+    if (!worker_pool_reaped(&__pool, pid, wstatus)) {
+      __active_rooms--;
+      // tells the server a room is over (send is async-signal-safe)
+      char done = 1;
+      if (send(__launcher_ctl, &done, sizeof(done), MSG_NOSIGNAL) < 0) {
+        // the server is gone: nobody waits for the news
+      }
+    }
+  }
+  errno = saved_errno;
+}
+
+static void __rooms_sigint_handler(int signum) { __stop_requested = 1; }
+
+static int __compare_fds(const void *a, const void *b) {
+  return *(const FileDescriptor *)a - *(const FileDescriptor *)b;
+}
+
+// Closes every descriptor above the standard streams but the 'n' of 'keep'
+// (sorted in place). A room process must not keep the socket of the
+// launcher, or the sets of workers of the other rooms, for the whole match.
+static void __close_all_but(FileDescriptor *keep, int n) {
+  qsort(keep, n, sizeof(*keep), __compare_fds);
+  unsigned int from = STDERR_FILENO + 1;
+  for (int i = 0; i < n; i++) {
+    if ((unsigned int)keep[i] > from) {
+      close_range(from, keep[i] - 1, 0);
+    }
+    if ((unsigned int)keep[i] + 1 > from) {
+      from = keep[i] + 1;
+    }
+  }
+  close_range(from, ~0U, 0);
+}
+
+static void __send_order(FileDescriptor ctl, const struct RoomOrder *order,
+                         const FileDescriptor *players_fd) {
+  struct iovec iov = {.iov_base = (void *)order, .iov_len = sizeof(*order)};
+  union {
+    char buf[CMSG_SPACE(NB_PLAYERS * sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  struct msghdr msg = {.msg_iov = &iov,
+                       .msg_iovlen = 1,
+                       .msg_control = control.buf,
+                       .msg_controllen = sizeof(control.buf)};
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(NB_PLAYERS * sizeof(int));
+  memcpy(CMSG_DATA(cmsg), players_fd, NB_PLAYERS * sizeof(int));
+  ssize_t n;
+  do {
+    n = sendmsg(ctl, &msg, MSG_NOSIGNAL);
+  } while (n < 0 && errno == EINTR);
+  checkNeg(n, "Error sendmsg to the launcher");
+}
+
+// RES: false once the server is gone.
+static bool __recv_order(FileDescriptor ctl, struct RoomOrder *order,
+                         FileDescriptor *players_fd) {
+  struct iovec iov = {.iov_base = order, .iov_len = sizeof(*order)};
+  union {
+    char buf[CMSG_SPACE(NB_PLAYERS * sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  struct msghdr msg = {.msg_iov = &iov,
+                       .msg_iovlen = 1,
+                       .msg_control = control.buf,
+                       .msg_controllen = sizeof(control.buf)};
+  ssize_t n;
+  do {
+    n = recvmsg(ctl, &msg, MSG_CMSG_CLOEXEC);
+  } while (n < 0 && errno == EINTR);
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (n != sizeof(*order) || cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET ||
+      cmsg->cmsg_type != SCM_RIGHTS ||
+      cmsg->cmsg_len != CMSG_LEN(NB_PLAYERS * sizeof(int))) {
+    return false;
+  }
+  memcpy(players_fd, CMSG_DATA(cmsg), NB_PLAYERS * sizeof(int));
+  return true;
+}
+
+// Forks the process of the room playing 'order'.
+static void __launch_room(const struct RoomOrder *order,
+                          FileDescriptor *players_fd,
+                          const struct CompiledMap *map,
+                          const struct SendQueueConfig *sendq, int tick_ms,
+                          enum MessageTransport transport, bool trace) {
+  struct Room room = {
+      .id = order->id, .broadcaster = -1, .segment = NULL, .state = NULL};
+  for (int i = 0; i < NB_PLAYERS; i++) {
+    room.players_fd[i] = players_fd[i];
+    room.wire_versions[i] = order->wire_versions[i];
+    room.client_handlers[i] = -1;
+  }
+
+  sigset_t chld_set;
+  sigset_t orig_set;
+  ssigemptyset(&chld_set);
+  ssigaddset(&chld_set, SIGCHLD);
+  fflush(stdout);
+  ssigprocmask(SIG_BLOCK, &chld_set, &orig_set);
+  // a room finds no free set when more rooms than sets run: it then forks
+  // and execs its processes
+  struct WorkerSet *workers = worker_pool_acquire(&__pool);
+  pid_t pid = sfork();
+  if (pid == 0) {
+    signal(SIGCHLD, SIG_DFL);
+    ssigprocmask(SIG_SETMASK, &orig_set, NULL);
+    FileDescriptor keep[NB_PLAYERS + WORKERS_PER_SET + 1];
+    int n = 0;
+    if (metrics_enabled()) {
+      keep[n++] = METRICS_FD;
+    }
+    for (int i = 0; i < NB_PLAYERS; i++) {
+      keep[n++] = room.players_fd[i];
+    }
+    for (int w = 0; workers != NULL && w < WORKERS_PER_SET; w++) {
+      keep[n++] = workers->ctl[w];
+    }
+    __close_all_but(keep, n);
+    room_play(&room, map, sendq, tick_ms, transport, trace, workers);
+    exit(EXIT_SUCCESS);
+  }
+  if (workers != NULL) {
+    // freed by the SIGCHLD handler once the room is reaped
+    workers->user = pid;
+  }
+  __active_rooms++;
+  ssigprocmask(SIG_SETMASK, &orig_set, NULL);
+
+  printf("Room %d started (process %d, %d room(s) running)\n", room.id, pid,
+         (int)__active_rooms);
+  fflush(stdout);
+  for (int i = 0; i < NB_PLAYERS; i++) {
+    sclose(room.players_fd[i]);
+  }
+}
+
+// Body of the launcher: forks a room for every order of the server until it
+// is gone, then waits for the running rooms.
+static void __launcher_main(FileDescriptor ctl,
+                            const struct CompiledMap **maps,
+                            const struct SendQueueConfig *sendq, int tick_ms,
+                            enum MessageTransport transport, bool trace,
+                            int pool_size) {
+  // the server tells the launcher to stop by closing its socket
+  signal(SIGINT, SIG_IGN);
+  __launcher_ctl = ctl;
+  worker_pool_init(&__pool, pool_size);
+  if (pool_size > 0) {
+    printf("%d pre-forked worker set(s) ready\n", pool_size);
+  }
+
+  struct sigaction action = {0};
+  ssigemptyset(&action.sa_mask);
+  action.sa_handler = __launcher_sigchld_handler;
+  action.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+  checkNeg(sigaction(SIGCHLD, &action, NULL), "Error sigaction");
+
+  struct RoomOrder order;
+  FileDescriptor players_fd[NB_PLAYERS];
+  while (__recv_order(ctl, &order, players_fd)) {
+    __launch_room(&order, players_fd, maps[order.map], sendq, tick_ms,
+                  transport, trace);
+  }
+
+  sigset_t chld_set;
+  sigset_t orig_set;
+  ssigemptyset(&chld_set);
+  ssigaddset(&chld_set, SIGCHLD);
+  ssigprocmask(SIG_BLOCK, &chld_set, &orig_set);
+  while (__active_rooms > 0) {
+    sigsuspend(&orig_set);
+  }
+  ssigprocmask(SIG_SETMASK, &orig_set, NULL);
+  signal(SIGCHLD, SIG_DFL);
+  worker_pool_free(&__pool);
+}
+
+void rooms_launcher_start(struct RoomsLauncher *launcher,
+                          const struct CompiledMap **maps,
+                          const struct SendQueueConfig *sendq, int tick_ms,
+                          enum MessageTransport transport, bool trace,
+                          int pool_size) {
+  FileDescriptor pair[2];
+  checkNeg(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, pair),
+           "Error socketpair");
+  fflush(stdout);
+  launcher->pid = sfork();
+  if (launcher->pid == 0) {
+    sclose(pair[0]);
+    __launcher_main(pair[1], maps, sendq, tick_ms, transport, trace,
+                    pool_size);
+    exit(EXIT_SUCCESS);
+  }
+  sclose(pair[1]);
+  launcher->ctl = pair[0];
+}
+
+// Reads the rooms the launcher reports as over.
+// RES: the number of rooms over, -1 once the launcher is gone.
+static int __rooms_over(FileDescriptor ctl, bool wait) {
+  char done[64];
+  ssize_t n = recv(ctl, done, sizeof(done), wait ? 0 : MSG_DONTWAIT);
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+    return 0;
+  }
+  return n > 0 ? (int)n : -1;
+}
+
+int rooms_run(struct Matchmaker *mm, struct RoomsLauncher *launcher,
+              const struct CompiledMap **maps, int nb_maps, int max_rooms) {
+  // SIGINT must interrupt the wait for a free room.
+  struct sigaction action = {0};
+  ssigemptyset(&action.sa_mask);
+  action.sa_handler = __rooms_sigint_handler;
+  action.sa_flags = 0;
+  checkNeg(sigaction(SIGINT, &action, NULL), "Error sigaction");
+
+  int active_rooms = 0;
+  int next_room_id = 0;
+  while (!__stop_requested) {
+    int over;
+    while ((over = __rooms_over(launcher->ctl,
+                                max_rooms > 0 && active_rooms >= max_rooms &&
+                                    !__stop_requested)) > 0) {
+      active_rooms -= over;
+    }
+    if (over < 0) {
+      fprintf(stderr, "The launcher of the rooms is gone\n");
+      break;
+    }
+    if (__stop_requested || (max_rooms > 0 && active_rooms >= max_rooms)) {
+      continue;
+    }
+
+    // the players keep queueing in the matchmaker meanwhile
+    struct Match match;
+    if (!matchmaker_next(mm, &match, ROOMS_POLL_MS)) {
+      continue;
+    }
+    struct RoomOrder order = {
+        .id = next_room_id,
+        .map = match.map != -1 ? match.map : next_room_id % nb_maps};
+    for (int i = 0; i < NB_PLAYERS; i++) {
+      order.wire_versions[i] = match.wire_versions[i];
+    }
+    printf("Room %d: players matched, playing %s\n", order.id,
+           maps[order.map]->path);
+    matchmaker_print_stats(mm, stdout);
+    fflush(stdout);
+    __send_order(launcher->ctl, &order, match.players_fd);
+    active_rooms++;
+    for (int i = 0; i < NB_PLAYERS; i++) {
+      sclose(match.players_fd[i]);
+    }
+    next_room_id++;
+  }
+
+  printf("Waiting for the running rooms to finish...\n");
+  fflush(stdout);
+  shutdown(launcher->ctl, SHUT_WR);
+  // the launcher closes its socket once every room is over
+  while (__rooms_over(launcher->ctl, true) >= 0) {
+  }
+  sclose(launcher->ctl);
+  waitpid(launcher->pid, NULL, 0);
+  return 0;
+}
@@ -0,0 +1,161 @@
+#ifndef ROOM_H
+#define ROOM_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "game.h"
+#include "map_cache.h"
+#include "matchmaker.h"
+#include "room_segment.h"
+#include "send_queue.h"
+#include "shm_arena.h"
+#include "worker_pool.h"
+
+// How the client handlers of a room hand their messages to the broadcaster.
+enum MessageTransport {
+  // the pipe: one write per command
+  TRANSPORT_PIPE,
+  // the message ring in the shared memory segment of the room (see
+  // msg_ring.h), the pipe only tells the broadcaster the handlers are gone
+  TRANSPORT_RING,
+  // the handlers only publish the commands of their player in the ring: the
+  // broadcaster is the game actor, the single process applying them to the
+  // GameState, in the order of the ring
+  TRANSPORT_ACTOR
+};
+
+// Where the processes of a room find its message ring.
+struct RoomRing {
+  // name of the segment of the room (see shm_arena.h)
+  const char *segment_name;
+  // offset of the ring in the segment
+  size_t offset;
+  // eventfd waking up the broadcaster
+  FileDescriptor doorbell;
+  // true if the ring carries commands (TRANSPORT_ACTOR)
+  bool commands;
+};
+
+/**
+ * A room is one match between NB_PLAYERS players. Each room owns its own
+ * GameState and lock (in a shared memory segment of the arena named after
+ * the room id, see room_segment.h and shm_arena.h), its own pipe to the
+ * broadcaster and its own client_handler/broadcaster processes, so several
+ * rooms can run side by side in the same pas_server instance.
+ */
+struct Room {
+  int id;
+  FileDescriptor players_fd[NB_PLAYERS];
+  // wire version negotiated by each player (see wire.h)
+  int wire_versions[NB_PLAYERS];
+  pid_t client_handlers[NB_PLAYERS];
+  pid_t broadcaster;
+  struct ShmSegment shm;
+  struct RoomSegment *segment;
+  struct GameState *state;
+  // pipe between the client handlers (write end) and the broadcaster
+  // (read end)
+  FileDescriptor pipefd[2];
+  // message ring, when the room uses TRANSPORT_RING
+  struct RoomRing ring;
+};
+
+/**
+ * Forks and execs the client_handler of the given player (1-based). The
+ * player socket is moved to PLAYER_SOCKET_FD and the pipe write end to
+ * WRITE_PIPE_TO_BROADCAST_FD. When 'ring' is not NULL, the handler publishes
+ * its messages in that ring and its doorbell is moved to RING_DOORBELL_FD.
+ * Every other descriptor in 'close_fds' (terminated by -1) is closed in the
+ * child.
+ */
+pid_t room_spawn_client_handler(int player_no, FileDescriptor player,
+                                FileDescriptor pipe_write,
+                                const char *segment_name,
+                                const struct RoomRing *ring,
+                                const FileDescriptor *close_fds);
+
+/**
+ * Forks and execs the broadcaster. The pipe read end is moved to
+ * WRITE_PIPE_TO_BROADCAST_FD and the player sockets to PLAYERS_RANGE_FD + i.
+ * The broadcaster serves each player through a send queue configured by
+ * 'sendq', in its wire version ('wire_versions'), and forwards the messages
+ * every 'tick_ms' milliseconds (0 = right away). When 'ring' is not NULL, the
+ * messages are read from that ring, whose doorbell is moved to
+ * RING_DOORBELL_FD.
+ */
+pid_t room_spawn_broadcaster(FileDescriptor pipe_read,
+                             const FileDescriptor *players_fd,
+                             const int *wire_versions,
+                             const struct SendQueueConfig *sendq, int tick_ms,
+                             const struct RoomRing *ring,
+                             const FileDescriptor *close_fds);
+
+/**
+ * Plays a whole match in the calling process: creates the private IPC of the
+ * room, sends the map and the registrations to the players, spawns the
+ * client handlers and the broadcaster (or hands the match to the pooled
+ * 'workers' if not NULL), waits until the match is over and releases
+ * everything. The player sockets are closed on return. With 'trace', the
+ * handlers stamp the key presses and the broadcaster reports the latency of
+ * each stage (see stage_trace.h).
+ */
+void room_play(struct Room *room, const struct CompiledMap *map,
+               const struct SendQueueConfig *sendq, int tick_ms,
+               enum MessageTransport transport, bool trace,
+               struct WorkerSet *workers);
+
+/**
+ * PRE:  'shm' is a segment of room_segment_size(state_size, true) bytes,
+ *       'transport' is TRANSPORT_RING or TRANSPORT_ACTOR.
+ * POST: the message ring of the segment is empty and 'ring' describes it,
+ *       with a new doorbell.
+ */
+void room_ring_create(struct RoomRing *ring, const struct ShmSegment *shm,
+                      size_t state_size, enum MessageTransport transport);
+
+// RES: true if 'name' is a transport ("pipe", "ring" or "actor"), put in
+//      'transport'.
+bool room_parse_transport(const char *name, enum MessageTransport *transport);
+
+/**
+ * The room processes of the "rooms" mode play their match without exec. They
+ * are forked by the launcher, a process forked while the server still has a
+ * single thread: a room never inherits a lock held by the acceptors of the
+ * matchmaker or the metrics thread. The server sends it every match (and the
+ * player sockets) through a socket, the launcher answers a byte for every
+ * room over.
+ */
+struct RoomsLauncher {
+  pid_t pid;
+  FileDescriptor ctl;
+};
+
+/**
+ * PRE:  the calling process has a single thread.
+ * POST: the launcher runs. Its rooms play the 'maps' with room_play
+ *       ('sendq', 'tick_ms', 'transport' and 'trace'). 'pool_size' sets of
+ *       workers are pre-forked (see worker_pool.h); the rooms which find no
+ *       free set fork and exec their own processes.
+ */
+void rooms_launcher_start(struct RoomsLauncher *launcher,
+                          const struct CompiledMap **maps,
+                          const struct SendQueueConfig *sendq, int tick_ms,
+                          enum MessageTransport transport, bool trace,
+                          int pool_size);
+
+/**
+ * Runs the server in "rooms" mode: the matchmaker 'mm' keeps accepting
+ * players while earlier matches run, every pair it matches is sent to the
+ * 'launcher', which forks a room process for it. At most 'max_rooms' matches
+ * run at the same time (0 means unlimited), the other players wait in the
+ * queue of the matchmaker. The rooms play the map their players asked for,
+ * or the 'nb_maps' maps in turn.
+ *
+ * Returns when SIGINT has been received and every running room is finished
+ * (the launcher is gone).
+ */
+int rooms_run(struct Matchmaker *mm, struct RoomsLauncher *launcher,
+              const struct CompiledMap **maps, int nb_maps, int max_rooms);
+
+#endif // ROOM_H
@@ -0,0 +1,69 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "metrics.h"
+#include "msg_ring.h"
+#include "room_segment.h"
+
+static void __check(int rv, const char *msg) {
+  if (rv != 0) {
+    errno = rv;
+    perror(msg);
+    exit(EXIT_FAILURE);
+  }
+}
+
+size_t room_segment_size(size_t state_size, bool with_ring) {
+  if (!with_ring) {
+    return sizeof(struct RoomSegment) + state_size;
+  }
+  return room_segment_ring_offset(state_size) +
+         msg_ring_size(MSG_RING_DEFAULT_CAPACITY);
+}
+
+size_t room_segment_ring_offset(size_t state_size) {
+  return msg_ring_offset(sizeof(struct RoomSegment) + state_size);
+}
+
+void room_segment_init(struct RoomSegment *segment, bool trace) {
+  segment->trace = trace;
+  pthread_mutexattr_t attr;
+  __check(pthread_mutexattr_init(&attr), "Error pthread_mutexattr_init");
+  __check(pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED),
+          "Error pthread_mutexattr_setpshared");
+  __check(pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST),
+          "Error pthread_mutexattr_setrobust");
+  __check(pthread_mutex_init(&segment->lock, &attr),
+          "Error pthread_mutex_init");
+  pthread_mutexattr_destroy(&attr);
+}
+
+struct GameState *room_segment_state(struct RoomSegment *segment) {
+  return (struct GameState *)segment->state;
+}
+
+void room_segment_lock(struct RoomSegment *segment) {
+  int rv = pthread_mutex_trylock(&segment->lock);
+  if (rv == EBUSY) {
+    // only a lock found taken is timed: the free one stays a single CAS
+    uint64_t since = metrics_enabled() ? metrics_now_ns() : 0;
+    rv = pthread_mutex_lock(&segment->lock);
+    if (since != 0) {
+      metrics_add(METRIC_LOCK_WAITS, 1);
+      metrics_add(METRIC_LOCK_WAIT_NS, metrics_now_ns() - since);
+    }
+  }
+  if (rv == EOWNERDEAD) {
+    // The state may hold half of the command the dead handler was
+    // processing: it stays readable, and a match whose handler died is
+    // ended by the room anyway.
+    fprintf(stderr, "The owner of the room lock died, recovering it\n");
+    rv = pthread_mutex_consistent(&segment->lock);
+  }
+  __check(rv, "Error pthread_mutex_lock");
+}
+
+void room_segment_unlock(struct RoomSegment *segment) {
+  __check(pthread_mutex_unlock(&segment->lock), "Error pthread_mutex_unlock");
+}
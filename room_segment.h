@@ -0,0 +1,56 @@
+#ifndef ROOM_SEGMENT_H
+#define ROOM_SEGMENT_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "game.h"
+
+/**
+ * The shared memory segment of a match, attached by the server (or the room
+ * process), the client handlers and the broadcaster:
+ *
+ *   [ lock | GameState | message ring (TRANSPORT_RING only, see msg_ring.h) ]
+ *
+ * The lock is a process-shared robust mutex: taking it when it is free is a
+ * single atomic operation with no system call, the kernel is only entered
+ * when another handler holds it. If a handler dies while holding it, the
+ * next one to take it gets it back instead of blocking forever.
+ */
+struct RoomSegment {
+  pthread_mutex_t lock;
+  // the handlers stamp the key presses (see stage_trace.h)
+  bool trace;
+  _Alignas(64) uint64_t state[];
+};
+
+/**
+ * RES: the size of a segment holding a GameState of 'state_size' bytes and,
+ *      if 'with_ring', a message ring of MSG_RING_DEFAULT_CAPACITY messages.
+ */
+size_t room_segment_size(size_t state_size, bool with_ring);
+
+// RES: the offset of the message ring in the segment.
+size_t room_segment_ring_offset(size_t state_size);
+
+/**
+ * PRE:  no process uses the lock of 'segment'.
+ * POST: the lock is initialised and free. The handlers of the match stamp
+ *       the key presses if 'trace'.
+ */
+void room_segment_init(struct RoomSegment *segment, bool trace);
+
+// RES: the GameState of the segment.
+struct GameState *room_segment_state(struct RoomSegment *segment);
+
+/**
+ * POST: the calling process holds the lock of the segment. If its previous
+ *       owner died holding it, the lock has been made consistent again.
+ */
+void room_segment_lock(struct RoomSegment *segment);
+
+// POST: the lock of the segment is released.
+void room_segment_unlock(struct RoomSegment *segment);
+
+#endif // ROOM_SEGMENT_H
@@ -0,0 +1,50 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "script.h"
+#include "utils_v3.h"
+
+void script_load(const char *path, struct Script *script) {
+  FILE *file = fopen(path, "r");
+  checkNull(file, "Error opening a script");
+  size_t capacity = 64;
+  script->moves = smalloc(capacity * sizeof(enum Direction));
+  script->count = 0;
+  int c;
+  while ((c = fgetc(file)) != EOF) {
+    enum Direction dir;
+    switch (c) {
+    case 'v':
+      dir = DOWN;
+      break;
+    case '>':
+      dir = RIGHT;
+      break;
+    case '<':
+      dir = LEFT;
+      break;
+    case '^':
+      dir = UP;
+      break;
+    default:
+      continue;
+    }
+    if (script->count == capacity) {
+      capacity *= 2;
+      script->moves = realloc(script->moves, capacity * sizeof(enum Direction));
+      checkNull(script->moves, "Error realloc");
+    }
+    script->moves[script->count++] = dir;
+  }
+  fclose(file);
+}
+
+int script_next(const struct Script *script, size_t *cursor) {
+  return *cursor < script->count ? (int)script->moves[(*cursor)++] : -1;
+}
+
+void script_free(struct Script *script) {
+  free(script->moves);
+  script->moves = NULL;
+  script->count = 0;
+}
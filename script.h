@@ -0,0 +1,36 @@
+#ifndef SCRIPT_H
+#define SCRIPT_H
+
+#include <stddef.h>
+
+#include "game.h"
+
+/**
+ * The moves of a player read from a test*\/joueur*.txt file, which the load
+ * generator and the simulator replay: one of the characters v > < ^ per
+ * move, anything else is ignored.
+ */
+struct Script {
+  enum Direction *moves;
+  size_t count;
+};
+
+/**
+ * POST: 'script' holds the moves of the file at 'path'; exits if it cannot
+ *       be read.
+ */
+void script_load(const char *path, struct Script *script);
+
+/**
+ * PRE: 'cursor' is 0 for the first move.
+ * POST: 'cursor' points at the move after the one returned.
+ * RES: the move of 'script' at 'cursor', -1 if the script is over.
+ */
+int script_next(const struct Script *script, size_t *cursor);
+
+/**
+ * POST: the moves of 'script' have been released.
+ */
+void script_free(struct Script *script);
+
+#endif // SCRIPT_H
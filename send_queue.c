@@ -0,0 +1,255 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "metrics.h"
+#include "send_queue.h"
+#include "utils_v3.h"
+#include "wire.h"
+
+// Players whose movements are tracked by the coalescing policy.
+#define COALESCE_MAX_IDS 8
+// Messages encoded at once in wire version 2.
+#define WIRE_BATCH 256
+
+static const char *__policy_names[] = {
+    [SLOW_CLIENT_DISCONNECT] = "disconnect",
+    [SLOW_CLIENT_DROP_MOVEMENT] = "drop",
+    [SLOW_CLIENT_COALESCE] = "coalesce",
+};
+
+void send_queue_init(struct SendQueue *q, FileDescriptor fd,
+                     const struct SendQueueConfig *config) {
+  q->fd = fd;
+  q->config = *config;
+  if (q->config.capacity == 0) {
+    q->config.capacity = SEND_QUEUE_DEFAULT_CAPACITY;
+  }
+  q->bulk = NULL;
+  q->bulk_len = 0;
+  q->msgs = smalloc(q->config.capacity * sizeof(union Message));
+  q->head = 0;
+  q->count = 0;
+  q->head_sent = 0;
+  q->wire_version = WIRE_V1;
+  q->wire = NULL;
+  q->wire_len = 0;
+  q->wire_sent = 0;
+  memset(&q->stats, 0, sizeof(q->stats));
+}
+
+void send_queue_set_wire(struct SendQueue *q, int version) {
+  q->wire_version = version;
+  if (version != WIRE_V1 && q->wire == NULL) {
+    q->wire = smalloc(WIRE_BATCH * WIRE_MAX_MESSAGE);
+  }
+}
+
+void send_queue_bulk(struct SendQueue *q, const void *data, size_t len) {
+  q->bulk = data;
+  q->bulk_len = len;
+  metrics_sent(METRICS_MSG_MAP, 1, len);
+}
+
+static union Message *__at(struct SendQueue *q, size_t i) {
+  return &q->msgs[(q->head + i) % q->config.capacity];
+}
+
+// Removes the i-th queued message, the later ones move up by one.
+static void __remove_at(struct SendQueue *q, size_t i) {
+  for (; i + 1 < q->count; i++) {
+    *__at(q, i) = *__at(q, i + 1);
+  }
+  q->count--;
+  q->stats.dropped++;
+}
+
+// The first message which may be dropped: one already partly written must
+// be completed or the stream would lose its framing.
+static size_t __first_droppable(const struct SendQueue *q) {
+  return q->head_sent > 0 ? 1 : 0;
+}
+
+static bool __drop_oldest_movement(struct SendQueue *q) {
+  for (size_t i = __first_droppable(q); i < q->count; i++) {
+    if (__at(q, i)->msgt == MOVEMENT) {
+      __remove_at(q, i);
+      return true;
+    }
+  }
+  return false;
+}
+
+// Drops every MOVEMENT superseded by a later one of the same item, including
+// the incoming message 'next'.
+static bool __coalesce(struct SendQueue *q, const union Message *next) {
+  uint32_t seen[COALESCE_MAX_IDS];
+  int nb_seen = 0;
+  if (next->msgt == MOVEMENT) {
+    seen[nb_seen++] = next->movement.id;
+  }
+  size_t before = q->count;
+  size_t first = __first_droppable(q);
+  for (size_t i = q->count; i-- > first;) {
+    union Message *msg = __at(q, i);
+    if (msg->msgt != MOVEMENT) {
+      continue;
+    }
+    bool superseded = false;
+    for (int j = 0; j < nb_seen; j++) {
+      superseded = superseded || seen[j] == msg->movement.id;
+    }
+    if (superseded) {
+      __remove_at(q, i);
+    } else if (nb_seen < COALESCE_MAX_IDS) {
+      seen[nb_seen++] = msg->movement.id;
+    }
+  }
+  return q->count < before;
+}
+
+bool send_queue_push(struct SendQueue *q, const union Message *msgs,
+                     size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    if (q->count == q->config.capacity) {
+      q->stats.slow_events++;
+      bool room_made = false;
+      switch (q->config.policy) {
+      case SLOW_CLIENT_DISCONNECT:
+        break;
+      case SLOW_CLIENT_DROP_MOVEMENT:
+        room_made = __drop_oldest_movement(q);
+        break;
+      case SLOW_CLIENT_COALESCE:
+        room_made = __coalesce(q, &msgs[i]);
+        break;
+      }
+      if (!room_made) {
+        return false;
+      }
+    }
+    *__at(q, q->count) = msgs[i];
+    q->count++;
+    if (q->count > q->stats.max_depth) {
+      q->stats.max_depth = q->count;
+    }
+  }
+  return true;
+}
+
+// Encodes the oldest queued messages into the (fully written) wire buffer.
+// Once encoded, they can no longer be dropped.
+static void __encode_batch(struct SendQueue *q) {
+  size_t n = q->count < WIRE_BATCH ? q->count : WIRE_BATCH;
+  q->wire_len = 0;
+  q->wire_sent = 0;
+  for (size_t i = 0; i < n; i++) {
+    size_t len =
+        wire_encode(q->wire_version, __at(q, i), q->wire + q->wire_len);
+    metrics_sent(__at(q, i)->msgt, 1, len);
+    q->wire_len += len;
+  }
+  q->head = (q->head + n) % q->config.capacity;
+  q->count -= n;
+}
+
+// Consumes 'written' bytes from the front of the queue.
+static void __advance(struct SendQueue *q, size_t written) {
+  if (q->bulk_len > 0) {
+    size_t n = written < q->bulk_len ? written : q->bulk_len;
+    q->bulk += n;
+    q->bulk_len -= n;
+    written -= n;
+  }
+  if (q->wire != NULL) {
+    q->wire_sent += written;
+    return;
+  }
+  written += q->head_sent;
+  size_t done = written / sizeof(union Message);
+  if (metrics_enabled()) {
+    for (size_t i = 0; i < done; i++) {
+      metrics_sent(__at(q, i)->msgt, 1, sizeof(union Message));
+    }
+  }
+  q->head = (q->head + done) % q->config.capacity;
+  q->count -= done;
+  q->head_sent = written % sizeof(union Message);
+}
+
+int send_queue_flush(struct SendQueue *q) {
+  while (!send_queue_empty(q)) {
+    struct iovec iov[3];
+    int iovcnt = 0;
+    if (q->bulk_len > 0) {
+      iov[iovcnt].iov_base = (void *)q->bulk;
+      iov[iovcnt++].iov_len = q->bulk_len;
+    }
+    if (q->wire != NULL) {
+      if (q->wire_sent == q->wire_len && q->count > 0) {
+        __encode_batch(q);
+      }
+      if (q->wire_sent < q->wire_len) {
+        iov[iovcnt].iov_base = q->wire + q->wire_sent;
+        iov[iovcnt++].iov_len = q->wire_len - q->wire_sent;
+      }
+    } else if (q->count > 0) {
+      size_t first = q->config.capacity - q->head;
+      if (first > q->count) {
+        first = q->count;
+      }
+      iov[iovcnt].iov_base = (char *)&q->msgs[q->head] + q->head_sent;
+      iov[iovcnt++].iov_len = first * sizeof(union Message) - q->head_sent;
+      if (q->count > first) {
+        iov[iovcnt].iov_base = q->msgs;
+        iov[iovcnt++].iov_len = (q->count - first) * sizeof(union Message);
+      }
+    }
+
+    // MSG_DONTWAIT rather than O_NONBLOCK: the socket may be shared with a
+    // process which reads it in blocking mode (client_handler).
+    struct msghdr msg = {.msg_iov = iov, .msg_iovlen = iovcnt};
+    ssize_t written = sendmsg(q->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    }
+    __advance(q, (size_t)written);
+  }
+  return 1;
+}
+
+size_t send_queue_depth(const struct SendQueue *q) { return q->count; }
+
+bool send_queue_empty(const struct SendQueue *q) {
+  return q->bulk_len == 0 && q->count == 0 && q->wire_sent == q->wire_len;
+}
+
+void send_queue_free(struct SendQueue *q) {
+  free(q->msgs);
+  free(q->wire);
+  q->msgs = NULL;
+  q->wire = NULL;
+  q->wire_len = 0;
+  q->wire_sent = 0;
+  q->count = 0;
+  q->bulk_len = 0;
+}
+
+bool send_queue_parse_policy(const char *name, enum SlowClientPolicy *policy) {
+  for (size_t i = 0; i < sizeof(__policy_names) / sizeof(*__policy_names);
+       i++) {
+    if (strcmp(name, __policy_names[i]) == 0) {
+      *policy = (enum SlowClientPolicy)i;
+      return true;
+    }
+  }
+  return false;
+}
+
+const char *send_queue_policy_name(enum SlowClientPolicy policy) {
+  return __policy_names[policy];
+}
@@ -0,0 +1,132 @@
+#ifndef SEND_QUEUE_H
+#define SEND_QUEUE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "game.h"
+
+/**
+ * A send queue is the bounded outbound buffer of one player socket. Messages
+ * are pushed without ever blocking and written with one non-blocking
+ * sendmsg() whenever the socket is writable, so a player whose TCP window
+ * is full no longer stalls the other player of the match.
+ *
+ * When a player falls so far behind that its queue is full, the queue
+ * applies the configured policy. Messages are queued as union Message and
+ * only encoded in the wire version of the player (see wire.h) when they are
+ * written. It is used by the broadcaster and by the event loops of the epoll
+ * and sharded engines.
+ */
+
+enum SlowClientPolicy {
+  // the player is disconnected
+  SLOW_CLIENT_DISCONNECT,
+  // the oldest queued MOVEMENT is dropped (the player may briefly see a
+  // stale position, the next MOVEMENT fixes it)
+  SLOW_CLIENT_DROP_MOVEMENT,
+  // every queued MOVEMENT superseded by a later MOVEMENT of the same item is
+  // dropped, only the latest position of each player is kept
+  SLOW_CLIENT_COALESCE,
+};
+
+#define SEND_QUEUE_DEFAULT_CAPACITY 4096
+
+struct SendQueueConfig {
+  enum SlowClientPolicy policy;
+  // maximum number of queued messages
+  size_t capacity;
+};
+
+struct SendQueueStats {
+  // highest number of messages queued at once
+  size_t max_depth;
+  // number of times the queue was full when a message was pushed
+  uint64_t slow_events;
+  // messages dropped by the policy
+  uint64_t dropped;
+};
+
+struct SendQueue {
+  FileDescriptor fd;
+  struct SendQueueConfig config;
+  // bytes of an external buffer (e.g. a compiled spawn stream) still to be
+  // written before the queued messages
+  const char *bulk;
+  size_t bulk_len;
+  // ring of 'config.capacity' messages, 'count' of them queued from 'head'
+  union Message *msgs;
+  size_t head;
+  size_t count;
+  // bytes of msgs[head] already written
+  size_t head_sent;
+  // wire version of the player; in version 2 the messages are encoded into
+  // 'wire' just before being written, 'wire_sent' of its 'wire_len' bytes
+  // are already written
+  int wire_version;
+  uint8_t *wire;
+  size_t wire_len;
+  size_t wire_sent;
+  struct SendQueueStats stats;
+};
+
+/**
+ * PRE:  'fd' is a socket (it is left in blocking mode, each send is made
+ *       non-blocking on its own).
+ * POST: 'q' is an empty queue writing on 'fd'.
+ */
+void send_queue_init(struct SendQueue *q, FileDescriptor fd,
+                     const struct SendQueueConfig *config);
+
+/**
+ * PRE:  'q' is empty.
+ * POST: the messages are written in the wire 'version' (WIRE_V1 by default).
+ */
+void send_queue_set_wire(struct SendQueue *q, int version);
+
+/**
+ * PRE:  'q' is empty and 'data' stays valid until it has been written. It is
+ *       already encoded in the wire version of the queue.
+ * POST: the 'len' bytes of 'data' are written before anything pushed later.
+ *       They do not count in the capacity and are never dropped.
+ */
+void send_queue_bulk(struct SendQueue *q, const void *data, size_t len);
+
+/**
+ * POST: the 'count' messages are queued, after applying the policy if the
+ *       queue was full.
+ * RES:  false if the player must be disconnected (policy
+ *       SLOW_CLIENT_DISCONNECT, or nothing could be dropped).
+ */
+bool send_queue_push(struct SendQueue *q, const union Message *msgs,
+                     size_t count);
+
+/**
+ * POST: as many queued bytes as the socket accepts have been written.
+ * RES:  1 if the queue is empty, 0 if the socket is full (wait until it is
+ *       writable again), -1 if the player left.
+ */
+int send_queue_flush(struct SendQueue *q);
+
+// The number of messages waiting in the queue.
+size_t send_queue_depth(const struct SendQueue *q);
+
+// True if nothing is waiting to be written.
+bool send_queue_empty(const struct SendQueue *q);
+
+/**
+ * POST: the memory of the queue is released (its descriptor is not closed).
+ */
+void send_queue_free(struct SendQueue *q);
+
+/**
+ * RES: true and the policy called 'name' ("disconnect", "drop" or
+ *      "coalesce") in 'policy', false if there is no such policy.
+ */
+bool send_queue_parse_policy(const char *name, enum SlowClientPolicy *policy);
+
+// The name of 'policy', as accepted by send_queue_parse_policy.
+const char *send_queue_policy_name(enum SlowClientPolicy policy);
+
+#endif // SEND_QUEUE_H
@@ -0,0 +1,311 @@
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "epoll_engine.h"
+#include "sharded_engine.h"
+#include "utils_v3.h"
+
+// Capacity of the hand-off queue of a worker (must be a power of two).
+#define HANDOFF_CAPACITY 1024
+
+// Lock-free single-producer (acceptor) / single-consumer (worker) queue of
+// accepted sockets.
+struct HandoffQueue {
+  _Alignas(64) atomic_size_t head; // next slot read by the worker
+  _Alignas(64) atomic_size_t tail; // next slot written by the acceptor
+  FileDescriptor slots[HANDOFF_CAPACITY];
+};
+
+// A registered player handed from a worker to another.
+struct Transfer {
+  FileDescriptor fd;
+  int version;
+  struct Transfer *next;
+};
+
+// The lobby shared by the workers: a player registered on a worker whose
+// lobby is empty is sent to the worker holding a waiting player, so that
+// players are paired whatever the workers their connections landed on.
+struct SharedLobby {
+  pthread_mutex_t lock;
+  // worker holding the player waiting for an opponent, -1 if none
+  int waiting;
+  struct Shard *shards;
+};
+
+struct Shard {
+  int index;
+  pthread_t thread;
+  struct EventLoop loop;
+  FileDescriptor doorbell;
+  atomic_bool stop;
+  struct HandoffQueue queue;
+  // registered players sent by the other workers (under lobby->lock)
+  struct Transfer *transfers;
+  struct SharedLobby *lobby;
+  // snapshot of the counters at the previous report
+  uint64_t last_messages;
+};
+
+static volatile sig_atomic_t __stop_requested = 0;
+
+static void __sharded_sigint_handler(int signum) { __stop_requested = 1; }
+
+static bool __handoff_push(struct HandoffQueue *queue, FileDescriptor fd) {
+  size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+  size_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+  if (tail - head == HANDOFF_CAPACITY) {
+    return false;
+  }
+  queue->slots[tail & (HANDOFF_CAPACITY - 1)] = fd;
+  atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+  return true;
+}
+
+static bool __handoff_pop(struct HandoffQueue *queue, FileDescriptor *fd) {
+  size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+  if (head == tail) {
+    return false;
+  }
+  *fd = queue->slots[head & (HANDOFF_CAPACITY - 1)];
+  atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+  return true;
+}
+
+static void __ring(struct Shard *shard) {
+  uint64_t one = 1;
+  if (write(shard->doorbell, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+    perror("Failed to ring a worker");
+  }
+}
+
+// Called by the worker thread when the acceptor rang its doorbell.
+static void __shard_doorbell(struct EventLoop *loop, void *ctx) {
+  struct Shard *shard = ctx;
+  uint64_t value;
+  if (read(shard->doorbell, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+    perror("Failed to read the doorbell");
+  }
+  FileDescriptor fd;
+  while (__handoff_pop(&shard->queue, &fd)) {
+    event_loop_add_connection(loop, fd);
+  }
+  pthread_mutex_lock(&shard->lobby->lock);
+  struct Transfer *transfers = shard->transfers;
+  shard->transfers = NULL;
+  pthread_mutex_unlock(&shard->lobby->lock);
+  while (transfers != NULL) {
+    struct Transfer *transfer = transfers;
+    transfers = transfer->next;
+    event_loop_add_player(loop, transfer->fd, transfer->version);
+    free(transfer);
+  }
+}
+
+// Called by a worker whose lobby is empty when a player registers.
+static bool __lobby_wait(struct EventLoop *loop, FileDescriptor fd,
+                         int version, void *ctx) {
+  struct Shard *shard = ctx;
+  struct SharedLobby *lobby = shard->lobby;
+  pthread_mutex_lock(&lobby->lock);
+  if (lobby->waiting == -1) {
+    lobby->waiting = shard->index;
+    pthread_mutex_unlock(&lobby->lock);
+    return false;
+  }
+  // The opponent is taken: if it leaves before the player gets there, the
+  // player looks for another one from the worker of the opponent.
+  struct Shard *target = &lobby->shards[lobby->waiting];
+  lobby->waiting = -1;
+  struct Transfer *transfer = smalloc(sizeof(struct Transfer));
+  transfer->fd = fd;
+  transfer->version = version;
+  transfer->next = target->transfers;
+  target->transfers = transfer;
+  pthread_mutex_unlock(&lobby->lock);
+  __ring(target);
+  return true;
+}
+
+static void __lobby_emptied(struct EventLoop *loop, void *ctx) {
+  struct Shard *shard = ctx;
+  struct SharedLobby *lobby = shard->lobby;
+  pthread_mutex_lock(&lobby->lock);
+  if (lobby->waiting == shard->index) {
+    lobby->waiting = -1;
+  }
+  pthread_mutex_unlock(&lobby->lock);
+}
+
+static void *__shard_main(void *arg) {
+  struct Shard *shard = arg;
+  while (!atomic_load(&shard->stop) || event_loop_busy(&shard->loop)) {
+    if (atomic_load(&shard->stop)) {
+      event_loop_stop_accepting(&shard->loop);
+    }
+    event_loop_run_once(&shard->loop, -1);
+  }
+  return NULL;
+}
+
+static void __print_stats(struct Shard *shards, int nb_workers,
+                          double elapsed) {
+  for (int i = 0; i < nb_workers; i++) {
+    struct EventLoopStats *stats = &shards[i].loop.stats;
+    uint64_t messages = atomic_load(&stats->messages);
+    uint64_t batches = atomic_load(&stats->batches);
+    uint64_t busy_ns = atomic_load(&stats->busy_ns);
+    printf("worker %d: %d room(s), %.0f msg/s, %lu batches, loop latency "
+           "avg %.1f us max %.1f us, send queue max %lu, %lu slow-client "
+           "event(s), %lu movement(s) coalesced\n",
+           i, atomic_load(&stats->rooms),
+           elapsed > 0 ? (messages - shards[i].last_messages) / elapsed : 0.0,
+           (unsigned long)batches,
+           batches > 0 ? busy_ns / 1000.0 / batches : 0.0,
+           atomic_load(&stats->max_batch_ns) / 1000.0,
+           (unsigned long)atomic_load(&stats->max_queue_depth),
+           (unsigned long)atomic_load(&stats->slow_clients),
+           (unsigned long)atomic_load(&stats->coalesced));
+    shards[i].last_messages = messages;
+  }
+}
+
+// Picks the worker which currently owns the fewest rooms.
+static struct Shard *__least_loaded(struct Shard *shards, int nb_workers) {
+  struct Shard *best = &shards[0];
+  for (int i = 1; i < nb_workers; i++) {
+    if (atomic_load_explicit(&shards[i].loop.stats.rooms,
+                             memory_order_relaxed) <
+        atomic_load_explicit(&best->loop.stats.rooms, memory_order_relaxed)) {
+      best = &shards[i];
+    }
+  }
+  return best;
+}
+
+static double __now_s(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int sharded_engine_default_workers(void) {
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  return cores > 0 ? (int)cores : 1;
+}
+
+int sharded_engine_run(FileDescriptor sockfd, const struct CompiledMap **maps,
+                       int nb_maps, int nb_workers, int stats_period,
+                       const struct SendQueueConfig *sendq, int tick_ms) {
+  signal(SIGPIPE, SIG_IGN);
+  struct sigaction action = {0};
+  ssigemptyset(&action.sa_mask);
+  action.sa_handler = __sharded_sigint_handler;
+  action.sa_flags = 0;
+  checkNeg(sigaction(SIGINT, &action, NULL), "Error sigaction");
+
+  // The workers never handle SIGINT: they inherit a mask blocking it so that
+  // it always interrupts the acceptor.
+  sigset_t blocked;
+  sigset_t orig;
+  ssigemptyset(&blocked);
+  ssigaddset(&blocked, SIGINT);
+  ssigprocmask(SIG_BLOCK, &blocked, &orig);
+
+  struct Shard *shards =
+      aligned_alloc(_Alignof(struct Shard), nb_workers * sizeof(struct Shard));
+  checkNull(shards, "Error aligned_alloc");
+  struct SharedLobby lobby = {.waiting = -1, .shards = shards};
+  pthread_mutex_init(&lobby.lock, NULL);
+  for (int i = 0; i < nb_workers; i++) {
+    struct Shard *shard = &shards[i];
+    shard->index = i;
+    shard->transfers = NULL;
+    shard->lobby = &lobby;
+    shard->last_messages = 0;
+    atomic_init(&shard->stop, false);
+    atomic_init(&shard->queue.head, 0);
+    atomic_init(&shard->queue.tail, 0);
+    shard->doorbell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    checkNeg(shard->doorbell, "Error eventfd");
+    event_loop_init(&shard->loop, -1, maps, nb_maps, sendq, tick_ms);
+    event_loop_set_doorbell(&shard->loop, shard->doorbell, __shard_doorbell,
+                            shard);
+    struct LobbyHooks hooks = {
+        .wait = __lobby_wait, .emptied = __lobby_emptied, .ctx = shard};
+    event_loop_set_lobby_hooks(&shard->loop, &hooks);
+    int ret = pthread_create(&shard->thread, NULL, __shard_main, shard);
+    checkCond(ret != 0, "Error pthread_create");
+  }
+  ssigprocmask(SIG_SETMASK, &orig, NULL);
+  printf("%d worker(s) started\n", nb_workers);
+
+  struct pollfd listener = {.fd = sockfd, .events = POLLIN};
+  double last_report = __now_s();
+  while (!__stop_requested) {
+    int timeout = stats_period > 0 ? stats_period * 1000 : -1;
+    int ready = poll(&listener, 1, timeout);
+    if (stats_period > 0 && __now_s() - last_report >= stats_period) {
+      double now = __now_s();
+      __print_stats(shards, nb_workers, now - last_report);
+      last_report = now;
+    }
+    if (ready <= 0) {
+      continue;
+    }
+    FileDescriptor fd = accept(sockfd, NULL, NULL);
+    if (fd < 0) {
+      if (errno != EINTR && errno != ECONNABORTED) {
+        perror("accept failure");
+      }
+      continue;
+    }
+    // The players are paired once registered, through the shared lobby.
+    struct Shard *target = __least_loaded(shards, nb_workers);
+    if (!__handoff_push(&target->queue, fd)) {
+      fprintf(stderr, "Worker %d is overloaded, dropping a connection\n",
+              target->index);
+      sclose(fd);
+      continue;
+    }
+    __ring(target);
+  }
+
+  printf("Waiting for the running rooms to finish...\n");
+  for (int i = 0; i < nb_workers; i++) {
+    atomic_store(&shards[i].stop, true);
+    __ring(&shards[i]);
+  }
+  for (int i = 0; i < nb_workers; i++) {
+    pthread_join(shards[i].thread, NULL);
+  }
+  __print_stats(shards, nb_workers, __now_s() - last_report);
+  for (int i = 0; i < nb_workers; i++) {
+    // connections handed off after the worker stopped accepting
+    FileDescriptor fd;
+    while (__handoff_pop(&shards[i].queue, &fd)) {
+      sclose(fd);
+    }
+    while (shards[i].transfers != NULL) {
+      struct Transfer *transfer = shards[i].transfers;
+      shards[i].transfers = transfer->next;
+      sclose(transfer->fd);
+      free(transfer);
+    }
+    event_loop_destroy(&shards[i].loop);
+    sclose(shards[i].doorbell);
+  }
+  pthread_mutex_destroy(&lobby.lock);
+  free(shards);
+  return 0;
+}
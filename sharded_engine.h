@@ -0,0 +1,32 @@
+#ifndef SHARDED_ENGINE_H
+#define SHARDED_ENGINE_H
+
+#include "game.h"
+#include "map_cache.h"
+#include "send_queue.h"
+
+/**
+ * The sharded engine runs one event loop (see epoll_engine.h) per worker
+ * thread. Each worker owns its own epoll set and a disjoint subset of the
+ * rooms: a room is created by the worker which received its players and
+ * never migrates, so its GameState needs no locking.
+ *
+ * The main thread only accepts connections and hands them to the workers
+ * through a lock-free single-producer/single-consumer queue, waking them up
+ * with an eventfd, each to the worker owning the fewest rooms. The workers
+ * share a lobby: a registered player who finds the lobby of its worker empty
+ * is handed to the worker where another player waits, if any.
+ *
+ * PRE:  nb_workers > 0 (use sharded_engine_default_workers() for one worker
+ *       per online core), stats_period >= 0 in seconds (0 = only at exit),
+ *       tick_ms >= 0 (see event_loop_init)
+ * POST: runs until SIGINT is received and every running match is finished.
+ */
+int sharded_engine_run(FileDescriptor sockfd, const struct CompiledMap **maps,
+                       int nb_maps, int nb_workers, int stats_period,
+                       const struct SendQueueConfig *sendq, int tick_ms);
+
+// The number of online cores.
+int sharded_engine_default_workers(void);
+
+#endif // SHARDED_ENGINE_H
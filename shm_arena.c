@@ -0,0 +1,109 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "shm_arena.h"
+#include "utils_v3.h"
+
+#define SHM_ARENA_PREFIX "pas_cman"
+// where Linux shows the POSIX shared memory objects
+#define SHM_ARENA_DIR "/dev/shm"
+#define PERM 0600
+
+static pid_t __instance = -1;
+
+// True if no process 'pid' exists anymore.
+static bool __is_dead(pid_t pid) {
+  return kill(pid, 0) == -1 && errno == ESRCH;
+}
+
+int shm_arena_init(void) {
+  __instance = getpid();
+
+  DIR *dir = opendir(SHM_ARENA_DIR);
+  if (dir == NULL) {
+    return 0;
+  }
+  int reclaimed = 0;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    int pid;
+    int room_id;
+    char name[NAME_MAX + 2];
+    // a segment holding our own pid was left by an earlier process which
+    // had the same pid
+    if (sscanf(entry->d_name, SHM_ARENA_PREFIX ".%d.%d", &pid, &room_id) !=
+            2 ||
+        (pid != __instance && !__is_dead(pid))) {
+      continue;
+    }
+    snprintf(name, sizeof(name), "/%s", entry->d_name);
+    if (shm_unlink(name) == 0) {
+      reclaimed++;
+    }
+  }
+  closedir(dir);
+  return reclaimed;
+}
+
+static size_t __round_size(size_t size) {
+  if (size < SHM_ARENA_HUGE_PAGE) {
+    return size;
+  }
+  return (size + SHM_ARENA_HUGE_PAGE - 1) / SHM_ARENA_HUGE_PAGE *
+         SHM_ARENA_HUGE_PAGE;
+}
+
+static void __map(struct ShmSegment *seg, int fd) {
+  seg->base =
+      mmap(NULL, seg->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (seg->base == MAP_FAILED) {
+    perror("Error mmap");
+    exit(EXIT_FAILURE);
+  }
+  if (seg->size >= SHM_ARENA_HUGE_PAGE) {
+    // only a hint: the kernel may not back shared memory with huge pages
+    madvise(seg->base, seg->size, MADV_HUGEPAGE);
+  }
+  sclose(fd);
+}
+
+void shm_arena_create(struct ShmSegment *seg, int room_id, size_t size) {
+  snprintf(seg->name, sizeof(seg->name), "/" SHM_ARENA_PREFIX ".%d.%d",
+           (int)__instance, room_id);
+  seg->size = __round_size(size);
+  int fd = shm_open(seg->name, O_RDWR | O_CREAT | O_EXCL, PERM);
+  checkNeg(fd, "Error shm_open");
+  checkNeg(ftruncate(fd, seg->size), "Error ftruncate");
+  __map(seg, fd);
+}
+
+void shm_arena_attach(struct ShmSegment *seg, const char *name) {
+  snprintf(seg->name, sizeof(seg->name), "%s", name);
+  int fd = shm_open(seg->name, O_RDWR, 0);
+  checkNeg(fd, "Error shm_open");
+  struct stat st;
+  checkNeg(fstat(fd, &st), "Error fstat");
+  seg->size = st.st_size;
+  __map(seg, fd);
+}
+
+void shm_arena_detach(struct ShmSegment *seg) {
+  if (seg->base != NULL) {
+    munmap(seg->base, seg->size);
+    seg->base = NULL;
+  }
+}
+
+void shm_arena_destroy(struct ShmSegment *seg) {
+  shm_arena_detach(seg);
+  shm_unlink(seg->name);
+}
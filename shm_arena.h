@@ -0,0 +1,56 @@
+#ifndef SHM_ARENA_H
+#define SHM_ARENA_H
+
+#include <stddef.h>
+
+/**
+ * The shared memory segments of the matches (see room_segment.h) are POSIX
+ * shared memory objects named after the server instance (its pid) and the
+ * room id: /pas_cman.<pid>.<room id>. Any number of servers and rooms can
+ * then run side by side on the same host, and the segments a crashed server
+ * left behind are recognised by their dead pid and reclaimed by the next
+ * server to start.
+ *
+ * Segments of at least SHM_ARENA_HUGE_PAGE bytes are rounded up to a whole
+ * number of huge pages and advised to use them (MADV_HUGEPAGE), which only
+ * takes effect if /sys/kernel/mm/transparent_hugepage/shmem_enabled allows
+ * it.
+ */
+
+#define SHM_ARENA_NAME_MAX 64
+#define SHM_ARENA_HUGE_PAGE (2 * 1024 * 1024)
+
+struct ShmSegment {
+  char name[SHM_ARENA_NAME_MAX];
+  void *base;
+  size_t size;
+};
+
+/**
+ * POST: the calling process is the server instance owning the segments
+ *       created from now on (by itself or its children), and the segments
+ *       of the instances which are not running anymore have been unlinked.
+ * RES:  the number of segments reclaimed.
+ */
+int shm_arena_init(void);
+
+/**
+ * PRE:  shm_arena_init() has been called by this process or a parent.
+ * POST: 'seg' is a new zeroed segment of at least 'size' bytes, mapped
+ *       read-write, for the room 'room_id'.
+ */
+void shm_arena_create(struct ShmSegment *seg, int room_id, size_t size);
+
+/**
+ * PRE:  'name' is the name of an existing segment.
+ * POST: the segment is mapped read-write in 'seg'.
+ */
+void shm_arena_attach(struct ShmSegment *seg, const char *name);
+
+// POST: the segment is unmapped.
+void shm_arena_detach(struct ShmSegment *seg);
+
+// POST: the segment is unmapped and unlinked.
+void shm_arena_destroy(struct ShmSegment *seg);
+
+#endif // SHM_ARENA_H
@@ -0,0 +1,59 @@
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+
+#include "stage_trace.h"
+
+static const char *__stage_names[NB_TRACE_STAGES] = {
+    "Trace: handler (read -> published)",
+    "Trace: transport (published -> received)",
+    "Trace: broadcaster (received -> sent)",
+    "Trace: total (read -> sent)"};
+
+uint32_t stage_trace_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint32_t)((uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec);
+}
+
+void stage_trace_begin(struct MessageBuffer *msgs) {
+  union Message msg;
+  struct TraceRecord record = {.msgt = MSG_TRACE,
+                               .read_ns = stage_trace_now()};
+  memcpy(&msg, &record, sizeof(msg));
+  message_buffer_push(msgs, &msg);
+}
+
+void stage_trace_end(struct MessageBuffer *msgs) {
+  if (msgs->count == 1) {
+    // a move into a wall: nothing to deliver, nothing to time
+    message_buffer_clear(msgs);
+    return;
+  }
+  uint32_t published_ns = stage_trace_now();
+  memcpy((char *)&msgs->msgs[0] + offsetof(struct TraceRecord, published_ns),
+         &published_ns, sizeof(published_ns));
+}
+
+void stage_histograms_reset(struct StageHistograms *h) {
+  for (int s = 0; s < NB_TRACE_STAGES; s++) {
+    histogram_reset(&h->stages[s]);
+  }
+}
+
+void stage_histograms_record(struct StageHistograms *h, uint32_t read_ns,
+                             uint32_t published_ns, uint32_t received_ns,
+                             uint32_t sent_ns) {
+  // unsigned differences: right across a wrap of the stamps
+  histogram_record(&h->stages[STAGE_HANDLER], published_ns - read_ns);
+  histogram_record(&h->stages[STAGE_TRANSPORT], received_ns - published_ns);
+  histogram_record(&h->stages[STAGE_BROADCASTER], sent_ns - received_ns);
+  histogram_record(&h->stages[STAGE_TOTAL], sent_ns - read_ns);
+}
+
+void stage_histograms_print(const struct StageHistograms *h, FILE *out) {
+  for (int s = 0; s < NB_TRACE_STAGES; s++) {
+    histogram_print(&h->stages[s], __stage_names[s], "ns", out);
+  }
+  fflush(out);
+}
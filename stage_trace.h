@@ -0,0 +1,92 @@
+#ifndef STAGE_TRACE_H
+#define STAGE_TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "game.h"
+#include "histogram.h"
+
+/**
+ * Latency tracing of the key presses through the processes of a match of the
+ * fork and rooms engines (pas_server -L). A key press goes through four
+ * instants:
+ *
+ *   read       the client handler reads it on the player socket,
+ *   published  the handler has applied it and publishes its messages on the
+ *              pipe or the message ring (in actor mode, publishes the command),
+ *   received   the broadcaster takes them out of the pipe or the ring,
+ *   sent       the broadcaster has written them on every player socket.
+ *
+ * The handler stamps the first two in a TraceRecord which travels right
+ * before the messages of the key press (in actor mode, in the PlayerCommand
+ * itself, see msg_ring.h). The broadcaster takes the records out of the
+ * stream, the players never see them, and counts the time spent in each stage
+ * in a histogram. When tracing is off, no record is written and each stage
+ * costs a single branch.
+ *
+ * The stamps are the low 32 bits of CLOCK_MONOTONIC in ns, which every
+ * process of the server reads alike: a stage longer than 4 s wraps around.
+ */
+
+// Message type of a TraceRecord. The broadcaster relies on GAME_OVER and
+// MSG_TRACE being the only message types above EAT_FOOD.
+#define MSG_TRACE 0x7f
+
+// Laid over a union Message in the pipe or the ring.
+struct TraceRecord {
+  // MSG_TRACE
+  enum MessageType msgt;
+  uint32_t read_ns;
+  uint32_t published_ns;
+  uint32_t unused[2];
+};
+
+_Static_assert(sizeof(struct TraceRecord) == sizeof(union Message),
+               "a TraceRecord takes the place of a message");
+
+enum TraceStage {
+  // read -> published: the lock, the game logic
+  STAGE_HANDLER,
+  // published -> received: the pipe or the ring, waking the broadcaster up
+  STAGE_TRANSPORT,
+  // received -> sent: the actor, the tick, the send queues
+  STAGE_BROADCASTER,
+  // read -> sent
+  STAGE_TOTAL,
+  NB_TRACE_STAGES
+};
+
+struct StageHistograms {
+  struct Histogram stages[NB_TRACE_STAGES];
+};
+
+// RES: the current stamp (low 32 bits of CLOCK_MONOTONIC in ns).
+uint32_t stage_trace_now(void);
+
+/**
+ * PRE:  'msgs' is empty.
+ * POST: 'msgs' holds a TraceRecord of a key press read now.
+ */
+void stage_trace_begin(struct MessageBuffer *msgs);
+
+/**
+ * PRE:  'msgs' starts with the record of stage_trace_begin, followed by the
+ *       messages of the key press.
+ * POST: the record is stamped as published now, or removed if the key press
+ *       produced no message.
+ */
+void stage_trace_end(struct MessageBuffer *msgs);
+
+// POST: 'h' is empty.
+void stage_histograms_reset(struct StageHistograms *h);
+
+// POST: the stages of a key press stamped at the four instants are counted.
+void stage_histograms_record(struct StageHistograms *h, uint32_t read_ns,
+                             uint32_t published_ns, uint32_t received_ns,
+                             uint32_t sent_ns);
+
+// POST: the percentiles of every stage (in ns) have been written on 'out'.
+void stage_histograms_print(const struct StageHistograms *h, FILE *out);
+
+#endif // STAGE_TRACE_H
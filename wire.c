@@ -0,0 +1,275 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "utils_v3.h"
+#include "wire.h"
+
+#define WIRE_REGISTRATION_MASK ((1 << WIRE_VERSION_SHIFT) - 1)
+// A run of the snapshot holds its tile in its 3 low bits.
+#define WIRE_RUN_TILE_BITS 3
+
+#define WIRE_VERSION_MASK 0xFF
+
+int wire_registration_word(int version, int map) {
+  int word = REGISTRATION | ((unsigned)map << WIRE_MAP_SHIFT);
+  return version == WIRE_V1 ? word : word | (version << WIRE_VERSION_SHIFT);
+}
+
+int wire_parse_registration(int word) {
+  if ((word & WIRE_REGISTRATION_MASK) != REGISTRATION) {
+    return -1;
+  }
+  int version = (int)(((unsigned)word >> WIRE_VERSION_SHIFT) &
+                      WIRE_VERSION_MASK);
+  if (version == 0) {
+    return WIRE_V1;
+  }
+  return version >= WIRE_V1 && version <= WIRE_V3 ? version : -1;
+}
+
+int wire_registration_map(int word) {
+  return (int)(((unsigned)word >> WIRE_MAP_SHIFT) & WIRE_MAX_MAP);
+}
+
+bool wire_send_ack(FileDescriptor fd, int version) {
+  if (version == WIRE_V1) {
+    return true;
+  }
+  uint8_t ack = (uint8_t)version;
+  ssize_t written;
+  do {
+    written = write(fd, &ack, sizeof(ack));
+  } while (written < 0 && errno == EINTR);
+  return written == sizeof(ack);
+}
+
+static size_t __put_varint(uint8_t *out, uint32_t value) {
+  size_t n = 0;
+  while (value >= 0x80) {
+    out[n++] = (uint8_t)(value | 0x80);
+    value >>= 7;
+  }
+  out[n++] = (uint8_t)value;
+  return n;
+}
+
+// RES: the number of bytes read, 0 if 'in' ends in the middle of the varint,
+//      -1 if it is longer than 32 bits.
+static ssize_t __get_varint(const uint8_t *in, size_t len, uint32_t *value) {
+  *value = 0;
+  for (size_t i = 0; i < len; i++) {
+    if (i == 5) {
+      return -1;
+    }
+    *value |= (uint32_t)(in[i] & 0x7f) << (7 * i);
+    if ((in[i] & 0x80) == 0) {
+      return (ssize_t)i + 1;
+    }
+  }
+  return len >= 5 ? -1 : 0;
+}
+
+size_t wire_encode(int version, const union Message *msg, uint8_t *out) {
+  if (version == WIRE_V1) {
+    memcpy(out, msg, sizeof(union Message));
+    return sizeof(union Message);
+  }
+
+  size_t n = 1;
+  uint32_t nibble = 0;
+  switch (msg->msgt) {
+  case REGISTRATION:
+    nibble = msg->registration.player;
+    break;
+  case SPAWN:
+    nibble = msg->spawn.item;
+    n += __put_varint(out + n, msg->spawn.id);
+    n += __put_varint(out + n, msg->spawn.pos.x);
+    n += __put_varint(out + n, msg->spawn.pos.y);
+    break;
+  case MOVEMENT:
+    n += __put_varint(out + n, msg->movement.id);
+    n += __put_varint(out + n, msg->movement.pos.x);
+    n += __put_varint(out + n, msg->movement.pos.y);
+    break;
+  case EAT_FOOD:
+    n += __put_varint(out + n, msg->eat_food.eater);
+    n += __put_varint(out + n, msg->eat_food.food);
+    break;
+  case GAME_OVER:
+    nibble = msg->game_over.winner;
+    break;
+  }
+  out[0] = (uint8_t)(msg->msgt << 4 | (nibble & 0x0f));
+  return n;
+}
+
+uint8_t *wire_encode_all(int version, const union Message *msgs, size_t count,
+                         size_t *len) {
+  uint8_t *out = smalloc(count * WIRE_MAX_MESSAGE + 1);
+  *len = 0;
+  for (size_t i = 0; i < count; i++) {
+    *len += wire_encode(version, &msgs[i], out + *len);
+  }
+  return out;
+}
+
+size_t wire_send(FileDescriptor fd, int version, const union Message *msgs,
+                 size_t count) {
+  size_t len;
+  uint8_t *out = wire_encode_all(version, msgs, count, &len);
+  nwrite(fd, out, len);
+  free(out);
+  return len;
+}
+
+uint8_t *wire_encode_snapshot(const uint8_t *tiles, uint32_t width,
+                              uint32_t height, size_t *len) {
+  size_t size = (size_t)width * height;
+  size_t nb_runs = 0;
+  for (size_t i = 0; i < size; i++) {
+    if (i == 0 || tiles[i] != tiles[i - 1]) {
+      nb_runs++;
+    }
+  }
+
+  uint8_t *out = smalloc(1 + 3 * 5 + nb_runs * 5);
+  out[0] = WIRE_MAP_SNAPSHOT << 4;
+  *len = 1;
+  *len += __put_varint(out + *len, width);
+  *len += __put_varint(out + *len, height);
+  *len += __put_varint(out + *len, (uint32_t)nb_runs);
+  for (size_t i = 0; i < size;) {
+    size_t run = 1;
+    while (i + run < size && tiles[i + run] == tiles[i]) {
+      run++;
+    }
+    *len += __put_varint(out + *len,
+                         (uint32_t)run << WIRE_RUN_TILE_BITS | tiles[i]);
+    i += run;
+  }
+  return out;
+}
+
+bool wire_is_snapshot(int version, const uint8_t *in) {
+  return version >= WIRE_V3 && in[0] >> 4 == WIRE_MAP_SNAPSHOT;
+}
+
+ssize_t wire_decode_snapshot(const uint8_t *in, size_t len, uint8_t **tiles,
+                             uint32_t *width, uint32_t *height) {
+  uint32_t header[3];
+  size_t n = 1;
+  for (int i = 0; i < 3; i++) {
+    ssize_t used = __get_varint(in + n, len - n, &header[i]);
+    if (used <= 0) {
+      return used;
+    }
+    n += (size_t)used;
+  }
+  *width = header[0];
+  *height = header[1];
+  if (*width == 0 || *height == 0 || *width > MAX_WIDTH ||
+      *height > MAX_HEIGHT) {
+    return -1;
+  }
+
+  // The runs are only decoded once they have all been received.
+  size_t size = (size_t)*width * *height;
+  size_t start = n;
+  for (uint32_t i = 0; i < header[2]; i++) {
+    uint32_t run;
+    ssize_t used = __get_varint(in + n, len - n, &run);
+    if (used <= 0) {
+      return used;
+    }
+    n += (size_t)used;
+  }
+
+  *tiles = smalloc(size);
+  size_t filled = 0;
+  for (size_t i = start; i < n;) {
+    uint32_t run;
+    i += (size_t)__get_varint(in + i, n - i, &run);
+    size_t count = run >> WIRE_RUN_TILE_BITS;
+    if (count > size - filled) {
+      free(*tiles);
+      return -1;
+    }
+    memset(*tiles + filled, run & ((1 << WIRE_RUN_TILE_BITS) - 1), count);
+    filled += count;
+  }
+  if (filled != size) {
+    free(*tiles);
+    return -1;
+  }
+  return (ssize_t)n;
+}
+
+ssize_t wire_decode(int version, const uint8_t *in, size_t len,
+                    union Message *msg) {
+  if (version == WIRE_V1) {
+    if (len < sizeof(union Message)) {
+      return 0;
+    }
+    memcpy(msg, in, sizeof(union Message));
+    return sizeof(union Message);
+  }
+
+  if (len == 0) {
+    return 0;
+  }
+  memset(msg, 0, sizeof(*msg));
+  enum MessageType msgt = in[0] >> 4;
+  uint32_t nibble = in[0] & 0x0f;
+  uint32_t fields[3];
+  int nb_fields = 0;
+  switch (msgt) {
+  case REGISTRATION:
+  case GAME_OVER:
+    break;
+  case SPAWN:
+  case MOVEMENT:
+    nb_fields = 3;
+    break;
+  case EAT_FOOD:
+    nb_fields = 2;
+    break;
+  default:
+    return -1;
+  }
+
+  size_t n = 1;
+  for (int i = 0; i < nb_fields; i++) {
+    ssize_t used = __get_varint(in + n, len - n, &fields[i]);
+    if (used <= 0) {
+      return used;
+    }
+    n += (size_t)used;
+  }
+
+  msg->msgt = msgt;
+  switch (msgt) {
+  case REGISTRATION:
+    msg->registration.player = nibble;
+    break;
+  case SPAWN:
+    msg->spawn.item = (enum Item)nibble;
+    msg->spawn.id = fields[0];
+    msg->spawn.pos = (struct Position){fields[1], fields[2]};
+    break;
+  case MOVEMENT:
+    msg->movement.id = fields[0];
+    msg->movement.pos = (struct Position){fields[1], fields[2]};
+    break;
+  case EAT_FOOD:
+    msg->eat_food.eater = fields[0];
+    msg->eat_food.food = fields[1];
+    break;
+  case GAME_OVER:
+    msg->game_over.winner = nibble;
+    break;
+  }
+  return (ssize_t)n;
+}
@@ -0,0 +1,128 @@
+#ifndef WIRE_H
+#define WIRE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "game.h"
+
+/**
+ * Encodings of the messages sent by the server to the players.
+ *
+ * Version 1 is the legacy one: every message is a whole union Message (20
+ * bytes), which is also what the GUI (pas-cman-ipl) reads.
+ *
+ * Version 2 is a compact variable-length encoding. A message starts with the
+ * byte (msgt << 4) | nibble, where the nibble is the item of a SPAWN, the
+ * player of a REGISTRATION and the winner of a GAME_OVER (0 otherwise). It is
+ * followed by unsigned LEB128 varints:
+ *   SPAWN     id, x, y
+ *   MOVEMENT  id, x, y
+ *   EAT_FOOD  eater, food
+ * On a 30x20 map a SPAWN takes 4 or 5 bytes instead of 20.
+ *
+ * Version 3 encodes the messages like version 2 but replaces the spawn
+ * stream sent at the start of a match by a single MAP_SNAPSHOT message: the
+ * byte WIRE_MAP_SNAPSHOT << 4 followed by the varints width, height and
+ * number of runs, then one varint (length << 3 | tile) per run of identical
+ * tiles (see TILE_NONE in game.h), row by row. The player rebuilds the spawn
+ * stream from the tiles with load_tiles_buf, which yields exactly the
+ * messages the server would have sent.
+ *
+ * The version is negotiated with the REGISTRATION word sent by the player:
+ * its low 16 bits hold REGISTRATION, the next 8 bits the version it asks
+ * for (0 means version 1, so a legacy client is unaffected) and the 7 bits
+ * above the map it would like to play (1-based, 0 means any map). The server
+ * answers a version 2 or 3 registration with a single byte holding the version
+ * before anything else. A legacy server accepts any REGISTRATION word and
+ * sends the version 1 messages right away: they start with a REGISTRATION or
+ * SPAWN message, whose first byte (0 or 1) is never an answer, so the player
+ * keeps the connection in version 1. The key presses sent by the players are
+ * the same 4-byte ints in every version.
+ */
+
+#define WIRE_V1 1
+#define WIRE_V2 2
+#define WIRE_V3 3
+#define WIRE_VERSION_SHIFT 16
+#define WIRE_MAP_SHIFT 24
+// highest map preference a REGISTRATION word can carry
+#define WIRE_MAX_MAP 127
+
+// Message type of the map snapshot (version 3 only).
+#define WIRE_MAP_SNAPSHOT 5
+
+// Longest encoding of a message: the first byte and 3 varints of 32 bits.
+#define WIRE_MAX_MESSAGE (1 + 3 * 5)
+
+// The REGISTRATION word of a player asking for 'version' and the map 'map'
+// (0 for any map).
+int wire_registration_word(int version, int map);
+
+/**
+ * RES: the version asked for by the REGISTRATION word 'word', -1 if 'word'
+ *      is not a REGISTRATION or asks for an unknown version.
+ */
+int wire_parse_registration(int word);
+
+// RES: the map asked for by the REGISTRATION word 'word' (0 for any map).
+int wire_registration_map(int word);
+
+/**
+ * POST: the server answer to a registration in 'version' has been written on
+ *       'fd' (nothing for version 1).
+ * RES:  false if the player left.
+ */
+bool wire_send_ack(FileDescriptor fd, int version);
+
+/**
+ * PRE:  'out' can hold WIRE_MAX_MESSAGE bytes.
+ * RES:  the number of bytes of the encoding of 'msg' written in 'out'.
+ */
+size_t wire_encode(int version, const union Message *msg, uint8_t *out);
+
+/**
+ * RES: a malloc()ed buffer holding the encoding of the 'count' messages,
+ *      whose size is put in 'len'.
+ */
+uint8_t *wire_encode_all(int version, const union Message *msgs, size_t count,
+                         size_t *len);
+
+/**
+ * POST: the 'count' messages have been encoded and written on 'fd' in one
+ *       call.
+ * RES:  the number of bytes written.
+ */
+size_t wire_send(FileDescriptor fd, int version, const union Message *msgs,
+                 size_t count);
+
+/**
+ * RES: a malloc()ed MAP_SNAPSHOT message describing the 'width' x 'height'
+ *      'tiles', whose size is put in 'len'.
+ */
+uint8_t *wire_encode_snapshot(const uint8_t *tiles, uint32_t width,
+                              uint32_t height, size_t *len);
+
+// True if 'in' (not empty) starts with a MAP_SNAPSHOT message.
+bool wire_is_snapshot(int version, const uint8_t *in);
+
+/**
+ * RES: the number of bytes of 'in' used to decode the MAP_SNAPSHOT message,
+ *      whose tiles are put in '*tiles' (malloc()ed) and size in 'width' and
+ *      'height'; 0 if 'in' does not hold the whole message yet, -1 if it is
+ *      not a valid snapshot.
+ */
+ssize_t wire_decode_snapshot(const uint8_t *in, size_t len, uint8_t **tiles,
+                             uint32_t *width, uint32_t *height);
+
+/**
+ * PRE:  'in' does not start with a MAP_SNAPSHOT message.
+ * RES:  the number of bytes of 'in' used to decode 'msg', 0 if 'in' does not
+ *       hold a whole message yet, -1 if the bytes are not a valid message.
+ */
+ssize_t wire_decode(int version, const uint8_t *in, size_t len,
+                    union Message *msg);
+
+#endif // WIRE_H
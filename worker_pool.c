@@ -0,0 +1,300 @@
+// close_range()
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "common_fd.h"
+#include "metrics.h"
+#include "pm_exec_paths.h"
+#include "room.h"
+#include "room_segment.h"
+#include "utils_v3.h"
+#include "worker_pool.h"
+
+// The most descriptors a job comes with: the pipe, the player sockets and
+// the doorbell.
+#define JOB_MAX_FDS (NB_PLAYERS + 2)
+
+static pid_t __spawn_worker(const char *path, FileDescriptor *ctl) {
+  int sv[2];
+  checkNeg(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv),
+           "Error socketpair");
+  pid_t pid = sfork();
+  if (pid == 0) {
+    sdup2(sv[1], POOL_CONTROL_FD);
+    // the worker outlives matches and rooms: it must not hold any of their
+    // descriptors, nor the control sockets of the other workers. Only the
+    // counters stay, right below the control socket.
+    close_range(3, METRICS_FD - 1, 0);
+    if (!metrics_enabled()) {
+      close(METRICS_FD);
+    }
+    close_range(POOL_CONTROL_FD + 1, ~0U, 0);
+    sexecl(path, path, "-pool", (char *)NULL);
+    perror("Failed to exec a pooled worker");
+    exit(EXIT_FAILURE);
+  }
+  sclose(sv[1]);
+  *ctl = sv[0];
+  return pid;
+}
+
+void worker_pool_init(struct WorkerPool *pool, int size) {
+  pool->size = size;
+  pool->sets = size > 0 ? smalloc(size * sizeof(struct WorkerSet)) : NULL;
+  for (int s = 0; s < size; s++) {
+    struct WorkerSet *set = &pool->sets[s];
+    for (int w = 0; w < WORKERS_PER_SET; w++) {
+      set->pids[w] = __spawn_worker(
+          w == WORKER_BROADCASTER ? BROADCASTER_PATH : CLIENT_HANDLER_PATH,
+          &set->ctl[w]);
+      set->running[w] = false;
+    }
+    set->user = 0;
+    set->broken = false;
+  }
+}
+
+struct WorkerSet *worker_pool_acquire(struct WorkerPool *pool) {
+  for (int s = 0; s < pool->size; s++) {
+    struct WorkerSet *set = &pool->sets[s];
+    if (set->user == 0 && !set->broken) {
+      set->user = -1;
+      return set;
+    }
+  }
+  return NULL;
+}
+
+void worker_pool_release(struct WorkerSet *set) { set->user = 0; }
+
+bool worker_pool_reaped(struct WorkerPool *pool, pid_t pid, int wstatus) {
+  for (int s = 0; s < pool->size; s++) {
+    struct WorkerSet *set = &pool->sets[s];
+    if (set->user == pid) {
+      if (!WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != EXIT_SUCCESS) {
+        set->broken = true;
+      }
+      set->user = 0;
+    }
+    for (int w = 0; w < WORKERS_PER_SET; w++) {
+      if (set->pids[w] == pid) {
+        set->pids[w] = -1;
+        set->broken = true;
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+void worker_pool_free(struct WorkerPool *pool) {
+  for (int s = 0; s < pool->size; s++) {
+    for (int w = 0; w < WORKERS_PER_SET; w++) {
+      close(pool->sets[s].ctl[w]);
+    }
+  }
+  // workers already reaped (by a SIGCHLD handler) are skipped
+  for (int s = 0; s < pool->size; s++) {
+    for (int w = 0; w < WORKERS_PER_SET; w++) {
+      if (pool->sets[s].pids[w] > 0) {
+        waitpid(pool->sets[s].pids[w], NULL, 0);
+      }
+    }
+  }
+  free(pool->sets);
+  pool->sets = NULL;
+  pool->size = 0;
+}
+
+// Sends 'job' and its 'nfds' descriptors in a single message.
+static void __send_job(FileDescriptor ctl, const void *job, size_t len,
+                       const FileDescriptor *fds, int nfds) {
+  struct iovec iov = {.iov_base = (void *)job, .iov_len = len};
+  union {
+    char buf[CMSG_SPACE(JOB_MAX_FDS * sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  struct msghdr msg = {.msg_iov = &iov,
+                       .msg_iovlen = 1,
+                       .msg_control = control.buf,
+                       .msg_controllen = CMSG_SPACE(nfds * sizeof(int))};
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+  memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+  checkNeg(sendmsg(ctl, &msg, MSG_NOSIGNAL), "Error sendmsg to a worker");
+}
+
+static void __fill_ring(const struct RoomRing *ring, const char *segment_name,
+                        char *segment, bool *has_ring, size_t *offset,
+                        bool *actor) {
+  snprintf(segment, SHM_ARENA_NAME_MAX, "%s",
+           segment_name != NULL ? segment_name : "");
+  *has_ring = ring != NULL;
+  *offset = ring != NULL ? ring->offset : 0;
+  *actor = ring != NULL && ring->commands;
+}
+
+void worker_start_handler(struct WorkerSet *set, int player_no,
+                          FileDescriptor player, FileDescriptor pipe_write,
+                          const char *segment_name,
+                          const struct RoomRing *ring) {
+  struct HandlerJob job = {.player_no = player_no};
+  __fill_ring(ring, segment_name, job.segment, &job.ring, &job.ring_offset,
+              &job.actor);
+  FileDescriptor fds[] = {player, pipe_write,
+                          ring != NULL ? ring->doorbell : -1};
+  __send_job(set->ctl[player_no - 1], &job, sizeof(job), fds,
+             ring != NULL ? 3 : 2);
+  set->running[player_no - 1] = true;
+  metrics_add(METRIC_HANDLERS_STARTED, 1);
+}
+
+void worker_start_broadcaster(struct WorkerSet *set, FileDescriptor pipe_read,
+                              const FileDescriptor *players_fd,
+                              const int *wire_versions,
+                              const struct SendQueueConfig *sendq,
+                              int tick_ms, const struct RoomRing *ring) {
+  struct BroadcasterJob job = {.sendq = *sendq, .tick_ms = tick_ms};
+  memcpy(job.wire_versions, wire_versions, sizeof(job.wire_versions));
+  __fill_ring(ring, ring != NULL ? ring->segment_name : NULL, job.segment,
+              &job.ring, &job.ring_offset, &job.actor);
+  FileDescriptor fds[JOB_MAX_FDS];
+  int nfds = 0;
+  fds[nfds++] = pipe_read;
+  for (int i = 0; i < NB_PLAYERS; i++) {
+    fds[nfds++] = players_fd[i];
+  }
+  if (ring != NULL) {
+    fds[nfds++] = ring->doorbell;
+  }
+  __send_job(set->ctl[WORKER_BROADCASTER], &job, sizeof(job), fds, nfds);
+  set->running[WORKER_BROADCASTER] = true;
+}
+
+// Reads the answer of worker 'w', which is then idle. A worker which died
+// breaks its set.
+static void __worker_done(struct WorkerSet *set, int w) {
+  char done;
+  ssize_t n;
+  do {
+    n = read(set->ctl[w], &done, sizeof(done));
+  } while (n < 0 && errno == EINTR);
+  if (n <= 0) {
+    set->broken = true;
+    if (w != WORKER_BROADCASTER) {
+      metrics_add(METRIC_HANDLERS_FAILED, 1);
+    }
+  }
+  set->running[w] = false;
+}
+
+void worker_set_finish_match(struct WorkerSet *set,
+                             const FileDescriptor *players_fd,
+                             struct RoomSegment *segment) {
+  bool player_left = false;
+  while (!player_left && set->running[WORKER_BROADCASTER]) {
+    struct pollfd fds[WORKERS_PER_SET];
+    int index[WORKERS_PER_SET];
+    int nfds = 0;
+    for (int w = 0; w < WORKERS_PER_SET; w++) {
+      if (set->running[w]) {
+        index[nfds] = w;
+        fds[nfds++] = (struct pollfd){.fd = set->ctl[w], .events = POLLIN};
+      }
+    }
+    int ready = poll(fds, nfds, -1);
+    if (ready < 0 && errno == EINTR) {
+      continue;
+    }
+    checkNeg(ready, "Error poll");
+    for (int i = 0; i < nfds; i++) {
+      if (fds[i].revents == 0) {
+        continue;
+      }
+      __worker_done(set, index[i]);
+      // A handler which stopped because the game is over leaves the
+      // broadcaster the time to forward the GAME_OVER message. Any other
+      // reason (a player left) ends the match right away.
+      if (index[i] != WORKER_BROADCASTER) {
+        room_segment_lock(segment);
+        player_left =
+            player_left || !room_segment_state(segment)->game_over;
+        room_segment_unlock(segment);
+      }
+    }
+  }
+
+  for (int i = 0; i < NB_PLAYERS; i++) {
+    shutdown(players_fd[i], SHUT_RDWR);
+  }
+  for (int w = 0; w < WORKERS_PER_SET; w++) {
+    if (set->running[w]) {
+      __worker_done(set, w);
+    }
+  }
+}
+
+int worker_recv_job(void *job, size_t len, const FileDescriptor *targets,
+                    int max_fds) {
+  struct iovec iov = {.iov_base = job, .iov_len = len};
+  union {
+    char buf[CMSG_SPACE(JOB_MAX_FDS * sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  struct msghdr msg = {.msg_iov = &iov,
+                       .msg_iovlen = 1,
+                       .msg_control = control.buf,
+                       .msg_controllen = sizeof(control.buf)};
+  ssize_t n;
+  do {
+    n = recvmsg(POOL_CONTROL_FD, &msg, 0);
+  } while (n < 0 && errno == EINTR);
+  if (n <= 0) {
+    return -1;
+  }
+  if ((size_t)n != len) {
+    fprintf(stderr, "Invalid job received (%zd bytes)\n", n);
+    return -1;
+  }
+
+  FileDescriptor fds[JOB_MAX_FDS];
+  int nfds = 0;
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET &&
+      cmsg->cmsg_type == SCM_RIGHTS) {
+    nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    memcpy(fds, CMSG_DATA(cmsg), nfds * sizeof(int));
+  }
+  // The descriptors arrive on the lowest free numbers, which are the
+  // well-known ones: they are lifted out of the way before being moved.
+  for (int i = 0; i < nfds; i++) {
+    FileDescriptor lifted = fcntl(fds[i], F_DUPFD, POOL_CONTROL_FD + 1);
+    checkNeg(lifted, "Error fcntl F_DUPFD");
+    sclose(fds[i]);
+    fds[i] = lifted;
+  }
+  for (int i = 0; i < nfds; i++) {
+    if (i < max_fds) {
+      sdup2(fds[i], targets[i]);
+    }
+    sclose(fds[i]);
+  }
+  return nfds < max_fds ? nfds : max_fds;
+}
+
+void worker_job_done(void) {
+  char done = 1;
+  swrite(POOL_CONTROL_FD, &done, sizeof(done));
+}
@@ -0,0 +1,142 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "game.h"
+#include "send_queue.h"
+#include "shm_arena.h"
+
+/**
+ * A worker pool holds sets of client handlers and broadcasters forked and
+ * exec'ed once, at startup, instead of once per match. Each set serves one
+ * match at a time: its workers receive the sockets and pipe of the match
+ * through their control socket (SCM_RIGHTS) together with a job, serve the
+ * match exactly like the processes spawned for a single match, reset
+ * themselves and answer a "done" byte.
+ *
+ * A match is stopped by shutting the player sockets down, which ends the
+ * handlers (they read EOF) and the broadcaster (its sends fail): no worker
+ * is ever killed. A set whose worker died is broken and never handed out
+ * again, the match then falls back to fork+exec.
+ */
+
+struct RoomRing;
+struct RoomSegment;
+
+// Index of the broadcaster in the workers of a set, after the handlers.
+#define WORKER_BROADCASTER NB_PLAYERS
+#define WORKERS_PER_SET (NB_PLAYERS + 1)
+
+// What a pooled client handler is given for a match. The player socket, the
+// pipe write end and, with a ring, the doorbell come with it.
+struct HandlerJob {
+  int player_no;
+  char segment[SHM_ARENA_NAME_MAX];
+  bool ring;
+  size_t ring_offset;
+  bool actor;
+};
+
+// What a pooled broadcaster is given for a match. The pipe read end, the
+// player sockets and, with a ring, the doorbell come with it.
+struct BroadcasterJob {
+  struct SendQueueConfig sendq;
+  int tick_ms;
+  int wire_versions[NB_PLAYERS];
+  char segment[SHM_ARENA_NAME_MAX];
+  bool ring;
+  size_t ring_offset;
+  bool actor;
+};
+
+struct WorkerSet {
+  pid_t pids[WORKERS_PER_SET];
+  FileDescriptor ctl[WORKERS_PER_SET];
+  // true while the worker serves a match
+  bool running[WORKERS_PER_SET];
+  // process using the set (-1 while reserved, 0 if free)
+  volatile pid_t user;
+  volatile bool broken;
+};
+
+struct WorkerPool {
+  struct WorkerSet *sets;
+  int size;
+};
+
+/**
+ * POST: 'size' sets of workers have been started (none if 'size' is 0). The
+ *       workers only keep their control socket (POOL_CONTROL_FD) and the
+ *       standard streams.
+ */
+void worker_pool_init(struct WorkerPool *pool, int size);
+
+/**
+ * RES: a free set, now reserved (its 'user' is -1), NULL if every set is
+ *      busy or broken.
+ */
+struct WorkerSet *worker_pool_acquire(struct WorkerPool *pool);
+
+// POST: 'set' is free again (unless broken).
+void worker_pool_release(struct WorkerSet *set);
+
+/**
+ * To be called (from a SIGCHLD handler too) for every child reaped, with its
+ * wait status: frees the set used by 'pid', or marks broken the set 'pid'
+ * was a worker of. A set whose user did not exit cleanly is broken too: its
+ * workers may still be busy with the match.
+ * RES: true if 'pid' was a worker.
+ */
+bool worker_pool_reaped(struct WorkerPool *pool, pid_t pid, int wstatus);
+
+/**
+ * POST: the workers have been told to stop (their control sockets are
+ *       closed) and reaped.
+ */
+void worker_pool_free(struct WorkerPool *pool);
+
+/**
+ * POST: handler 'player_no' (1-based) of 'set' serves 'player' in the match
+ *       whose segment is 'segment_name', publishing on 'pipe_write' or in
+ *       'ring' (if not NULL).
+ */
+void worker_start_handler(struct WorkerSet *set, int player_no,
+                          FileDescriptor player, FileDescriptor pipe_write,
+                          const char *segment_name,
+                          const struct RoomRing *ring);
+
+// POST: the broadcaster of 'set' serves the match (see
+//       room_spawn_broadcaster).
+void worker_start_broadcaster(struct WorkerSet *set, FileDescriptor pipe_read,
+                              const FileDescriptor *players_fd,
+                              const int *wire_versions,
+                              const struct SendQueueConfig *sendq,
+                              int tick_ms, const struct RoomRing *ring);
+
+/**
+ * Waits until the match served by 'set' is over: the broadcaster is done,
+ * or a handler is done while the game is not over (a player left). The
+ * player sockets are then shut down and every worker of the set is waited
+ * for.
+ */
+void worker_set_finish_match(struct WorkerSet *set,
+                             const FileDescriptor *players_fd,
+                             struct RoomSegment *segment);
+
+/**
+ * Worker side.
+ * POST: the next job has been read from POOL_CONTROL_FD in 'job' ('len'
+ *       bytes) and the i-th descriptor received has been moved to
+ *       'targets[i]' (at most 'max_fds' of them).
+ * RES:  the number of descriptors received, -1 once the pool is closed.
+ */
+int worker_recv_job(void *job, size_t len, const FileDescriptor *targets,
+                    int max_fds);
+
+// Worker side. POST: the server knows the job is done.
+void worker_job_done(void);
+
+#endif // WORKER_POOL_H